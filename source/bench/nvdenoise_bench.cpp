@@ -0,0 +1,1347 @@
+/****************************************************************************/
+/* Engine benchmark and regression check									*/
+/*																			*/
+/* Benchmark (default): denoises seeded synthetic noisy images with every	*/
+/* engine over a sweep of resolutions, patch sizes, search sizes and		*/
+/* offsets and reports the throughput and the time of every stage.			*/
+/* --cutoff runs them with the fast weights (nvDenoiseSettings::			*/
+/* weight_cutoff), --pyramid with that many pyramid levels, --half 1 with	*/
+/* fp16 input on the OpenCL device.											*/
+/*																			*/
+/*	nvdenoise_bench [--sizes 256x256,512x512] [--patch 5,7] [--search 10,20]*/
+/*					[--offset 1,3] [--threads N] [--repeat N] [--cutoff W]	*/
+/*					[--engines brute,integral,symmetric,opencl]				*/
+/*					[--pyramid N] [--half 0|1] [-h|--help]					*/
+/*																			*/
+/* Regression check (--verify): compares every engine, every compiled in	*/
+/* SIMD kernel, regions, the streamed path, the temporal and the guided		*/
+/* filter against a straightforward double precision implementation of		*/
+/* the filter written down here, using PSNR and max error thresholds. The	*/
+/* fast weights must stay within their documented error bound. The			*/
+/* pyramid mode must remove grainy noise better than a single level and		*/
+/* give the same result streamed. The fp16 input of the OpenCL engine is	*/
+/* checked against the reference of the input rounded to fp16. Repeated		*/
+/* frames of the CPU engines must not allocate, neither pooled buffers nor	*/
+/* any other heap memory. A traced streamed frame has to report its copy	*/
+/* and filter stages with the pixels they moved. Returns 1 if any case		*/
+/* fails. The OpenCL engine is checked whenever a device is available, POCL	*/
+/* is enough on a machine without GPU. Each of its launch variants (direct	*/
+/* and tiled kernel, one or several slices) is forced once with either		*/
+/* border and fp32 or fp16 input. --require-opencl makes a missing device	*/
+/* a failure instead of skipping the engine.								*/
+/****************************************************************************/
+#include "../nvdenoise.h"
+#include "../nvtrace.h"
+#ifdef USE_OPENCL
+#include "../nvclruntime.h"
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace NAVIE_GLOBAL;
+
+namespace
+{
+	//heap allocations of the whole process, all threads
+	std::atomic<unsigned long long> g_heap_allocations(0);
+}
+
+void* operator new(size_t size)
+{
+	++g_heap_allocations;
+	if(void* memory = malloc(size ? size : 1))
+		return memory;
+	throw std::bad_alloc();
+}
+
+void operator delete(void* memory) noexcept					{ free(memory); }
+void operator delete(void* memory, size_t) noexcept			{ free(memory); }
+
+namespace
+{
+	/* Acceptance thresholds of --verify, on images with values in [0,1]. The vector kernels use a */
+	/* polynomial exp and OpenCL devices may use a less exact exp, both stay well below these */
+	const double VERIFY_MIN_PSNR		= 90.0;
+	const double VERIFY_MAX_ERROR		= 1e-4;
+
+	/* Fast weights of --verify, their error may exceed the bound of nvdenoise.h by float rounding only */
+	const float VERIFY_WEIGHT_CUTOFF	= 1e-3f;
+	const double VERIFY_MAX_BOUND_EXCESS	= 1e-5;
+
+	/* Adaptive mode of --verify: relative error of the noise estimate on the smooth test image, and */
+	/* the PSNR its filter may lose against the fixed h on the noisiest part */
+	const double VERIFY_MAX_SIGMA_ERROR		= 0.15;
+	const double VERIFY_MAX_ADAPTIVE_LOSS	= 0.5;
+
+	/* Smooth shapes plus gaussian noise of strength sigma, the same for every seed. A grain > 0 blurs */
+	/* the noise over 2 * grain + 1 pixels at the same strength, the low frequency noise of the */
+	/* pyramid mode, and without edges only the smooth shapes remain. Planes after the color get */
+	/* noise free guide features: the edges, a tilted normal and a depth ramp */
+	void make_noisy_image(nvImage& image, int width, int height, unsigned seed, int channels = 3, float sigma = 0.08f, int grain = 0, bool edges = true)
+	{
+		image.resize(width, height, channels);
+
+		std::mt19937 rng(seed);
+		std::normal_distribution<float> normal(0.0f, 1.0f);
+		std::vector<float> noise(size_t(width) * height), blurred(noise.size());
+		for(int dim = 0; dim < 3; ++dim)
+		{
+			for(size_t i = 0; i < noise.size(); ++i)
+				noise[i] = normal(rng);
+
+			//separable box filter, scaled back to unit strength
+			for(int pass = 0; pass < 2 && grain > 0; ++pass)
+			{
+				const int step = pass == 0 ? 1 : width;
+				const int count = pass == 0 ? width : height;
+				for(int y = 0; y < height; ++y)
+				{
+					for(int x = 0; x < width; ++x)
+					{
+						const int i = pass == 0 ? x : y;
+						const size_t first = size_t(y) * width + x - size_t(i) * step;
+						float sum = 0.0f;
+						for(int k = i - grain; k <= i + grain; ++k)
+							sum += noise[first + size_t(std::min(std::max(k, 0), count - 1)) * step];
+						blurred[size_t(y) * width + x] = sum / std::sqrt(float(2 * grain + 1));
+					}
+				}
+				noise.swap(blurred);
+			}
+
+			for(int y = 0; y < height; ++y)
+			{
+				float* row = image.row(dim, y);
+				for(int x = 0; x < width; ++x)
+				{
+					const float edge = edges && (x * 3 + y * 2) % 97 < 48 ? 0.25f : 0.0f;
+					const float value = 0.4f + edge + 0.2f * std::sin(0.05f * x * (dim + 1)) * std::cos(0.04f * y) + sigma * noise[size_t(y) * width + x];
+					row[x] = std::min(1.0f, std::max(0.0f, value));
+				}
+			}
+		}
+
+		for(int plane = 3; plane < channels; ++plane)
+		{
+			for(int y = 0; y < height; ++y)
+			{
+				float* row = image.row(plane, y);
+				for(int x = 0; x < width; ++x)
+				{
+					const float edge = (x * 3 + y * 2) % 97 < 48 ? 0.25f : 0.0f;
+					row[x] = plane % 3 == 0 ? 0.4f + edge : plane % 3 == 1 ? std::sin(0.03f * (x + plane * y)) : float(y) / height;
+				}
+			}
+		}
+	}
+
+	/* The filter as written in the paper, in double precision. Candidates and patch samples outside */
+	/* the image are skipped, like in the engines. The candidates come from all frames, the first */
+	/* one is denoised. The weights are always exact, fast_bound receives the error bound of the */
+	/* fast weights of settings.weight_cutoff */
+	void reference_nlm(const nvDenoiseSettings& settings, const std::vector<const nvImage*>& frames, nvImage& denoised, nvImage* fast_bound = nullptr)
+	{
+		const nvImage& noisy = *frames[0];
+		const int width		= noisy.width();
+		const int height	= noisy.height();
+		const int ph		= (settings.patch_size - 1) / 2;
+		const int sh		= (settings.search_size - 1) / 2;
+		const double h2		= 2.0 * settings.h * settings.h;
+
+		//weighted squared differences of the guide planes add to the distance of every channel
+		float guide_weights[NLM_MAX_GUIDE_PLANES];
+		const int guides = nvNLMdenoiser::guide_planes(settings, guide_weights);
+
+		denoised.resize(width, height, 3);
+		if(fast_bound)
+			fast_bound->resize(width, height, 3);
+		for(int dim = 0; dim < 3; ++dim)
+		{
+			for(int y = 0; y < height; ++y)
+			{
+				for(int x = 0; x < width; ++x)
+				{
+					double sum = 0.0, norm = 0.0;
+					double low = HUGE_VAL, high = -HUGE_VAL;
+					int candidates = 0;
+					for(size_t f = 0; f < frames.size(); ++f)
+					for(int j = 0; j < settings.search_size; j += settings.search_offset)
+					{
+						for(int i = 0; i < settings.search_size; i += settings.search_offset)
+						{
+							const int qx = x + i - sh, qy = y + j - sh;
+							if(qx < 0 || qy < 0 || qx >= width || qy >= height)
+								continue;
+
+							double distance = 0.0;
+							for(int b = -ph; b < settings.patch_size - ph; ++b)
+							{
+								for(int a = -ph; a < settings.patch_size - ph; ++a)
+								{
+									const int px = x + a, py = y + b, sx = qx + a, sy = qy + b;
+									if(px < 0 || py < 0 || px >= width || py >= height || sx < 0 || sy < 0 || sx >= width || sy >= height)
+										continue;
+									const double diff = double(noisy.at(dim, px, py)) - frames[f]->at(dim, sx, sy);
+									distance += diff * diff;
+									for(int g = 0; g < guides; ++g)
+									{
+										const double guide_diff = double(noisy.at(3 + g, px, py)) - frames[f]->at(3 + g, sx, sy);
+										distance += guide_weights[g] * guide_diff * guide_diff;
+									}
+								}
+							}
+
+							const double weight = std::exp(-distance / h2);
+							const double value = frames[f]->at(dim, qx, qy);
+							sum		+= weight * value;
+							norm	+= weight;
+							low		= std::min(low, value);
+							high	= std::max(high, value);
+							++candidates;
+						}
+					}
+					denoised.at(dim, x, y) = float(sum / norm);
+					if(fast_bound)
+						fast_bound->at(dim, x, y) = float((candidates * settings.weight_cutoff / norm + 4e-7) * (high - low));
+				}
+			}
+		}
+	}
+
+	struct nvError
+	{
+		double psnr;
+		double max_error;
+	};
+
+	nvError compare(const nvImage& reference, const nvImage& image)
+	{
+		double squared = 0.0, max_error = 0.0;
+		for(int dim = 0; dim < 3; ++dim)
+		{
+			for(int y = 0; y < reference.height(); ++y)
+			{
+				for(int x = 0; x < reference.width(); ++x)
+				{
+					const double diff = std::fabs(double(reference.at(dim, x, y)) - image.at(dim, x, y));
+					squared += diff * diff;
+					//a NaN counts as an infinite error
+					max_error = diff == diff ? std::max(max_error, diff) : HUGE_VAL;
+				}
+			}
+		}
+
+		const double mse = squared / (3.0 * reference.width() * reference.height());
+		nvError error;
+		error.psnr		= mse > 0.0 ? 10.0 * std::log10(1.0 / mse) : HUGE_VAL;
+		error.max_error	= max_error;
+		return error;
+	}
+
+	/* Largest amount by which the error of image exceeds the per pixel bound, <= 0 if it is within */
+	double bound_excess(const nvImage& reference, const nvImage& image, const nvImage& bound)
+	{
+		double excess = -HUGE_VAL;
+		for(int dim = 0; dim < 3; ++dim)
+		{
+			for(int y = 0; y < reference.height(); ++y)
+			{
+				for(int x = 0; x < reference.width(); ++x)
+				{
+					const double diff = std::fabs(double(reference.at(dim, x, y)) - image.at(dim, x, y)) - bound.at(dim, x, y);
+					excess = diff == diff ? std::max(excess, diff) : HUGE_VAL;
+				}
+			}
+		}
+		return excess;
+	}
+
+	/* The rect of image */
+	void crop(const nvImage& image, const nvRect& rect, nvImage& part)
+	{
+		part.resize(rect.width, rect.height, 3);
+		for(int dim = 0; dim < 3; ++dim)
+			for(int y = 0; y < rect.height; ++y)
+				std::copy(image.row(dim, rect.y + y) + rect.x, image.row(dim, rect.y + y) + rect.x + rect.width, part.row(dim, y));
+	}
+
+	/* Rounds every sample to fp16 and back, the input the OpenCL engine reads with half_input */
+	void round_to_half(const nvImage& image, nvImage& rounded)
+	{
+		rounded.resize(image.width(), image.height(), image.channels());
+		for(int dim = 0; dim < image.channels(); ++dim)
+			for(int y = 0; y < image.height(); ++y)
+				for(int x = 0; x < image.width(); ++x)
+					rounded.row(dim, y)[x] = nv_half_to_float(nv_float_to_half(image.row(dim, y)[x]));
+	}
+
+	/* Streams the region of noisy through the denoiser in bands of one tile, streamed receives the region */
+	void stream(nvNLMdenoiser& denoiser, const nvDenoiseSettings& settings, const nvImage& noisy, const nvRect& region, nvImage& streamed)
+	{
+		streamed.resize(region.width, region.height, 3);
+		denoiser.denoise_streamed(settings, noisy.width(), noisy.height(), region, 1,
+			[&](int x, int y, int count, nvImage& image, int image_row)
+			{
+				for(int dim = 0; dim < noisy.channels(); ++dim)
+					for(int i = 0; i < count; ++i)
+						std::copy(noisy.row(dim, y + i) + x, noisy.row(dim, y + i) + x + image.width(), image.row(dim, image_row + i));
+				return true;
+			},
+			[&](int x, int y, int count, const nvImage& image, int image_row)
+			{
+				for(int dim = 0; dim < 3; ++dim)
+					for(int i = 0; i < count; ++i)
+						std::copy(image.row(dim, image_row + i), image.row(dim, image_row + i) + image.width(), streamed.row(dim, y - region.y + i) + x - region.x);
+				return true;
+			});
+	}
+
+	bool opencl_available()
+	{
+#ifdef USE_OPENCL
+		nvCLRuntime& cl = *nvCLRuntime::shared();
+		std::lock_guard<std::mutex> lock(cl.mutex());
+		return cl.initialize();
+#else
+		return false;
+#endif
+	}
+
+	const char* engine_name(int engine)
+	{
+		switch(engine)
+		{
+			case NLM_ENGINE_INTEGRAL:	return "integral";
+			case NLM_ENGINE_SYMMETRIC:	return "symmetric";
+			case NLM_ENGINE_OPENCL:		return "opencl";
+			default:					return "brute";
+		}
+	}
+
+	/* Splits "a,b,c" */
+	std::vector<std::string> split(const char* list)
+	{
+		std::vector<std::string> items;
+		std::string item;
+		for(const char* c = list; ; ++c)
+		{
+			if(*c == ',' || *c == 0)
+			{
+				if(!item.empty())
+					items.push_back(item);
+				item.clear();
+				if(*c == 0)
+					break;
+			}
+			else
+				item += *c;
+		}
+		return items;
+	}
+
+	std::vector<int> split_ints(const char* list)
+	{
+		std::vector<int> values;
+		const std::vector<std::string> items = split(list);
+		for(size_t i = 0; i < items.size(); ++i)
+			values.push_back(atoi(items[i].c_str()));
+		return values;
+	}
+
+	/****************************************************************************/
+	/* --verify																	*/
+	/****************************************************************************/
+
+	/* Frames the plugin would denoise over and over with every CPU engine: whole, streamed region, pyramid */
+	/* and temporal. After one round has sized the buffers, the second may not allocate anything. Returns */
+	/* the number of failures */
+	int verify_steady_state(int threads)
+	{
+		const int width = 160, height = 120;
+		nvDenoiseSettings settings;
+		settings.h				= 0.4f;
+		settings.patch_size		= 7;
+		settings.search_size	= 20;
+		settings.search_offset	= 3;
+		settings.threads		= threads;
+		settings.isa			= NLM_ISA_AUTO;
+		settings.fallback_engine	= NLM_ENGINE_BRUTEFORCE;
+		settings.temporal_radius	= 0;
+		settings.albedo_weight	= 1.0f;
+		settings.normal_weight	= 0.0f;
+		settings.depth_weight	= 1.0f;
+		settings.weight_cutoff	= 0.0f;
+		settings.pyramid_levels	= 0;
+		settings.half_input		= 0;
+		settings.adaptive		= 0;
+		settings.edge_mode		= NLM_EDGE_SKIP;
+		settings.noise_floor	= 0.0f;
+
+		const int channels = nvNLMdenoiser::image_channels(settings);
+		nvImage noisy;
+		make_noisy_image(noisy, width, height, 4000, channels);
+		nvFrameRing ring(3);
+		for(int f = 0; f < 3; ++f)
+			make_noisy_image(ring.insert(f), width, height, unsigned(4001 + f), channels);
+		const nvRect roi	= { 0, 0, width, height };
+		const nvRect region	= { 37, 29, 61, 43 };
+
+		int failures = 0;
+		const int engines[] = { NLM_ENGINE_BRUTEFORCE, NLM_ENGINE_INTEGRAL, NLM_ENGINE_SYMMETRIC };
+		for(size_t e = 0; e < sizeof(engines) / sizeof(engines[0]); ++e)
+		{
+			settings.engine = engines[e];
+			nvDenoiseSettings pyramid_settings = settings;
+			pyramid_settings.pyramid_levels = 3;
+			nvDenoiseSettings temporal_settings = settings;
+			temporal_settings.temporal_radius = 1;
+
+			nvNLMdenoiser denoiser;
+			nvImage denoised, streamed, pyramid, temporal;
+			unsigned long long heap = 0, pool = 0;
+			for(int round = 0; round < 2; ++round)
+			{
+				const unsigned long long heap_start	= g_heap_allocations;
+				const unsigned long long pool_start	= nv_pool_counters().allocations;
+
+				denoiser.denoise(settings, noisy, denoised, roi);
+				stream(denoiser, settings, noisy, region, streamed);
+				denoiser.denoise(pyramid_settings, noisy, pyramid, roi);
+				denoiser.denoise_temporal(temporal_settings, ring, 1, temporal, roi);
+
+				heap	= g_heap_allocations - heap_start;
+				pool	= nv_pool_counters().allocations - pool_start;
+			}
+
+			const bool ok = heap == 0 && pool == 0;
+			printf("%-4s steady state %-9s heap allocations %llu  pool allocations %llu\n", ok ? "ok" : "FAIL", engine_name(settings.engine), heap, pool);
+			if(!ok)
+				++failures;
+		}
+		return failures;
+	}
+
+	/* A streamed region and a temporal frame with tracing on: the frame summary has to hold the copies */
+	/* and the filter with the pixels of the region, and nothing may be recorded once tracing is off. */
+	/* Returns the number of failures */
+	int verify_trace(int threads)
+	{
+#ifdef USE_TRACE
+		const int width = 160, height = 120;
+		nvDenoiseSettings settings;
+		settings.h				= 0.4f;
+		settings.patch_size		= 7;
+		settings.search_size	= 20;
+		settings.search_offset	= 3;
+		settings.engine			= NLM_ENGINE_INTEGRAL;
+		settings.threads		= threads;
+		settings.isa			= NLM_ISA_AUTO;
+		settings.fallback_engine	= NLM_ENGINE_BRUTEFORCE;
+		settings.temporal_radius	= 0;
+		settings.albedo_weight	= 0.0f;
+		settings.normal_weight	= 0.0f;
+		settings.depth_weight	= 0.0f;
+		settings.weight_cutoff	= 0.0f;
+		settings.pyramid_levels	= 0;
+		settings.half_input		= 0;
+		settings.adaptive		= 0;
+		settings.edge_mode		= NLM_EDGE_SKIP;
+		settings.noise_floor	= 0.0f;
+
+		nvImage noisy, streamed, temporal;
+		make_noisy_image(noisy, width, height, 5000, 3);
+		nvFrameRing ring(3);
+		for(int f = 0; f < 3; ++f)
+			make_noisy_image(ring.insert(f), width, height, unsigned(5001 + f), 3);
+		const nvRect roi	= { 0, 0, width, height };
+		const nvRect region	= { 37, 29, 61, 43 };
+		const unsigned long long region_pixels = (unsigned long long)region.width * region.height;
+
+		nvTrace& trace = nvTrace::instance();
+		trace.set_log_frames(false);
+		trace.enable();
+
+		nvNLMdenoiser denoiser;
+		nvTraceFrame frame;
+		stream(denoiser, settings, noisy, region, streamed);
+		bool ok = trace.last_frame(frame) && frame.number == -1 && frame.seconds > 0.0;
+		const nvTraceStage* copy_in		= ok ? frame.stage("copy in") : nullptr;
+		const nvTraceStage* filter		= ok ? frame.stage("filter") : nullptr;
+		const nvTraceStage* copy_out	= ok ? frame.stage("copy out") : nullptr;
+		ok = copy_in && filter && copy_out && copy_in->pixels > region_pixels && filter->pixels == region_pixels &&
+			 copy_out->pixels == region_pixels && copy_out->bytes == region_pixels * 3 * sizeof(float) &&
+			 copy_in->seconds + filter->seconds + copy_out->seconds <= frame.seconds;
+
+		nvDenoiseSettings temporal_settings = settings;
+		temporal_settings.temporal_radius = 1;
+		denoiser.denoise_temporal(temporal_settings, ring, 1, temporal, roi);
+		ok = ok && trace.last_frame(frame) && frame.number == 1 && frame.stage("filter");
+
+		//off again, the next frame leaves nothing behind
+		trace.disable();
+		trace.clear();
+		stream(denoiser, settings, noisy, region, streamed);
+		ok = ok && !trace.last_frame(frame);
+		trace.set_log_frames(true);
+
+		printf("%-4s trace stages copy in, filter, copy out of a streamed region and a temporal frame\n", ok ? "ok" : "FAIL");
+		return ok ? 0 : 1;
+#else
+		(void)threads;
+		return 0;
+#endif
+	}
+
+	/* Thread pool restarted between jobs with different thread counts, every tile has to run exactly */
+	/* once and new workers may not join the job of the pool they replace. Returns the number of failures */
+	int verify_pool_restart(int threads)
+	{
+		const int size = 1024;
+		const nvRect area = { 0, 0, size, size };
+		const int counts[] = { threads > 1 ? threads : 4, 3, 4, 3 };
+
+		nvThreadPool pool(1);
+		std::vector<unsigned char> hits;
+		bool ok = true;
+		for(size_t r = 0; r < sizeof(counts) / sizeof(counts[0]); ++r)
+		{
+			pool.set_threads(counts[r]);
+			hits.assign(size_t(size) * size, 0);
+			pool.parallel_tiles(area, 1, 1, [&](const nvRect& tile, int) { ++hits[size_t(tile.y) * size + tile.x]; });
+			ok = ok && std::count(hits.begin(), hits.end(), 1) == size * size;
+		}
+
+		printf("%-4s thread pool restarts %d, %d, %d, %d workers over %dx%d tiles\n", ok ? "ok" : "FAIL", counts[0], counts[1], counts[2], counts[3], size, size);
+		return ok ? 0 : 1;
+	}
+
+	/* Without an OpenCL device the OpenCL engine has to run the fallback engine, whole frames and */
+	/* streamed regions alike, instead of leaving the output unfiltered. Returns the number of failures */
+	int verify_fallback(int threads, bool opencl)
+	{
+		if(opencl)
+			return 0;
+
+		const int width = 96, height = 80;
+		nvImage noisy;
+		make_noisy_image(noisy, width, height, 8000);
+		const nvRect roi	= { 0, 0, width, height };
+		const nvRect region	= { 37, 29, 41, 33 };
+
+		nvDenoiseSettings settings;
+		settings.h				= 0.4f;
+		settings.patch_size		= 7;
+		settings.search_size	= 20;
+		settings.search_offset	= 3;
+		settings.engine			= NLM_ENGINE_INTEGRAL;
+		settings.fallback_engine	= NLM_ENGINE_INTEGRAL;
+		settings.threads		= threads;
+		settings.isa			= NLM_ISA_AUTO;
+		settings.temporal_radius	= 0;
+		settings.albedo_weight	= 0.0f;
+		settings.normal_weight	= 0.0f;
+		settings.depth_weight	= 0.0f;
+		settings.weight_cutoff	= 0.0f;
+		settings.pyramid_levels	= 0;
+		settings.half_input		= 0;
+		settings.adaptive		= 0;
+		settings.edge_mode		= NLM_EDGE_SKIP;
+		settings.noise_floor	= 0.0f;
+
+		nvNLMdenoiser denoiser;
+		nvImage expected, expected_region;
+		denoiser.denoise(settings, noisy, expected, roi);
+		stream(denoiser, settings, noisy, region, expected_region);
+
+		settings.engine = NLM_ENGINE_OPENCL;
+		nvImage denoised, streamed;
+		denoiser.denoise(settings, noisy, denoised, roi);
+		stream(denoiser, settings, noisy, region, streamed);
+
+		const double error = std::max(compare(expected, denoised).max_error, compare(expected_region, streamed).max_error);
+		const bool ok = error == 0.0;
+		printf("%-4s opencl without a device runs the integral engine, error %.1e\n", ok ? "ok" : "FAIL", error);
+		return ok ? 0 : 1;
+	}
+
+	/* Pyramid mode of every engine on grainy noise over smooth shapes: it has to beat a single level */
+	/* against the clean image, and a region or the streamed image may only differ by float rounding. Returns the */
+	/* number of failures */
+	int verify_pyramid(int threads, bool opencl)
+	{
+		const int width = 160, height = 120, grain = 3;
+		nvImage clean, noisy;
+		make_noisy_image(clean, width, height, 3000, 3, 0.0f, 0, false);
+		make_noisy_image(noisy, width, height, 3000, 3, 0.08f, grain, false);
+		const nvRect roi		= { 0, 0, width, height };
+		const nvRect region		= { 37, 29, 61, 43 };
+
+		nvDenoiseSettings settings;
+		settings.h				= 0.4f;
+		settings.patch_size		= 7;
+		settings.search_size	= 20;
+		settings.search_offset	= 3;
+		settings.threads		= threads;
+		settings.isa			= NLM_ISA_AUTO;
+		settings.fallback_engine	= NLM_ENGINE_BRUTEFORCE;
+		settings.temporal_radius	= 0;
+		settings.albedo_weight	= 0.0f;
+		settings.normal_weight	= 0.0f;
+		settings.depth_weight	= 0.0f;
+		settings.weight_cutoff	= 0.0f;
+		settings.half_input		= 0;
+		settings.adaptive		= 0;
+		settings.edge_mode		= NLM_EDGE_SKIP;
+		settings.noise_floor	= 0.0f;
+
+		int failures = 0;
+		const int engines[] = { NLM_ENGINE_BRUTEFORCE, NLM_ENGINE_INTEGRAL, NLM_ENGINE_SYMMETRIC, NLM_ENGINE_OPENCL };
+		for(size_t e = 0; e < sizeof(engines) / sizeof(engines[0]); ++e)
+		{
+			settings.engine = engines[e];
+			if(settings.engine == NLM_ENGINE_OPENCL && !opencl)
+				continue;
+
+			nvNLMdenoiser denoiser;
+			nvImage single, pyramid;
+			settings.pyramid_levels = 0;
+			denoiser.denoise(settings, noisy, single, roi);
+			settings.pyramid_levels = 3;
+			denoiser.denoise(settings, noisy, pyramid, roi);
+
+			const double noisy_psnr		= compare(clean, noisy).psnr;
+			const double single_psnr	= compare(clean, single).psnr;
+			const double pyramid_psnr	= compare(clean, pyramid).psnr;
+			bool ok = pyramid_psnr > single_psnr;
+
+			//a region of the image
+			nvImage part, expected;
+			denoiser.denoise(settings, noisy, part, region);
+			crop(pyramid, region, expected);
+			const double region_error = compare(expected, part).max_error;
+			ok = ok && region_error <= VERIFY_MAX_ERROR;
+
+			double stream_error = 0.0;
+			if(settings.engine != NLM_ENGINE_OPENCL)
+			{
+				nvImage streamed, streamed_region;
+				stream(denoiser, settings, noisy, roi, streamed);
+				stream(denoiser, settings, noisy, region, streamed_region);
+				stream_error = std::max(compare(pyramid, streamed).max_error, compare(part, streamed_region).max_error);
+				ok = ok && stream_error <= VERIFY_MAX_ERROR;
+			}
+
+			printf("%-4s %3dx%-3d pyramid 3 grain %d %-9s noisy %5.1f dB  single level %5.1f dB  pyramid %5.1f dB  region %.1e  stream %.1e\n",
+				   ok ? "ok" : "FAIL", width, height, grain, engine_name(settings.engine), noisy_psnr, single_psnr, pyramid_psnr, region_error, stream_error);
+			if(!ok)
+				++failures;
+		}
+		return failures;
+	}
+
+	/* Mean estimated sigma of the cells whose pixels and margins lie in the columns [x0,x1) */
+	double mean_sigma(const nvNoiseMap& map, int x0, int x1)
+	{
+		double sum = 0.0;
+		int count = 0;
+		for(int cy = 0; cy < map.rows; ++cy)
+		{
+			for(int cx = 0; cx < map.cols; ++cx)
+			{
+				const int x = (map.x0 + cx) * NLM_NOISE_CELL;
+				if(x - NLM_NOISE_MARGIN >= x0 && x + NLM_NOISE_CELL + NLM_NOISE_MARGIN <= x1)
+				{
+					sum += map.cells[cy * map.cols + cx].sigma;
+					++count;
+				}
+			}
+		}
+		return count ? sum / count : 0.0;
+	}
+
+	/* Share of the candidate comparisons the cells of map skip */
+	double skipped_share(const nvNoiseMap& map)
+	{
+		const size_t offsets = map.axis[NLM_NOISE_FULL].size();
+		double compared = 0.0;
+		for(size_t c = 0; c < map.cells.size(); ++c)
+		{
+			const int level = map.cells[c].level;
+			if(level == NLM_NOISE_CLEAN)
+				continue;
+			const double used = double(std::count(map.axis[level].begin(), map.axis[level].end(), 1));
+			compared += used * used / double(offsets * offsets);
+		}
+		return 1.0 - compared / double(map.cells.size());
+	}
+
+	/* Noise adaptive mode on an image with a clean, a lightly and a strongly noisy third: the estimate */
+	/* of the noisy thirds, the clean third left as it is, the quality of the noisiest one, engines, */
+	/* regions and streamed bands agreeing. Returns the number of failures */
+	int verify_adaptive(int threads, bool opencl)
+	{
+		const int width = 192, height = 96;
+		const float light = 0.02f, strong = 0.08f;
+		nvImage clean, noisy, mixed;
+		make_noisy_image(clean, width, height, 6000, 3, 0.0f, 0, false);
+		make_noisy_image(noisy, width, height, 6000, 3, strong, 0, false);
+		mixed.resize(width, height, 3);
+		for(int dim = 0; dim < 3; ++dim)
+		{
+			for(int y = 0; y < height; ++y)
+			{
+				for(int x = 0; x < width; ++x)
+				{
+					const float c = clean.at(dim, x, y), n = noisy.at(dim, x, y);
+					mixed.at(dim, x, y) = x < width / 3 ? c : x < 2 * width / 3 ? c + (n - c) * (light / strong) : n;
+				}
+			}
+		}
+		const nvRect roi	= { 0, 0, width, height };
+		const nvRect region	= { 45, 21, 101, 53 };
+		const nvRect strong_part	= { 2 * width / 3, 0, width / 3, height };
+
+		nvDenoiseSettings settings;
+		settings.h				= 0.4f;
+		settings.patch_size		= 7;
+		settings.search_size	= 20;
+		settings.search_offset	= 3;
+		settings.threads		= threads;
+		settings.isa			= NLM_ISA_AUTO;
+		settings.fallback_engine	= NLM_ENGINE_BRUTEFORCE;
+		settings.temporal_radius	= 0;
+		settings.albedo_weight	= 0.0f;
+		settings.normal_weight	= 0.0f;
+		settings.depth_weight	= 0.0f;
+		settings.weight_cutoff	= 0.0f;
+		settings.pyramid_levels	= 0;
+		settings.half_input		= 0;
+		settings.adaptive		= 1;
+		settings.noise_floor	= 0.01f;
+		settings.edge_mode		= NLM_EDGE_SKIP;
+
+		int failures = 0;
+		nvImage reference;
+		const int engines[] = { NLM_ENGINE_BRUTEFORCE, NLM_ENGINE_INTEGRAL, NLM_ENGINE_SYMMETRIC, NLM_ENGINE_OPENCL };
+		for(size_t e = 0; e < sizeof(engines) / sizeof(engines[0]); ++e)
+		{
+			settings.engine = engines[e];
+			if(settings.engine == NLM_ENGINE_OPENCL && !opencl)
+				continue;
+
+			nvNLMdenoiser denoiser;
+			nvImage adaptive, fixed;
+			nvDenoiseSettings fixed_settings = settings;
+			fixed_settings.adaptive = 0;
+			denoiser.denoise(fixed_settings, mixed, fixed, roi);
+			const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			denoiser.denoise(settings, mixed, adaptive, roi);
+			const double adaptive_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+			//the estimate of the noisy thirds
+			const nvNoiseMap& map = denoiser.noise_map();
+			const double light_sigma	= mean_sigma(map, width / 3, 2 * width / 3);
+			const double strong_sigma	= mean_sigma(map, 2 * width / 3, width);
+			bool ok = std::fabs(light_sigma / light - 1.0) <= VERIFY_MAX_SIGMA_ERROR && std::fabs(strong_sigma / strong - 1.0) <= VERIFY_MAX_SIGMA_ERROR;
+			const double skipped = skipped_share(map);
+
+			//the clean third, without the cells whose margin sees the noise, stays as it is
+			const nvRect clean_part = { 0, 0, width / 3 - NLM_NOISE_CELL, height };
+			nvImage clean_input, clean_output;
+			crop(mixed, clean_part, clean_input);
+			crop(adaptive, clean_part, clean_output);
+			ok = ok && compare(clean_input, clean_output).max_error == 0.0;
+
+			//the noisiest third is filtered about as well as with the fixed h
+			nvImage strong_clean, strong_adaptive, strong_fixed;
+			crop(clean, strong_part, strong_clean);
+			crop(adaptive, strong_part, strong_adaptive);
+			crop(fixed, strong_part, strong_fixed);
+			const double adaptive_psnr	= compare(strong_clean, strong_adaptive).psnr;
+			const double fixed_psnr		= compare(strong_clean, strong_fixed).psnr;
+			ok = ok && adaptive_psnr >= fixed_psnr - VERIFY_MAX_ADAPTIVE_LOSS;
+
+			//all engines agree with the first one
+			double engine_error = 0.0;
+			if(e == 0)
+				reference = adaptive;
+			else
+				engine_error = compare(reference, adaptive).max_error;
+			ok = ok && engine_error <= VERIFY_MAX_ERROR;
+
+			//a region and streamed bands see the same cells
+			nvImage part, expected;
+			denoiser.denoise(settings, mixed, part, region);
+			crop(adaptive, region, expected);
+			const double region_error = compare(expected, part).max_error;
+			ok = ok && region_error <= VERIFY_MAX_ERROR;
+
+			double stream_error = 0.0;
+			if(settings.engine != NLM_ENGINE_OPENCL)
+			{
+				nvImage streamed, streamed_region;
+				stream(denoiser, settings, mixed, roi, streamed);
+				stream(denoiser, settings, mixed, region, streamed_region);
+				stream_error = std::max(compare(adaptive, streamed).max_error, compare(part, streamed_region).max_error);
+				ok = ok && stream_error <= VERIFY_MAX_ERROR;
+			}
+
+			printf("%-4s %3dx%-3d adaptive %-9s sigma %.4f %.4f  skipped %4.1f%%  %.3f s  noisy third %5.1f dB (fixed h %5.1f dB)  engines %.1e  region %.1e  stream %.1e\n",
+				   ok ? "ok" : "FAIL", width, height, engine_name(settings.engine), light_sigma, strong_sigma, 100.0 * skipped, adaptive_seconds,
+				   adaptive_psnr, fixed_psnr, engine_error, region_error, stream_error);
+			if(!ok)
+				++failures;
+		}
+		return failures;
+	}
+
+	/* Clamped border of every engine, with and without guides: the engines agree with the brute force */
+	/* one, a region and streamed bands agree with the whole image, and only pixels closer to the border */
+	/* than the halo differ from the skipped border. Returns the number of failures */
+	int verify_edges(int threads, bool opencl)
+	{
+		struct Case { int width, height, patch, search, offset; bool guided; };
+		const Case cases[] =
+		{
+			{ 96, 80, 7, 20, 3, false },
+			{ 72, 58, 4, 9, 2, true },		// all guides, even patches reach further right/down
+		};
+
+		int failures = 0;
+		for(size_t k = 0; k < sizeof(cases) / sizeof(cases[0]); ++k)
+		{
+			const Case& c = cases[k];
+			nvDenoiseSettings settings;
+			settings.h				= 0.4f;
+			settings.patch_size		= c.patch;
+			settings.search_size	= c.search;
+			settings.search_offset	= c.offset;
+			settings.threads		= threads;
+			settings.isa			= NLM_ISA_AUTO;
+			settings.fallback_engine	= NLM_ENGINE_BRUTEFORCE;
+			settings.temporal_radius	= 0;
+			settings.albedo_weight	= c.guided ? 1.0f : 0.0f;
+			settings.normal_weight	= c.guided ? 0.5f : 0.0f;
+			settings.depth_weight	= c.guided ? 2.0f : 0.0f;
+			settings.weight_cutoff	= 0.0f;
+			settings.pyramid_levels	= 0;
+			settings.half_input		= 0;
+			settings.adaptive		= 0;
+			settings.noise_floor	= 0.0f;
+
+			nvImage noisy;
+			make_noisy_image(noisy, c.width, c.height, 7000 + unsigned(k), nvNLMdenoiser::image_channels(settings));
+			const nvRect roi	= { 0, 0, c.width, c.height };
+			const nvRect region	= { 0, 5, c.width / 2, c.height / 2 };
+
+			const int reach = nvNLMdenoiser::halo(settings);
+			const nvRect inner = { reach, reach, c.width - 2 * reach, c.height - 2 * reach };
+
+			nvImage reference;
+			const int engines[] = { NLM_ENGINE_BRUTEFORCE, NLM_ENGINE_INTEGRAL, NLM_ENGINE_SYMMETRIC, NLM_ENGINE_OPENCL };
+			for(size_t e = 0; e < sizeof(engines) / sizeof(engines[0]); ++e)
+			{
+				settings.engine = engines[e];
+				if(settings.engine == NLM_ENGINE_OPENCL && !opencl)
+					continue;
+
+				nvNLMdenoiser denoiser;
+				nvImage skipped, clamped;
+				settings.edge_mode = NLM_EDGE_SKIP;
+				denoiser.denoise(settings, noisy, skipped, roi);
+				settings.edge_mode = NLM_EDGE_CLAMP;
+				denoiser.denoise(settings, noisy, clamped, roi);
+
+				//away from the border both modes see the same samples
+				nvImage skipped_inner, clamped_inner;
+				crop(skipped, inner, skipped_inner);
+				crop(clamped, inner, clamped_inner);
+				const double inner_error	= compare(skipped_inner, clamped_inner).max_error;
+				const double border_change	= compare(skipped, clamped).max_error;
+				bool ok = inner_error <= VERIFY_MAX_ERROR && border_change > VERIFY_MAX_ERROR;
+
+				double engine_error = 0.0;
+				if(e == 0)
+					reference = clamped;
+				else
+					engine_error = compare(reference, clamped).max_error;
+				ok = ok && engine_error <= VERIFY_MAX_ERROR;
+
+				//a region touching the border is clamped at the image border, not at its own
+				nvImage part, expected;
+				denoiser.denoise(settings, noisy, part, region);
+				crop(clamped, region, expected);
+				const double region_error = compare(expected, part).max_error;
+				ok = ok && region_error <= VERIFY_MAX_ERROR;
+
+				double stream_error = 0.0;
+				if(settings.engine != NLM_ENGINE_OPENCL)
+				{
+					nvImage streamed, streamed_region;
+					stream(denoiser, settings, noisy, roi, streamed);
+					stream(denoiser, settings, noisy, region, streamed_region);
+					stream_error = std::max(compare(clamped, streamed).max_error, compare(part, streamed_region).max_error);
+					ok = ok && stream_error <= VERIFY_MAX_ERROR;
+				}
+
+				printf("%-4s %3dx%-3d p%d s%-2d o%d%s clamped border %-9s inner %.1e  border change %.1e  engines %.1e  region %.1e  stream %.1e\n",
+					   ok ? "ok" : "FAIL", c.width, c.height, c.patch, c.search, c.offset, c.guided ? " guided" : "", engine_name(settings.engine),
+					   inner_error, border_change, engine_error, region_error, stream_error);
+				if(!ok)
+					++failures;
+			}
+		}
+		return failures;
+	}
+
+	/* Every launch variant of the OpenCL engine, forced instead of tuned: the direct and the tiled */
+	/* kernel, one or several slices, each with the skipped and the clamped border and with fp32 and */
+	/* fp16 input. Whole frames and regions run in several bands and are compared to the brute force */
+	/* engine on the same input. Returns the number of failures */
+	int verify_cl_launches(int threads, bool opencl)
+	{
+#ifdef USE_OPENCL
+		if(!opencl)
+			return 0;
+
+		struct Case { int width, height, patch, search, offset; bool guided; };
+		const Case cases[] =
+		{
+			{ 96, 80, 7, 20, 3, false },
+			{ 72, 58, 4, 9, 2, true },		// all guides, even patches reach further right/down
+		};
+		//the smallest tiled groups fit into the local memory of every device the engine runs on
+		const char* launches[] = { "direct 0 0 1", "direct 0 0 4", "tiled 8 4 1", "tiled 16 8 3" };
+
+		nvCLRuntime& cl = *nvCLRuntime::shared();
+		int failures = 0;
+		for(size_t k = 0; k < sizeof(cases) / sizeof(cases[0]); ++k)
+		{
+			const Case& c = cases[k];
+			nvDenoiseSettings settings;
+			settings.h				= 0.4f;
+			settings.patch_size		= c.patch;
+			settings.search_size	= c.search;
+			settings.search_offset	= c.offset;
+			settings.threads		= threads;
+			settings.isa			= NLM_ISA_AUTO;
+			settings.fallback_engine	= NLM_ENGINE_BRUTEFORCE;
+			settings.temporal_radius	= 0;
+			settings.albedo_weight	= c.guided ? 1.0f : 0.0f;
+			settings.normal_weight	= c.guided ? 0.5f : 0.0f;
+			settings.depth_weight	= c.guided ? 2.0f : 0.0f;
+			settings.weight_cutoff	= 0.0f;
+			settings.pyramid_levels	= 0;
+			settings.adaptive		= 0;
+			settings.noise_floor	= 0.0f;
+
+			nvImage noisy, rounded;
+			make_noisy_image(noisy, c.width, c.height, 9000 + unsigned(k), nvNLMdenoiser::image_channels(settings));
+			round_to_half(noisy, rounded);
+			const nvRect roi	= { 0, 0, c.width, c.height };
+			const nvRect region	= { c.width / 5, 3, c.width / 2, c.height / 2 };
+
+			for(int mode = 0; mode < 4; ++mode)
+			{
+				settings.edge_mode	= mode & 1 ? NLM_EDGE_CLAMP : NLM_EDGE_SKIP;
+				settings.half_input	= mode & 2 ? 1 : 0;
+
+				//fp16 input is compared to the filter of the input rounded to fp16
+				nvNLMdenoiser reference_denoiser;
+				nvImage reference;
+				settings.engine = NLM_ENGINE_BRUTEFORCE;
+				reference_denoiser.denoise(settings, settings.half_input ? rounded : noisy, reference, roi);
+				nvImage expected;
+				crop(reference, region, expected);
+
+				settings.engine = NLM_ENGINE_OPENCL;
+				for(size_t l = 0; l < sizeof(launches) / sizeof(launches[0]); ++l)
+				{
+					nvNLMdenoiser denoiser;
+					nvImage denoised, part;
+					{
+						std::lock_guard<std::mutex> lock(cl.mutex());
+						cl.force_profile(launches[l]);
+					}
+					denoiser.denoise(settings, noisy, denoised, roi);
+					denoiser.denoise(settings, noisy, part, region);
+					{
+						std::lock_guard<std::mutex> lock(cl.mutex());
+						cl.force_profile(std::string());
+					}
+
+					const double error			= compare(reference, denoised).max_error;
+					const double region_error	= compare(expected, part).max_error;
+					const bool ok = error <= VERIFY_MAX_ERROR && region_error <= VERIFY_MAX_ERROR;
+					printf("%-4s %3dx%-3d p%d s%-2d o%d%-7s opencl %-12s %-7s %-4s max error %.1e  region %.1e\n",
+						   ok ? "ok" : "FAIL", c.width, c.height, c.patch, c.search, c.offset, c.guided ? " guided" : "", launches[l],
+						   settings.edge_mode == NLM_EDGE_CLAMP ? "clamped" : "skipped", settings.half_input ? "fp16" : "fp32", error, region_error);
+					if(!ok)
+						++failures;
+				}
+			}
+		}
+		return failures;
+#else
+		(void)threads;
+		(void)opencl;
+		return 0;
+#endif
+	}
+
+	int verify(int threads, bool require_opencl)
+	{
+		struct Case { int width, height, patch, search, offset; float h, albedo, normal, depth; };
+		const Case cases[] =
+		{
+			{ 96, 80, 7, 20, 3, 0.4f, 0.0f, 0.0f, 0.0f },		// plugin defaults
+			{ 61, 47, 5, 10, 1, 0.4f, 0.0f, 0.0f, 0.0f },
+			{ 70, 53, 3, 7, 2, 0.15f, 0.0f, 0.0f, 0.0f },
+			{ 64, 64, 4, 9, 2, 0.3f, 0.0f, 0.0f, 0.0f },		// even sizes reach further right/down
+			{ 72, 58, 3, 7, 1, 0.4f, 1.0f, 0.5f, 2.0f },		// all guides
+			{ 67, 50, 5, 10, 2, 0.3f, 0.0f, 0.0f, 1.0f },		// depth only
+		};
+
+		//with --require-opencl a missing device is a failure, not a skipped engine
+		const bool opencl = opencl_available();
+		if(!opencl)
+			printf("%s\n", require_opencl ? "FAIL no OpenCL device" : "no OpenCL device, skipping the OpenCL engine");
+
+		int failures = !opencl && require_opencl ? 1 : 0;
+		for(size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); ++c)
+		{
+			const Case& test = cases[c];
+
+			nvDenoiseSettings settings;
+			settings.h				= test.h;
+			settings.patch_size		= test.patch;
+			settings.search_size	= test.search;
+			settings.search_offset	= test.offset;
+			settings.threads		= threads;
+			settings.isa			= NLM_ISA_AUTO;
+			settings.fallback_engine	= NLM_ENGINE_BRUTEFORCE;
+			settings.temporal_radius	= 0;
+			settings.albedo_weight	= test.albedo;
+			settings.normal_weight	= test.normal;
+			settings.depth_weight	= test.depth;
+			settings.weight_cutoff	= 0.0f;
+			settings.pyramid_levels	= 0;
+			settings.half_input		= 0;
+			settings.adaptive		= 0;
+			settings.edge_mode		= NLM_EDGE_SKIP;
+			settings.noise_floor	= 0.0f;
+			const int channels = nvNLMdenoiser::image_channels(settings);
+
+			nvImage noisy, reference;
+			make_noisy_image(noisy, test.width, test.height, unsigned(1000 + c), channels);
+			const nvRect roi = { 0, 0, test.width, test.height };
+
+			//exact reference and the error bound of the fast weights
+			nvDenoiseSettings fast_settings = settings;
+			fast_settings.weight_cutoff = VERIFY_WEIGHT_CUTOFF;
+			nvImage fast_bound;
+			reference_nlm(fast_settings, std::vector<const nvImage*>(1, &noisy), reference, &fast_bound);
+
+			//three frames of a sequence for the temporal filter, the middle one is denoised
+			nvFrameRing ring(3);
+			for(int f = 0; f < 3; ++f)
+				make_noisy_image(ring.insert(f), test.width, test.height, unsigned(2000 + 3 * c + f), channels);
+			nvDenoiseSettings temporal_settings = settings;
+			temporal_settings.temporal_radius = 1;
+			nvImage temporal_reference;
+			std::vector<const nvImage*> temporal_frames;
+			temporal_frames.push_back(ring.find(1));
+			temporal_frames.push_back(ring.find(0));
+			temporal_frames.push_back(ring.find(2));
+			reference_nlm(temporal_settings, temporal_frames, temporal_reference);
+
+			//every engine, the brute force one with every available kernel
+			struct Run { int engine; int isa; };
+			std::vector<Run> runs;
+			const std::vector<const nvNLMKernels*>& kernels = nv_nlm_kernels_available();
+			for(size_t k = 0; k < kernels.size(); ++k)
+			{
+				Run run = { NLM_ENGINE_BRUTEFORCE, kernels[k]->isa };
+				runs.push_back(run);
+			}
+			Run integral = { NLM_ENGINE_INTEGRAL, NLM_ISA_AUTO };
+			runs.push_back(integral);
+			Run symmetric = { NLM_ENGINE_SYMMETRIC, NLM_ISA_AUTO };
+			runs.push_back(symmetric);
+			if(opencl)
+			{
+				Run cl = { NLM_ENGINE_OPENCL, NLM_ISA_AUTO };
+				runs.push_back(cl);
+			}
+
+			for(size_t r = 0; r < runs.size(); ++r)
+			{
+				settings.engine	= runs[r].engine;
+				settings.isa	= runs[r].isa;
+
+				nvNLMdenoiser denoiser;
+				nvImage denoised;
+				denoiser.denoise(settings, noisy, denoised, roi);
+
+				const nvError error = compare(reference, denoised);
+				bool ok = error.psnr >= VERIFY_MIN_PSNR && error.max_error <= VERIFY_MAX_ERROR;
+
+				//a region (render region) reads only itself plus the halo, the tiles of the integral
+				//engine start elsewhere than in the whole frame
+				const nvRect region = { test.width / 5, test.height / 4, test.width / 2, test.height / 2 };
+				nvImage part, expected;
+				denoiser.denoise(settings, noisy, part, region);
+				crop(denoised, region, expected);
+				const double region_error = compare(expected, part).max_error;
+				ok = ok && region_error <= VERIFY_MAX_ERROR;
+
+				//streaming the frame or the region must not change the result at all, except for the
+				//order the symmetric engine adds the scattered weights in
+				double stream_error = 0.0;
+				if(settings.engine != NLM_ENGINE_OPENCL)
+				{
+					nvImage streamed, streamed_region;
+					stream(denoiser, settings, noisy, roi, streamed);
+					stream(denoiser, settings, noisy, region, streamed_region);
+					stream_error = std::max(compare(denoised, streamed).max_error, compare(part, streamed_region).max_error);
+					ok = ok && (settings.engine == NLM_ENGINE_SYMMETRIC ? stream_error <= VERIFY_MAX_ERROR : stream_error == 0.0);
+				}
+
+				//fp16 input only changes what the filter reads, the reference of the rounded input must
+				//match as closely as the fp32 one
+				double half_error = 0.0;
+				if(settings.engine == NLM_ENGINE_OPENCL)
+				{
+					nvImage rounded, half_reference, half;
+					round_to_half(noisy, rounded);
+					reference_nlm(settings, std::vector<const nvImage*>(1, &rounded), half_reference);
+					nvDenoiseSettings half_settings = settings;
+					half_settings.half_input = 1;
+					denoiser.denoise(half_settings, noisy, half, roi);
+					const nvError error = compare(half_reference, half);
+					half_error = error.max_error;
+					ok = ok && error.psnr >= VERIFY_MIN_PSNR && error.max_error <= VERIFY_MAX_ERROR;
+				}
+
+				//the temporal filter searches the neighbouring frames too
+				temporal_settings.engine	= settings.engine;
+				temporal_settings.isa		= settings.isa;
+				nvImage temporal;
+				denoiser.denoise_temporal(temporal_settings, ring, 1, temporal, roi);
+				const nvError temporal_error = compare(temporal_reference, temporal);
+				ok = ok && temporal_error.psnr >= VERIFY_MIN_PSNR && temporal_error.max_error <= VERIFY_MAX_ERROR;
+
+				//the fast weights drop candidates, but no pixel may move further than the bound allows
+				fast_settings.engine	= settings.engine;
+				fast_settings.isa		= settings.isa;
+				nvImage fast;
+				denoiser.denoise(fast_settings, noisy, fast, roi);
+				const nvError fast_error = compare(reference, fast);
+				ok = ok && bound_excess(reference, fast, fast_bound) <= VERIFY_MAX_BOUND_EXCESS;
+
+				const char* isa = settings.engine == NLM_ENGINE_BRUTEFORCE ? nv_nlm_kernels(settings.isa)->name : "";
+				printf("%-4s %3dx%-3d patch %d search %2d offset %d %-6s %-9s %-7s psnr %6.1f dB  max error %.2e  region %.1e  stream %.1e  half %.1e  temporal %.2e  fast %.2e\n",
+					   ok ? "ok" : "FAIL", test.width, test.height, test.patch, test.search, test.offset, channels > 3 ? "guided" : "",
+					   engine_name(settings.engine), isa, error.psnr, error.max_error, region_error, stream_error, half_error, temporal_error.max_error, fast_error.max_error);
+				if(!ok)
+					++failures;
+			}
+		}
+
+		failures += verify_pyramid(threads, opencl);
+		failures += verify_adaptive(threads, opencl);
+		failures += verify_edges(threads, opencl);
+		failures += verify_cl_launches(threads, opencl);
+		failures += verify_pool_restart(threads);
+		failures += verify_fallback(threads, opencl);
+		failures += verify_steady_state(threads);
+		failures += verify_trace(threads);
+
+		printf("%s\n", failures ? "verification FAILED" : "verification passed");
+		return failures ? 1 : 0;
+	}
+
+	void print_usage()
+	{
+		printf(
+			"usage: nvdenoise_bench [options]\n"
+			"       nvdenoise_bench --verify [--threads N] [--require-opencl]\n"
+			"\n"
+			"Denoises seeded synthetic noisy images with every engine over a sweep of\n"
+			"resolutions, patch sizes, search sizes and offsets and reports the throughput\n"
+			"and the time of every stage. --verify checks every engine against a double\n"
+			"precision reference instead and returns 1 if any case fails.\n"
+			"--require-opencl also fails it when no OpenCL device is found.\n"
+			"\n"
+			"  --sizes WxH,...           image sizes (default 256x256,512x512)\n"
+			"  --patch N,...             patch sizes (default 5,7)\n"
+			"  --search N,...            search window sizes (default 10,20)\n"
+			"  --offset N,...            search window steps (default 1,3)\n"
+			"  --engines NAME,...        brute, integral, symmetric, opencl (default all)\n"
+			"  --threads N               CPU threads, 0 = all (default)\n"
+			"  --repeat N                runs of every case, the fastest is reported (default 1)\n"
+			"  --cutoff W                fast weights, drop weights below W (default 0 = exact)\n"
+			"  --pyramid N               pyramid levels (default 0)\n"
+			"  --half 0|1                opencl: fp16 input frames on the device (default 0)\n"
+			"  -h, --help                print this and exit\n");
+	}
+
+	/****************************************************************************/
+	/* Benchmark sweep															*/
+	/****************************************************************************/
+	int benchmark(int argc, char** argv)
+	{
+		std::vector<std::string> sizes		= split("256x256,512x512");
+		std::vector<int> patches			= split_ints("5,7");
+		std::vector<int> searches			= split_ints("10,20");
+		std::vector<int> offsets			= split_ints("1,3");
+		std::vector<std::string> engines	= split("brute,integral,symmetric,opencl");
+		int threads = 0, repeat = 1;
+		float cutoff = 0.0f;
+		int pyramid = 0;
+		int half = 0;
+
+		for(int i = 1; i < argc; i += 2)
+		{
+			if(i + 1 == argc)
+			{
+				fprintf(stderr, "missing value of %s\n", argv[i]);
+				print_usage();
+				return 2;
+			}
+			if(!strcmp(argv[i], "--sizes"))			sizes		= split(argv[i + 1]);
+			else if(!strcmp(argv[i], "--patch"))	patches		= split_ints(argv[i + 1]);
+			else if(!strcmp(argv[i], "--search"))	searches	= split_ints(argv[i + 1]);
+			else if(!strcmp(argv[i], "--offset"))	offsets		= split_ints(argv[i + 1]);
+			else if(!strcmp(argv[i], "--engines"))	engines		= split(argv[i + 1]);
+			else if(!strcmp(argv[i], "--threads"))	threads		= atoi(argv[i + 1]);
+			else if(!strcmp(argv[i], "--repeat"))	repeat		= std::max(1, atoi(argv[i + 1]));
+			else if(!strcmp(argv[i], "--cutoff"))	cutoff		= float(atof(argv[i + 1]));
+			else if(!strcmp(argv[i], "--pyramid"))	pyramid		= std::min(std::max(atoi(argv[i + 1]), 0), NLM_MAX_PYRAMID_LEVELS);
+			else if(!strcmp(argv[i], "--half"))		half		= atoi(argv[i + 1]) ? 1 : 0;
+			else
+			{
+				fprintf(stderr, "unknown option %s\n", argv[i]);
+				print_usage();
+				return 2;
+			}
+		}
+
+		const bool opencl = opencl_available();
+		printf("%-9s %-9s %5s %6s %6s %9s %9s %9s %9s %9s %9s\n", "engine", "size", "patch", "search", "offset",
+			   "Mpix/s", "upload", "setup", "filter", "download", "total");
+
+		nvNLMdenoiser denoiser;
+		for(size_t s = 0; s < sizes.size(); ++s)
+		{
+			int width = 0, height = 0;
+			if(sscanf(sizes[s].c_str(), "%dx%d", &width, &height) != 2 || width <= 0 || height <= 0)
+			{
+				fprintf(stderr, "invalid size %s\n", sizes[s].c_str());
+				return 2;
+			}
+
+			nvImage noisy, denoised;
+			make_noisy_image(noisy, width, height, 1);
+			const nvRect roi = { 0, 0, width, height };
+
+			for(size_t e = 0; e < engines.size(); ++e)
+			{
+				nvDenoiseSettings settings;
+				settings.h			= 0.4f;
+				settings.threads	= threads;
+				settings.isa		= NLM_ISA_AUTO;
+				settings.fallback_engine	= NLM_ENGINE_BRUTEFORCE;
+				settings.temporal_radius	= 0;
+				settings.albedo_weight		= 0.0f;
+				settings.normal_weight		= 0.0f;
+				settings.depth_weight		= 0.0f;
+				settings.weight_cutoff		= cutoff;
+				settings.pyramid_levels		= pyramid;
+				settings.half_input			= half;
+				settings.adaptive			= 0;
+				settings.edge_mode			= NLM_EDGE_SKIP;
+				settings.noise_floor		= 0.0f;
+				if(engines[e] == "brute")			settings.engine = NLM_ENGINE_BRUTEFORCE;
+				else if(engines[e] == "integral")	settings.engine = NLM_ENGINE_INTEGRAL;
+				else if(engines[e] == "symmetric")	settings.engine = NLM_ENGINE_SYMMETRIC;
+				else if(engines[e] == "opencl")		settings.engine = NLM_ENGINE_OPENCL;
+				else
+				{
+					fprintf(stderr, "unknown engine %s\n", engines[e].c_str());
+					return 2;
+				}
+				if(settings.engine == NLM_ENGINE_OPENCL && !opencl)
+					continue;
+
+				for(size_t p = 0; p < patches.size(); ++p)
+				for(size_t q = 0; q < searches.size(); ++q)
+				for(size_t o = 0; o < offsets.size(); ++o)
+				{
+					settings.patch_size		= patches[p];
+					settings.search_size	= searches[q];
+					settings.search_offset	= offsets[o];
+
+					//the first OpenCL run of a configuration compiles the program, it is not timed
+					if(settings.engine == NLM_ENGINE_OPENCL)
+						denoiser.denoise(settings, noisy, denoised, roi);
+
+					nvStageTimes best = nvStageTimes();
+					for(int r = 0; r < repeat; ++r)
+					{
+						denoiser.denoise(settings, noisy, denoised, roi);
+						if(r == 0 || denoiser.stage_times().total < best.total)
+							best = denoiser.stage_times();
+					}
+
+					printf("%-9s %-9s %5d %6d %6d %9.3f %9.4f %9.4f %9.4f %9.4f %9.4f\n", engines[e].c_str(), sizes[s].c_str(),
+						   settings.patch_size, settings.search_size, settings.search_offset, width * height / best.total * 1e-6,
+						   best.upload, best.setup, best.filter, best.download, best.total);
+				}
+			}
+		}
+		return 0;
+	}
+}
+
+int main(int argc, char** argv)
+{
+	for(int i = 1; i < argc; ++i)
+	{
+		if(!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help"))
+		{
+			print_usage();
+			return 0;
+		}
+	}
+	if(argc > 1 && !strcmp(argv[1], "--verify"))
+	{
+		int threads = 0;
+		bool require_opencl = false;
+		for(int i = 2; i < argc; ++i)
+		{
+			if(!strcmp(argv[i], "--threads") && i + 1 < argc)
+				threads = atoi(argv[++i]);
+			else if(!strcmp(argv[i], "--require-opencl"))
+				require_opencl = true;
+			else
+			{
+				fprintf(stderr, "unknown option %s\n", argv[i]);
+				print_usage();
+				return 2;
+			}
+		}
+		return verify(threads, require_opencl);
+	}
+	return benchmark(argc, argv);
+}
@@ -0,0 +1,163 @@
+/****************************************************************************/
+/* Microbenchmark of the brute force block kernels							*/
+/*																			*/
+/* Denoises a seeded synthetic noisy image single threaded with every		*/
+/* instruction set this build and CPU support and reports the throughput,	*/
+/* the speedup over the scalar kernel and the largest difference to it.		*/
+/* The kernels run with exact weights and then with the fast ones. The fp16	*/
+/* converters of the OpenCL input are timed and compared with				*/
+/* nv_float_to_half over a sweep of all float bit patterns.					*/
+/*																			*/
+/*	nvkernels_bench [width height [patch_size search_size search_offset]]	*/
+/****************************************************************************/
+#include "../nvdenoise.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+
+using namespace NAVIE_GLOBAL;
+
+namespace
+{
+	/* Smooth gradient plus gaussian noise, the same for every run */
+	void make_noisy_image(nvImage& image, int width, int height)
+	{
+		image.resize(width, height, 3);
+
+		std::mt19937 rng(1234);
+		std::normal_distribution<float> noise(0.0f, 0.1f);
+		for(int dim = 0; dim < 3; ++dim)
+		{
+			for(int y = 0; y < height; ++y)
+			{
+				float* row = image.row(dim, y);
+				for(int x = 0; x < width; ++x)
+					row[x] = 0.5f + 0.4f * std::sin(0.02f * x * (dim + 1)) * std::cos(0.03f * y) + noise(rng);
+			}
+		}
+	}
+
+	float max_difference(const nvImage& a, const nvImage& b)
+	{
+		float diff = 0.0f;
+		for(int dim = 0; dim < 3; ++dim)
+		{
+			for(int y = 0; y < a.height(); ++y)
+			{
+				for(int x = 0; x < a.width(); ++x)
+					diff = std::max(diff, std::fabs(a.at(dim, x, y) - b.at(dim, x, y)));
+			}
+		}
+		return diff;
+	}
+
+	/* Floats of every 61st bit pattern, all exponents and signs, NaNs included */
+	std::vector<float> float_sweep()
+	{
+		std::vector<float> values;
+		values.reserve((1ull << 32) / 61 + 1);
+		for(unsigned long long bits = 0; bits < (1ull << 32); bits += 61)
+		{
+			const unsigned int pattern = (unsigned int)bits;
+			float f;
+			memcpy(&f, &pattern, sizeof(f));
+			values.push_back(f);
+		}
+		return values;
+	}
+}
+
+int main(int argc, char** argv)
+{
+	const int width		= argc > 2 ? atoi(argv[1]) : 512;
+	const int height	= argc > 2 ? atoi(argv[2]) : 512;
+
+	nvDenoiseSettings settings;
+	settings.h				= 0.4f;
+	settings.patch_size		= argc > 5 ? atoi(argv[3]) : 7;
+	settings.search_size	= argc > 5 ? atoi(argv[4]) : 20;
+	settings.search_offset	= argc > 5 ? atoi(argv[5]) : 3;
+	settings.engine			= NLM_ENGINE_BRUTEFORCE;
+	settings.fallback_engine	= NLM_ENGINE_BRUTEFORCE;
+	settings.threads		= 1;
+	settings.temporal_radius	= 0;
+	settings.albedo_weight		= 0.0f;
+	settings.normal_weight		= 0.0f;
+	settings.depth_weight		= 0.0f;
+	settings.weight_cutoff		= 0.0f;
+	settings.pyramid_levels		= 0;
+	settings.half_input			= 0;
+	settings.adaptive			= 0;
+	settings.edge_mode			= NLM_EDGE_SKIP;
+	settings.noise_floor		= 0.0f;
+
+	nvImage noisy;
+	make_noisy_image(noisy, width, height);
+	const nvRect roi = { 0, 0, width, height };
+
+	printf("%dx%d, patch %d, search %d, offset %d, 1 thread\n", width, height, settings.patch_size, settings.search_size, settings.search_offset);
+
+	nvNLMdenoiser denoiser;
+	nvImage reference;
+	double reference_seconds = 0.0;
+
+	//the scalar kernel is always available and last in the list. Its exact result is the reference
+	//of the fast weights too
+	const std::vector<const nvNLMKernels*>& available = nv_nlm_kernels_available();
+	const float cutoffs[2] = { 0.0f, 1e-3f };
+	for(int c = 0; c < 2; ++c)
+	{
+		settings.weight_cutoff = cutoffs[c];
+		for(int i = int(available.size()) - 1; i >= 0; --i)
+		{
+			settings.isa = available[i]->isa;
+
+			nvImage denoised;
+			const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			denoiser.non_local_mean(&settings, noisy, denoised, roi);
+			const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+			if(reference.empty())
+			{
+				reference = denoised;
+				reference_seconds = seconds;
+			}
+
+			printf("%-8s %-5s %8.3f Mpix/s  speedup %5.2fx  max diff %.3g\n", available[i]->name, c ? "fast" : "exact", width * height / seconds * 1e-6,
+				   reference_seconds / seconds, max_difference(reference, denoised));
+		}
+	}
+
+	//fp16 conversion of the OpenCL input, every converter against the scalar one. NaNs only have to
+	//stay NaNs, F16C keeps their payload
+	int mismatches = 0;
+	for(int h = 0; h < 0x7c00; ++h)
+		mismatches += nv_float_to_half(nv_half_to_float((unsigned short)h)) != h;
+	printf("fp16 round trip    mismatches %d\n", mismatches);
+
+	const std::vector<float> sweep = float_sweep();
+	std::vector<unsigned short> expected(sweep.size()), converted(sweep.size());
+	for(size_t i = 0; i < sweep.size(); ++i)
+		expected[i] = nv_float_to_half(sweep[i]);
+
+	for(int i = int(available.size()) - 1; i >= 0; --i)
+	{
+		const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		available[i]->to_half(&sweep[0], &converted[0], sweep.size());
+		const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		mismatches = 0;
+		for(size_t k = 0; k < sweep.size(); ++k)
+		{
+			const bool nan = (expected[k] & 0x7c00) == 0x7c00 && (expected[k] & 0x3ff) != 0;
+			mismatches += nan ? (converted[k] & 0x7c00) != 0x7c00 || (converted[k] & 0x3ff) == 0 : converted[k] != expected[k];
+		}
+		printf("fp16 %-8s %8.1f Mfloat/s  mismatches %d\n", available[i]->name, sweep.size() / seconds * 1e-6, mismatches);
+	}
+	return 0;
+}
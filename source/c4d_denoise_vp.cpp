@@ -1,10 +1,37 @@
 #include "nvdenoise.h"
+#include "nvclruntime.h"
+#include "nvtrace.h"
 #include "c4d_denoise_vp.h"
 
 #include "nvdenoiser.h"
 
+#include <algorithm>
+
+// rows per streamed band, peak memory is about three bands of float RGB
+#define DENOISE_BAND_HEIGHT 128
+
+// multipass buffers guiding the filter, in nvNLMGuide order
+static const Int32 guide_buffers[NLM_GUIDE_COUNT] = { VPBUFFER_MAT_COLOR, VPBUFFER_MAT_NORMAL, VPBUFFER_DEPTH };
+static const Int32 guide_weight_ids[NLM_GUIDE_COUNT] = { NVDENOISE_ALBEDOWEIGHT, NVDENOISE_NORMALWEIGHT, NVDENOISE_DEPTHWEIGHT };
+
+Bool nvDenoise::AllocateBuffers(BaseVideoPost* node, Render* render, BaseDocument* doc)
+{
+	// the guide passes are rendered for the filter even if they are not saved
+	BaseContainer *data = node->GetDataInstance();
+	for (Int32 g = 0; g < NLM_GUIDE_COUNT; ++g)
+	{
+		if (data->GetFloat(guide_weight_ids[g], 0.0) > 0.0)
+			render->AllocateBuffer(guide_buffers[g], 0, 32, false);
+	}
+	return true;
+}
+
 RENDERRESULT nvDenoise::Execute(BaseVideoPost* node, VideoPostStruct* vps)
 {
+	// frames of an earlier render may show another state of the scene, never search them
+	if (vps->vp == VIDEOPOSTCALL_FRAMESEQUENCE && vps->open)
+		m_frames.reset(0);
+
 	if (vps->vp == VIDEOPOSTCALL_RENDER && !vps->open && *vps->error == RENDERRESULT_OK && !vps->thread->TestBreak())
 	{
 		VPBuffer*			rgba = vps->render->GetBuffer(VPBUFFER_RGBA, NOTOK);
@@ -12,7 +39,7 @@ RENDERRESULT nvDenoise::Execute(BaseVideoPost* node, VideoPostStruct* vps)
 		if (!ray || !rgba)
 			return RENDERRESULT_OUTOFMEMORY;
 		
-		Int32 x1, y1, x2, y2, x, y, cnt/*, i*/;
+		Int32 x1, y1, x2, y2, y, cnt/*, i*/;
 
 		// example functions
 		Int32 cpp = rgba->GetInfo(VPGETINFO_CPP);
@@ -34,90 +61,129 @@ RENDERRESULT nvDenoise::Execute(BaseVideoPost* node, VideoPostStruct* vps)
 		settings.search_size	= data->GetInt32(NVDENOISE_SEARCHSIZE,20);
 		settings.search_offset	= data->GetInt32(NVDENOISE_SEARCHOFFSET,3); 
 		settings.h				= data->GetFloat(NVDENOISE_STRENGTH,0.4);
+		settings.engine			= data->GetInt32(NVDENOISE_CPUENGINE,NLM_ENGINE_INTEGRAL);
+		settings.fallback_engine	= settings.engine;
+		settings.threads		= data->GetInt32(NVDENOISE_CPUTHREADS,0);
+		settings.isa			= NLM_ISA_AUTO;
+		settings.temporal_radius = data->GetInt32(NVDENOISE_TEMPORALRADIUS,0);
+		settings.albedo_weight	= data->GetFloat(NVDENOISE_ALBEDOWEIGHT,0.0);
+		settings.normal_weight	= data->GetFloat(NVDENOISE_NORMALWEIGHT,0.0);
+		settings.depth_weight	= data->GetFloat(NVDENOISE_DEPTHWEIGHT,0.0);
+		settings.weight_cutoff	= data->GetFloat(NVDENOISE_WEIGHTCUTOFF,0.0);
+		settings.pyramid_levels	= data->GetInt32(NVDENOISE_PYRAMIDLEVELS,0);
+		settings.half_input		= data->GetBool(NVDENOISE_HALFINPUT,false) ? 1 : 0;
+		settings.adaptive		= data->GetBool(NVDENOISE_ADAPTIVE,false) ? 1 : 0;
+		settings.noise_floor	= data->GetFloat(NVDENOISE_NOISEFLOOR,0.005);
+		settings.edge_mode		= data->GetInt32(NVDENOISE_EDGEMODE,NLM_EDGE_SKIP);
+
+		// guide passes, a guide whose buffer the renderer did not provide is not used
+		VPBuffer* guides[NLM_GUIDE_COUNT] = { nullptr, nullptr, nullptr };
+		Int32 guide_cpp = cpp;
+		for (Int32 g = 0; g < NLM_GUIDE_COUNT; ++g)
+		{
+			if (NAVIE_GLOBAL::nvNLMdenoiser::guide_weight(settings, g) > 0.0f)
+				guides[g] = vps->render->GetBuffer(guide_buffers[g], 0);
+			if (guides[g])
+				guide_cpp = std::max(guide_cpp, Int32(guides[g]->GetInfo(VPGETINFO_CPP)));
+		}
+		if (!guides[NLM_GUIDE_ALBEDO])	settings.albedo_weight	= 0.0f;
+		if (!guides[NLM_GUIDE_NORMAL])	settings.normal_weight	= 0.0f;
+		if (!guides[NLM_GUIDE_DEPTH])	settings.depth_weight	= 0.0f;
 		
+		if(data->GetBool(NVDENOISE_USEGPU, false))
+			settings.engine = NLM_ENGINE_OPENCL;
+
 		/************************************************************************/
 		/* Denoise */
 		/************************************************************************/		
-		NAVIE_GLOBAL::nvNLMdenoiser dn;		
+		if(!m_denoiser)
+			m_denoiser = NAVIE_GLOBAL::nvNLMdenoiser::shared();
+		NAVIE_GLOBAL::nvNLMdenoiser& dn = *m_denoiser;
 
-		if(data->GetBool(NVDENOISE_USEGPU, false)) 
+		const Int32 width	= bmp->GetBw();
+		const Int32 height	= bmp->GetBh();
+
+		// the line buffer is kept across frames and only grows
+		Int bufferSize = guide_cpp * width;
+		if(bufferSize <= 0)
+			return RENDERRESULT_OUTOFMEMORY;
+		NAVIE_GLOBAL::nv_pool_resize(m_line, size_t(bufferSize));
+		Float32* buffer = m_line.data();
+
+		//Copy noisy lines (a band of the render region plus its halo at a time) into the planar float
+		//image, the guide passes go into the planes after the color
+		auto read_rows = [&](int x, int first, int count, NAVIE_GLOBAL::nvImage& image, int image_row) -> bool
 		{
-			/************************************************************************/
-			Int			 bufferSize = cpp * cnt;
-			Float32* b, *buffer = nullptr;
-
-			if(bufferSize > 0)
-				buffer = NewMemClear(Float32, bufferSize);
-			if(!buffer)
-				return RENDERRESULT_OUTOFMEMORY;
-
-			/************************************************************************/
-			std::vector<float> in_bmp((bmp->GetBw() * bmp->GetBh()) * 3); //color vectors encoded in a float array
-			//Copy the buffer into the float vector
-			for(y = y1; y <= y2; y++) 
+			const Int32 columns = image.width();
+			for(y = first; y < first + count; y++) 
 			{
-				rgba->GetLine(x1, y, cnt, buffer, 32, true);
-
-				int index = NAVIE_GLOBAL::nvNLMdenoiser::get_index_array(x1, y, bmp->GetBw()); //Weight index
-				for(b = buffer, x = x1; x <= x2; x++, b += cpp, index += 3) {
-					for(int i = 0; i < 3; i++) 
-					{
-						in_bmp[index + i] = b[i]; 
-					}
+				if(!rgba->GetLine(x, y, columns, buffer, 32, true))
+					return false;
+				image.set_row_interleaved(image_row + y - first, 0, columns, buffer, cpp, 0, 3);
+
+				for(Int32 g = 0; g < NLM_GUIDE_COUNT; ++g)
+				{
+					if(!guides[g])
+						continue;
+					if(!guides[g]->GetLine(x, y, columns, buffer, 32, true))
+						return false;
+					image.set_row_interleaved(image_row + y - first, 0, columns, buffer, Int32(guides[g]->GetInfo(VPGETINFO_CPP)),
+											  NAVIE_GLOBAL::nvNLMdenoiser::guide_plane(settings, g), NLM_GUIDE_CHANNELS[g]);
 				}
 			}
-			
-			std::vector<float> out_bmp(in_bmp);
-			dn.non_local_mean_cl(settings, in_bmp, out_bmp, bmp->GetBw(), bmp->GetBh());
-			
-			/************************************************************************/
-			//Apply denoising result to our buffer
-			/************************************************************************/
-			NAVIE_GLOBAL::vector3d rgb;
-			for(y = y1; y <= y2; y++) {
-				rgba->GetLine(x1, y, cnt, buffer, 32, true);
-
-				int index = NAVIE_GLOBAL::nvNLMdenoiser::get_index_array(x1, y, bmp->GetBw()); //Weight index
-				for(b = buffer, x = x1; x <= x2; x++, b += cpp, index += 3) {
-					for(int i = 0; i < 3; i++) 
-					{
-						b[i] = out_bmp[index + i]; 
-					}
-				}
+			return true;
+		};
 
-				rgba->SetLine(x1, y, cnt, buffer, 32, true);
+		//Apply denoising result to our buffer, the image holds the render region columns only
+		auto write_rows = [&](int x, int first, int count, const NAVIE_GLOBAL::nvImage& image, int image_row) -> bool
+		{
+			const Int32 columns = image.width();
+			for(y = first; y < first + count; y++) 
+			{
+				rgba->GetLine(x, y, columns, buffer, 32, true);
+				image.get_row_interleaved(image_row + y - first, 0, columns, buffer, cpp);
+				rgba->SetLine(x, y, columns, buffer, 32, true);
 			}
-			DeleteMem(buffer);
-		}
-		else 
+			return true;
+		};
+
+		const NAVIE_GLOBAL::nvRect region = { x1, y1, cnt, y2 - y1 + 1 };
+
+		// several video posts (and documents) share the denoiser, one frame at a time
+		std::lock_guard<std::mutex> lock(dn.mutex());
+
+		// with NVDENOISE_TRACE set every frame is logged and added to the trace file
+		const Int32 frame = vps->time.GetFrame(vps->doc->GetFps());
+		NV_TRACE_FRAME(frame);
+
+		bool done = true;
+		if(settings.temporal_radius > 0)
 		{
-			std::vector<NAVIE_GLOBAL::Color> out_bmp(bmp->GetBw() * bmp->GetBh());
-			dn.non_local_mean(&settings, bmp, out_bmp);
-
-			/************************************************************************/
-			//Apply denoising result to our buffer
-			/************************************************************************/
-			Int			 bufferSize = cpp * cnt;
-			Float32* b, *buffer = nullptr;
-
-			if(bufferSize > 0)
-				buffer = NewMemClear(Float32, bufferSize);
-			if(!buffer)
-				return RENDERRESULT_OUTOFMEMORY;
-
-			NAVIE_GLOBAL::vector3d rgb;
-			for(y = y1; y <= y2; y++) {
-				rgba->GetLine(x1, y, cnt, buffer, 32, true);
-
-				int index = NAVIE_GLOBAL::nvNLMdenoiser::get_index(0, y, bmp->GetBw()); //Weight index
-				for(b = buffer, x = x1; x <= x2; x++, b += cpp, ++index) {
-					for(int i = 0; i < 3; i++) { b[i] = out_bmp[index][i]; }
-				}
+			// the following frames are not rendered yet, so the temporal filter only looks back.
+			// The whole noisy frame goes into the ring, the next frames search it
+			if(m_frames.capacity() != settings.temporal_radius + 1)
+				m_frames.reset(settings.temporal_radius + 1);
+
+			NAVIE_GLOBAL::nvImage& noisy = m_frames.insert(frame);
+			{
+				NV_TRACE_NAMED_SCOPE(copy_in, "copy in");
+				NV_TRACE_COUNT(copy_in, (unsigned long long)width * height * NAVIE_GLOBAL::nvNLMdenoiser::image_channels(settings) * sizeof(float), (unsigned long long)width * height);
+				done = noisy.resize(width, height, NAVIE_GLOBAL::nvNLMdenoiser::image_channels(settings)) && read_rows(0, 0, height, noisy, 0);
+			}
+			if(done)
+			{
+				dn.denoise_temporal(settings, m_frames, frame, m_temporal_out, region);
 
-				rgba->SetLine(x1, y, cnt, buffer, 32, true);
+				NV_TRACE_NAMED_SCOPE(copy_out, "copy out");
+				NV_TRACE_COUNT(copy_out, (unsigned long long)region.width * region.height * 3 * sizeof(float), (unsigned long long)region.width * region.height);
+				done = write_rows(region.x, region.y, region.height, m_temporal_out, 0);
 			}
-			DeleteMem(buffer);
 		}
+		else
+			done = dn.denoise_streamed(settings, width, height, region, DENOISE_BAND_HEIGHT, read_rows, write_rows);
+
+		if(!done)
+			return RENDERRESULT_OUTOFMEMORY;
 	}
 
 	return RENDERRESULT_OK;
@@ -142,8 +208,19 @@ Bool nvDenoise::Init(GeListNode* node)
 	data->SetInt32(NVDENOISE_PATCHSIZE,7);
 	data->SetFloat(NVDENOISE_STRENGTH,0.4);
 
+	data->SetInt32(NVDENOISE_CPUENGINE,NLM_ENGINE_INTEGRAL);
 	data->SetBool(NVDENOISE_USEGPU,true);
 	data->SetInt32(NVDENOISE_CPUTHREADS,0);
+	data->SetInt32(NVDENOISE_TEMPORALRADIUS,0);
+	data->SetFloat(NVDENOISE_ALBEDOWEIGHT,0.0);
+	data->SetFloat(NVDENOISE_NORMALWEIGHT,0.0);
+	data->SetFloat(NVDENOISE_DEPTHWEIGHT,0.0);
+	data->SetFloat(NVDENOISE_WEIGHTCUTOFF,0.0);
+	data->SetInt32(NVDENOISE_PYRAMIDLEVELS,0);
+	data->SetBool(NVDENOISE_HALFINPUT,false);
+	data->SetBool(NVDENOISE_ADAPTIVE,false);
+	data->SetFloat(NVDENOISE_NOISEFLOOR,0.005);
+	data->SetInt32(NVDENOISE_EDGEMODE,NLM_EDGE_SKIP);
 	return true;
 }
 
@@ -151,5 +228,20 @@ Bool nvDenoise::Init(GeListNode* node)
 
 Bool RegisterDenoiser(void)
 {
+	// compiled OpenCL programs are cached in the user preferences, the plugin folder may be read only
+	Filename cache_path = GeGetC4DPath(C4D_PATH_PREFS) + Filename("nvdenoise_clcache");
+	Char* cache_directory = cache_path.GetString().GetCStringCopy(STRINGENCODING_UTF8);
+	if(cache_directory)
+	{
+		NAVIE_GLOBAL::nvCLRuntime::shared()->set_cache_directory(cache_directory);
+		DeleteMem(cache_directory);
+	}
+
 	return RegisterVideoPostPlugin(DENOISE_PLUGINID, "nvDenoiser", PLUGINFLAG_VIDEOPOST_MULTIPLE, nvDenoise::Alloc, "nvdenoiser", 0, 0);
+}
+
+void FreeDenoiser(void)
+{
+	// release the OpenCL context while the driver is still loaded
+	NAVIE_GLOBAL::nvCLRuntime::release_shared();
 }
\ No newline at end of file
@@ -3,6 +3,7 @@
 
 #include "c4d.h"
 #include "c4d_symbols.h"
+#include "nvdenoise.h"
 
 class nvDenoise : public VideoPostData
 {
@@ -10,11 +11,17 @@ public:
 	virtual RENDERRESULT		Execute				(BaseVideoPost* node, VideoPostStruct* vps);
 	virtual Bool				RenderEngineCheck	(BaseVideoPost* node, Int32 id);
 	virtual VIDEOPOSTINFO		GetRenderInfo		(BaseVideoPost* node) { return VIDEOPOSTINFO_0; }
+	virtual Bool				AllocateBuffers		(BaseVideoPost* node, Render* render, BaseDocument* doc);
 		
 	static NodeData*			Alloc				(void) { return NewObjClear(nvDenoise); }
 
 	virtual Bool Init(GeListNode* node) override;
 
+private:
+	std::shared_ptr<NAVIE_GLOBAL::nvNLMdenoiser>	m_denoiser;	// process wide, keeps the worker pool and scratch alive across frames
+	std::vector<Float32>		m_line;		// interleaved line of the render buffers, grows to the widest frame
+	NAVIE_GLOBAL::nvFrameRing	m_frames;	// noisy frames of the current render for the temporal filter
+	NAVIE_GLOBAL::nvImage		m_temporal_out;
 };
 
 #endif
\ No newline at end of file
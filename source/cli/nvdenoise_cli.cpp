@@ -0,0 +1,606 @@
+/****************************************************************************/
+/* Command line batch denoiser												*/
+/*																			*/
+/* Denoises single frames or frame sequences with nvNLMdenoiser outside of	*/
+/* Cinema 4D. Frames are read, denoised and written by separate threads,	*/
+/* so file I/O overlaps with the filter, and several frames can be			*/
+/* denoised at the same time. Run without arguments for the options.		*/
+/****************************************************************************/
+#include "../nvdenoise.h"
+#include "../nvtrace.h"
+#include "nvimageio.h"
+#ifdef USE_OPENCL
+#include "../nvclruntime.h"
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace NAVIE_GLOBAL;
+
+namespace
+{
+	typedef std::chrono::steady_clock Clock;
+
+	double seconds_since(const Clock::time_point& start)
+	{
+		return std::chrono::duration<double>(Clock::now() - start).count();
+	}
+
+	struct nvCliOptions
+	{
+		nvDenoiseSettings			settings;
+		std::vector<std::string>	inputs;
+		std::string					output;
+		std::string					cl_cache;	// compiled OpenCL programs and launch profiles
+		std::string					trace;		// Chrome trace-event JSON of the run
+		std::string					guides[NLM_GUIDE_COUNT];	// albedo, normal and depth file or pattern
+		nvRawFormat					raw;
+		int							first_frame;
+		int							last_frame;
+		int							parallel_frames;	// frames denoised at the same time
+		int							io_threads;			// reader and writer threads each
+		bool						quiet;
+	};
+
+	/* One frame on its way through the pipeline */
+	struct nvFrame
+	{
+		std::string	input;
+		std::string	output;
+		int			sequence;		// index of the input the frame belongs to
+		int			number;			// frame number within the sequence
+		std::string	guides[NLM_GUIDE_COUNT];	// guide files, empty if not used
+		nvImage		image;
+		double		read_seconds;
+		double		denoise_seconds;
+	};
+
+	/* Blocking queue with a capacity, which limits the frames held in memory */
+	class nvFrameQueue
+	{
+	public:
+		explicit nvFrameQueue(size_t capacity) : m_capacity(capacity), m_producers(0) {}
+
+		void add_producer() { std::lock_guard<std::mutex> lock(m_lock); ++m_producers; }
+
+		/* Called by every producer when it is done, consumers return false once all are done and the queue is empty */
+		void remove_producer()
+		{
+			std::lock_guard<std::mutex> lock(m_lock);
+			--m_producers;
+			m_not_empty.notify_all();
+		}
+
+		void push(std::unique_ptr<nvFrame> frame)
+		{
+			std::unique_lock<std::mutex> lock(m_lock);
+			m_not_full.wait(lock, [this] { return m_frames.size() < m_capacity; });
+			m_frames.push_back(std::move(frame));
+			m_not_empty.notify_one();
+		}
+
+		bool pop(std::unique_ptr<nvFrame>& frame)
+		{
+			std::unique_lock<std::mutex> lock(m_lock);
+			m_not_empty.wait(lock, [this] { return !m_frames.empty() || m_producers == 0; });
+			if(m_frames.empty())
+				return false;
+
+			frame = std::move(m_frames.front());
+			m_frames.pop_front();
+			m_not_full.notify_one();
+			return true;
+		}
+
+	private:
+		std::mutex								m_lock;
+		std::condition_variable					m_not_empty;
+		std::condition_variable					m_not_full;
+		std::deque<std::unique_ptr<nvFrame>>	m_frames;
+		size_t									m_capacity;
+		int										m_producers;
+	};
+
+	void print_usage()
+	{
+		printf(
+			"usage: nvdenoise_cli [options] input... -o output\n"
+			"\n"
+			"Inputs are .pfm, .exr (if built with OpenEXR) or raw interleaved float RGB files.\n"
+			"A run of '#' in an input or output name is replaced by the zero padded frame\n"
+			"number of every frame of --frames. Without '#' and with several inputs the\n"
+			"output is a directory that receives files named like the inputs.\n"
+			"\n"
+			"  -o, --output PATH         output file, pattern or directory\n"
+			"  --frames FIRST-LAST       frame range of '#' patterns\n"
+			"  --raw-size WxH            dimensions of raw float files\n"
+			"  --engine NAME             brute, integral (default), symmetric or opencl\n"
+			"  --isa NAME                auto (default), scalar, sse42, avx2, avx512, neon\n"
+			"  --h VALUE                 filter strength (default 0.4)\n"
+			"  --patch N                 patch size (default 7)\n"
+			"  --search N                search window size (default 20)\n"
+			"  --offset N                search window step (default 3)\n"
+			"  --temporal N              also search N frames before and after every frame\n"
+			"  --pyramid N               also denoise N - 1 halved resolutions (low frequency noise)\n"
+			"  --albedo PATH             albedo pass guiding the filter, file or '#' pattern\n"
+			"  --normal PATH             normal pass guiding the filter\n"
+			"  --depth PATH              depth pass guiding the filter, normalized to [0,1]\n"
+			"  --albedo-weight W         weight of the albedo pass (default 1)\n"
+			"  --normal-weight W         weight of the normal pass (default 1)\n"
+			"  --depth-weight W          weight of the depth pass (default 1)\n"
+			"  --weight-cutoff W         drop weights below W, e.g. 1e-3 (default 0 = exact)\n"
+			"  --half                    opencl: keep the input frames as fp16 on the device\n"
+			"  --adaptive FLOOR          follow the local noise, cells below FLOOR are left as they are\n"
+			"  --edges MODE              patches past the border: skip (default) or clamp\n"
+			"  --threads N               CPU threads of all frames together, 0 = all (default)\n"
+			"  --parallel-frames N       frames denoised at the same time (default 1)\n"
+			"  --io-threads N            reader and writer threads each (default 1)\n"
+			"  --cl-cache DIR            keeps compiled OpenCL programs and tuned launch profiles\n"
+			"  --trace FILE              logs the stages of every frame, writes a Chrome trace\n"
+			"  -q, --quiet               only report errors\n");
+	}
+
+	bool parse_engine(const char* name, int& engine)
+	{
+		if(!strcmp(name, "brute"))			engine = NLM_ENGINE_BRUTEFORCE;
+		else if(!strcmp(name, "integral"))	engine = NLM_ENGINE_INTEGRAL;
+		else if(!strcmp(name, "opencl"))	engine = NLM_ENGINE_OPENCL;
+		else if(!strcmp(name, "symmetric"))	engine = NLM_ENGINE_SYMMETRIC;
+		else return false;
+		return true;
+	}
+
+	bool parse_edges(const char* name, int& edge_mode)
+	{
+		if(!strcmp(name, "skip"))			edge_mode = NLM_EDGE_SKIP;
+		else if(!strcmp(name, "clamp"))		edge_mode = NLM_EDGE_CLAMP;
+		else return false;
+		return true;
+	}
+
+	bool parse_isa(const char* name, int& isa)
+	{
+		static const char* names[] = { "auto", "scalar", "sse42", "avx2", "avx512", "neon" };
+		for(int i = 0; i < 6; ++i)
+		{
+			if(!strcmp(name, names[i]))
+			{
+				isa = NLM_ISA_AUTO + i;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	bool parse_options(int argc, char** argv, nvCliOptions& options)
+	{
+		options.settings.h				= 0.4f;
+		options.settings.patch_size		= 7;
+		options.settings.search_size	= 20;
+		options.settings.search_offset	= 3;
+		options.settings.engine			= NLM_ENGINE_INTEGRAL;
+		options.settings.fallback_engine	= NLM_ENGINE_INTEGRAL;
+		options.settings.threads		= 0;
+		options.settings.isa			= NLM_ISA_AUTO;
+		options.settings.temporal_radius	= 0;
+		options.settings.albedo_weight	= 1.0f;
+		options.settings.normal_weight	= 1.0f;
+		options.settings.depth_weight	= 1.0f;
+		options.settings.weight_cutoff	= 0.0f;
+		options.settings.pyramid_levels	= 0;
+		options.settings.half_input		= 0;
+		options.settings.adaptive		= 0;
+		options.settings.noise_floor	= 0.0f;
+		options.settings.edge_mode		= NLM_EDGE_SKIP;
+		options.raw.width				= 0;
+		options.raw.height				= 0;
+		options.first_frame				= 0;
+		options.last_frame				= -1;
+		options.parallel_frames			= 1;
+		options.io_threads				= 1;
+		options.quiet					= false;
+
+		for(int i = 1; i < argc; ++i)
+		{
+			const char* arg		= argv[i];
+			const char* value	= i + 1 < argc ? argv[i + 1] : nullptr;
+			bool ok				= true;
+
+			if(arg[0] != '-')
+			{
+				options.inputs.push_back(arg);
+				continue;
+			}
+			if(!strcmp(arg, "-q") || !strcmp(arg, "--quiet"))
+			{
+				options.quiet = true;
+				continue;
+			}
+			if(!strcmp(arg, "--half"))
+			{
+				options.settings.half_input = 1;
+				continue;
+			}
+			if(!value)
+			{
+				fprintf(stderr, "missing value of %s\n", arg);
+				return false;
+			}
+			++i;
+
+			if(!strcmp(arg, "-o") || !strcmp(arg, "--output"))	options.output = value;
+			else if(!strcmp(arg, "--frames"))					ok = sscanf(value, "%d-%d", &options.first_frame, &options.last_frame) == 2 && options.first_frame <= options.last_frame;
+			else if(!strcmp(arg, "--raw-size"))					ok = sscanf(value, "%dx%d", &options.raw.width, &options.raw.height) == 2;
+			else if(!strcmp(arg, "--engine"))					ok = parse_engine(value, options.settings.engine);
+			else if(!strcmp(arg, "--isa"))						ok = parse_isa(value, options.settings.isa);
+			else if(!strcmp(arg, "--h"))						ok = (options.settings.h = float(atof(value))) > 0.0f;
+			else if(!strcmp(arg, "--patch"))					ok = (options.settings.patch_size = atoi(value)) > 0;
+			else if(!strcmp(arg, "--search"))					ok = (options.settings.search_size = atoi(value)) > 0;
+			else if(!strcmp(arg, "--offset"))					ok = (options.settings.search_offset = atoi(value)) > 0;
+			else if(!strcmp(arg, "--temporal"))					ok = (options.settings.temporal_radius = atoi(value)) >= 0;
+			else if(!strcmp(arg, "--pyramid"))					ok = (options.settings.pyramid_levels = atoi(value)) >= 0 && options.settings.pyramid_levels <= NLM_MAX_PYRAMID_LEVELS;
+			else if(!strcmp(arg, "--albedo"))					options.guides[NLM_GUIDE_ALBEDO] = value;
+			else if(!strcmp(arg, "--normal"))					options.guides[NLM_GUIDE_NORMAL] = value;
+			else if(!strcmp(arg, "--depth"))					options.guides[NLM_GUIDE_DEPTH] = value;
+			else if(!strcmp(arg, "--albedo-weight"))			ok = (options.settings.albedo_weight = float(atof(value))) >= 0.0f;
+			else if(!strcmp(arg, "--normal-weight"))			ok = (options.settings.normal_weight = float(atof(value))) >= 0.0f;
+			else if(!strcmp(arg, "--depth-weight"))				ok = (options.settings.depth_weight = float(atof(value))) >= 0.0f;
+			else if(!strcmp(arg, "--weight-cutoff"))			ok = (options.settings.weight_cutoff = float(atof(value))) >= 0.0f && options.settings.weight_cutoff < 1.0f;
+			else if(!strcmp(arg, "--adaptive"))
+			{
+				options.settings.adaptive = 1;
+				ok = (options.settings.noise_floor = float(atof(value))) >= 0.0f;
+			}
+			else if(!strcmp(arg, "--edges"))					ok = parse_edges(value, options.settings.edge_mode);
+			else if(!strcmp(arg, "--threads"))					ok = (options.settings.threads = atoi(value)) >= 0;
+			else if(!strcmp(arg, "--parallel-frames"))			ok = (options.parallel_frames = atoi(value)) > 0;
+			else if(!strcmp(arg, "--io-threads"))				ok = (options.io_threads = atoi(value)) > 0;
+			else if(!strcmp(arg, "--cl-cache"))					options.cl_cache = value;
+			else if(!strcmp(arg, "--trace"))					options.trace = value;
+			else
+			{
+				fprintf(stderr, "unknown option %s\n", arg);
+				return false;
+			}
+
+			if(!ok)
+			{
+				fprintf(stderr, "invalid value %s of %s\n", value, arg);
+				return false;
+			}
+		}
+
+		//guides without a pass are not used
+		if(options.guides[NLM_GUIDE_ALBEDO].empty())	options.settings.albedo_weight	= 0.0f;
+		if(options.guides[NLM_GUIDE_NORMAL].empty())	options.settings.normal_weight	= 0.0f;
+		if(options.guides[NLM_GUIDE_DEPTH].empty())		options.settings.depth_weight	= 0.0f;
+
+#ifndef USE_OPENCL
+		if(options.settings.engine == NLM_ENGINE_OPENCL)
+		{
+			fprintf(stderr, "this build has no OpenCL support\n");
+			return false;
+		}
+#endif
+#ifndef USE_TRACE
+		if(!options.trace.empty())
+		{
+			fprintf(stderr, "this build has no tracing support\n");
+			return false;
+		}
+#endif
+		return !options.inputs.empty() && !options.output.empty();
+	}
+
+	/* Replaces the last run of '#' in pattern by the zero padded frame number */
+	std::string expand_pattern(const std::string& pattern, int frame)
+	{
+		const std::string::size_type last = pattern.find_last_of('#');
+		if(last == std::string::npos)
+			return pattern;
+
+		std::string::size_type first = last;
+		while(first > 0 && pattern[first - 1] == '#')
+			--first;
+
+		char number[32];
+		snprintf(number, sizeof(number), "%0*d", int(last - first + 1), frame);
+		return pattern.substr(0, first) + number + pattern.substr(last + 1);
+	}
+
+	std::string file_name(const std::string& path)
+	{
+		const std::string::size_type slash = path.find_last_of("/\\");
+		return slash == std::string::npos ? path : path.substr(slash + 1);
+	}
+
+	/* Reads the color of a frame and the guide passes the settings use into the planes after it */
+	bool read_frame(const nvDenoiseSettings& settings, const nvRawFormat& raw, nvFrame& frame, std::string& error)
+	{
+		nvImage color;
+		if(!nv_read_image(frame.input, raw, color, error))
+			return false;
+
+		const int channels = nvNLMdenoiser::image_channels(settings);
+		if(channels == 3)
+		{
+			frame.image = std::move(color);
+			return true;
+		}
+
+		frame.image.resize(color.width(), color.height(), channels);
+		for(int c = 0; c < 3; ++c)
+			std::copy(color.plane(c), color.plane(c) + size_t(color.stride()) * color.height(), frame.image.plane(c));
+
+		for(int g = 0; g < NLM_GUIDE_COUNT; ++g)
+		{
+			const int plane = nvNLMdenoiser::guide_plane(settings, g);
+			if(plane < 0)
+				continue;
+
+			//gray PFM files come in as three equal planes, depth takes the first one
+			nvImage guide;
+			if(!nv_read_image(frame.guides[g], raw, guide, error))
+				return false;
+			if(guide.width() != color.width() || guide.height() != color.height())
+			{
+				error = frame.guides[g] + ": size differs from " + frame.input;
+				return false;
+			}
+			for(int c = 0; c < NLM_GUIDE_CHANNELS[g]; ++c)
+				std::copy(guide.plane(c), guide.plane(c) + size_t(guide.stride()) * guide.height(), frame.image.plane(plane + c));
+		}
+		return true;
+	}
+
+	/* Temporal filter of all frames arriving in order in noisy. The frame ring holds the */
+	/* temporal_radius frames before and after the frame being denoised */
+	void denoise_sequences(nvNLMdenoiser& denoiser, const nvDenoiseSettings& settings, nvFrameQueue& noisy, nvFrameQueue& denoised)
+	{
+		const int radius = settings.temporal_radius;
+		nvFrameRing ring(2 * radius + 1);
+		std::deque<std::unique_ptr<nvFrame>> pending;
+
+		//denoises the oldest pending frame, the ring keeps its noisy version for the following ones
+		auto denoise_next = [&]
+		{
+			std::unique_ptr<nvFrame> frame = std::move(pending.front());
+			pending.pop_front();
+
+			const Clock::time_point denoise_start = Clock::now();
+			const nvImage& image = *ring.find(frame->number);
+			const nvRect roi = { 0, 0, image.width(), image.height() };
+			denoiser.denoise_temporal(settings, ring, frame->number, frame->image, roi);
+			frame->denoise_seconds = seconds_since(denoise_start);
+			denoised.push(std::move(frame));
+		};
+
+		std::unique_ptr<nvFrame> frame;
+		while(noisy.pop(frame))
+		{
+			if(!pending.empty() && pending.front()->sequence != frame->sequence)
+			{
+				while(!pending.empty())
+					denoise_next();
+				ring.reset(2 * radius + 1);
+			}
+
+			//the slot memory of the dropped frame becomes the output image of this one
+			std::swap(ring.insert(frame->number), frame->image);
+			const int newest = frame->number;
+			pending.push_back(std::move(frame));
+
+			while(!pending.empty() && pending.front()->number + radius <= newest)
+				denoise_next();
+		}
+
+		while(!pending.empty())
+			denoise_next();
+	}
+
+	/* Input and output paths of all frames */
+	std::vector<nvFrame> collect_frames(const nvCliOptions& options)
+	{
+		const bool output_pattern	= options.output.find('#') != std::string::npos;
+		const bool output_directory	= !output_pattern && (options.inputs.size() > 1 || options.inputs[0].find('#') != std::string::npos);
+
+		std::vector<nvFrame> frames;
+		for(size_t i = 0; i < options.inputs.size(); ++i)
+		{
+			const std::string& input = options.inputs[i];
+			const bool sequence = input.find('#') != std::string::npos;
+			const int first	= sequence ? options.first_frame : 0;
+			const int last	= sequence ? options.last_frame : 0;
+
+			for(int f = first; f <= last; ++f)
+			{
+				nvFrame frame;
+				frame.input				= expand_pattern(input, f);
+				frame.sequence			= int(i);
+				frame.number			= f;
+				for(int g = 0; g < NLM_GUIDE_COUNT; ++g)
+					frame.guides[g] = options.guides[g].empty() ? std::string() : expand_pattern(options.guides[g], f);
+				frame.read_seconds		= 0.0;
+				frame.denoise_seconds	= 0.0;
+				if(output_pattern)
+					frame.output = expand_pattern(options.output, f);
+				else if(output_directory)
+					frame.output = options.output + "/" + file_name(frame.input);
+				else
+					frame.output = options.output;
+				frames.push_back(frame);
+			}
+		}
+		return frames;
+	}
+}
+
+int main(int argc, char** argv)
+{
+	nvCliOptions options;
+	if(!parse_options(argc, argv, options))
+	{
+		print_usage();
+		return 2;
+	}
+
+#ifdef USE_TRACE
+	//before the OpenCL queues are created, they profile only for the trace. The file is written at the end
+	if(!options.trace.empty())
+	{
+		nvTrace::instance().set_log_frames(!options.quiet);
+		nvTrace::instance().enable();
+	}
+#endif
+#ifdef USE_OPENCL
+	if(!options.cl_cache.empty())
+		nvCLRuntime::shared()->set_cache_directory(options.cl_cache);
+#endif
+
+	std::vector<nvFrame> frames = collect_frames(options);
+	if(frames.empty())
+	{
+		fprintf(stderr, "no frames, --frames is required for '#' patterns\n");
+		return 2;
+	}
+
+	//the temporal filter needs the frames in order, each one is denoised once its following frames are read
+	const bool temporal = options.settings.temporal_radius > 0;
+	if(temporal)
+		options.parallel_frames = options.io_threads = 1;
+
+	//the CPU threads are split between the frames in flight
+	const int parallel_frames = std::min<int>(options.parallel_frames, int(frames.size()));
+	nvDenoiseSettings settings = options.settings;
+	settings.threads = std::max(1, nvThreadPool::resolve_threads(options.settings.threads) / parallel_frames);
+
+	//at most one frame waits in front of and behind every denoiser
+	nvFrameQueue noisy(parallel_frames);
+	nvFrameQueue denoised(parallel_frames);
+
+	std::atomic<size_t> next_frame(0);
+	std::atomic<int> failures(0);
+	std::mutex report_lock;
+	const Clock::time_point start = Clock::now();
+
+	std::vector<std::thread> threads;
+	for(int i = 0; i < options.io_threads; ++i)
+		noisy.add_producer();
+	for(int i = 0; i < parallel_frames; ++i)
+		denoised.add_producer();
+
+	for(int i = 0; i < options.io_threads; ++i)
+	{
+		threads.push_back(std::thread([&]
+		{
+			for(size_t index; (index = next_frame++) < frames.size(); )
+			{
+				std::unique_ptr<nvFrame> frame(new nvFrame(frames[index]));
+				const Clock::time_point read_start = Clock::now();
+
+				std::string error;
+				NV_TRACE_NAMED_SCOPE(read_file, "read file");
+				if(!read_frame(settings, options.raw, *frame, error))
+				{
+					std::lock_guard<std::mutex> lock(report_lock);
+					fprintf(stderr, "%s\n", error.c_str());
+					++failures;
+					continue;
+				}
+				frame->read_seconds = seconds_since(read_start);
+				NV_TRACE_COUNT(read_file, (unsigned long long)frame->image.width() * frame->image.height() * frame->image.channels() * sizeof(float), (unsigned long long)frame->image.width() * frame->image.height());
+				NV_TRACE_END(read_file);
+				noisy.push(std::move(frame));
+			}
+			noisy.remove_producer();
+		}));
+	}
+
+	for(int i = 0; i < parallel_frames; ++i)
+	{
+		threads.push_back(std::thread([&]
+		{
+			//every frame worker has its own denoiser with its own thread pool and scratch memory
+			nvNLMdenoiser denoiser;
+			nvImage result;
+
+			std::unique_ptr<nvFrame> frame;
+			if(temporal)
+			{
+				denoise_sequences(denoiser, settings, noisy, denoised);
+				denoised.remove_producer();
+				return;
+			}
+
+			while(noisy.pop(frame))
+			{
+				const Clock::time_point denoise_start = Clock::now();
+				const nvRect roi = { 0, 0, frame->image.width(), frame->image.height() };
+				{
+					NV_TRACE_FRAME(frame->number);
+					denoiser.denoise(settings, frame->image, result, roi);
+				}
+				std::swap(frame->image, result);
+				frame->denoise_seconds = seconds_since(denoise_start);
+				denoised.push(std::move(frame));
+			}
+			denoised.remove_producer();
+		}));
+	}
+
+	for(int i = 0; i < options.io_threads; ++i)
+	{
+		threads.push_back(std::thread([&]
+		{
+			std::unique_ptr<nvFrame> frame;
+			while(denoised.pop(frame))
+			{
+				const Clock::time_point write_start = Clock::now();
+
+				std::string error;
+				NV_TRACE_NAMED_SCOPE(write_file, "write file");
+				NV_TRACE_COUNT(write_file, (unsigned long long)frame->image.width() * frame->image.height() * frame->image.channels() * sizeof(float), (unsigned long long)frame->image.width() * frame->image.height());
+				const bool written = nv_write_image(frame->output, frame->image, error);
+				NV_TRACE_END(write_file);
+
+				std::lock_guard<std::mutex> lock(report_lock);
+				if(!written)
+				{
+					fprintf(stderr, "%s\n", error.c_str());
+					++failures;
+				}
+				else if(!options.quiet)
+				{
+					printf("%s -> %s  %dx%d  read %.3fs  denoise %.3fs  write %.3fs\n", frame->input.c_str(), frame->output.c_str(),
+						   frame->image.width(), frame->image.height(), frame->read_seconds, frame->denoise_seconds, seconds_since(write_start));
+				}
+			}
+		}));
+	}
+
+	for(size_t i = 0; i < threads.size(); ++i)
+		threads[i].join();
+
+#ifdef USE_TRACE
+	if(!options.trace.empty() && !nvTrace::instance().write(options.trace))
+		++failures;
+#endif
+
+	if(!options.quiet)
+	{
+		const double seconds = seconds_since(start);
+		printf("%d of %d frames in %.3fs (%.2f frames/s)\n", int(frames.size()) - failures, int(frames.size()), seconds, frames.size() / seconds);
+	}
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,313 @@
+#include "nvimageio.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#ifdef USE_OPENEXR
+#include <ImfRgbaFile.h>
+#include <ImfArray.h>
+#endif
+
+namespace
+{
+	enum nvFileFormat
+	{
+		FILE_FORMAT_RAW = 0,
+		FILE_FORMAT_PFM,
+		FILE_FORMAT_EXR
+	};
+
+	nvFileFormat file_format(const std::string& path)
+	{
+		const std::string::size_type dot = path.find_last_of('.');
+		if(dot == std::string::npos)
+			return FILE_FORMAT_RAW;
+
+		std::string extension = path.substr(dot + 1);
+		std::transform(extension.begin(), extension.end(), extension.begin(), [](char c) { return char(tolower(c)); });
+		if(extension == "pfm")
+			return FILE_FORMAT_PFM;
+		if(extension == "exr")
+			return FILE_FORMAT_EXR;
+		return FILE_FORMAT_RAW;
+	}
+
+	bool host_is_little_endian()
+	{
+		const unsigned int one = 1;
+		unsigned char first;
+		memcpy(&first, &one, 1);
+		return first == 1;
+	}
+
+	void swap_bytes(float* values, size_t count)
+	{
+		for(size_t i = 0; i < count; ++i)
+		{
+			unsigned char* b = reinterpret_cast<unsigned char*>(values + i);
+			std::swap(b[0], b[3]);
+			std::swap(b[1], b[2]);
+		}
+	}
+
+	/* Closes the file when leaving the scope */
+	struct nvFile
+	{
+		FILE* f;
+		nvFile(const std::string& path, const char* mode) : f(fopen(path.c_str(), mode)) {}
+		~nvFile() { if(f) fclose(f); }
+	};
+
+	/* PFM header tokens are separated by one or more whitespace characters */
+	bool read_token(FILE* f, char* token, size_t size)
+	{
+		int c;
+		while((c = fgetc(f)) != EOF && isspace(c)) {}
+
+		size_t n = 0;
+		while(c != EOF && !isspace(c) && n + 1 < size)
+		{
+			token[n++] = char(c);
+			c = fgetc(f);
+		}
+		token[n] = 0;
+		return n > 0;
+	}
+
+	bool read_pfm(const std::string& path, NAVIE_GLOBAL::nvImage& image, std::string& error)
+	{
+		nvFile file(path, "rb");
+		if(!file.f)
+		{
+			error = "cannot open " + path;
+			return false;
+		}
+
+		char magic[8], width_token[16], height_token[16], scale_token[32];
+		if(!read_token(file.f, magic, sizeof(magic)) || !read_token(file.f, width_token, sizeof(width_token)) ||
+		   !read_token(file.f, height_token, sizeof(height_token)) || !read_token(file.f, scale_token, sizeof(scale_token)))
+		{
+			error = "invalid PFM header in " + path;
+			return false;
+		}
+		//exactly one whitespace character follows the scale, read_token consumed it
+
+		const int channels	= strcmp(magic, "PF") == 0 ? 3 : (strcmp(magic, "Pf") == 0 ? 1 : 0);
+		const int width		= atoi(width_token);
+		const int height	= atoi(height_token);
+		const float scale	= float(atof(scale_token));
+		if(!channels || width <= 0 || height <= 0 || scale == 0.0f)
+		{
+			error = "invalid PFM header in " + path;
+			return false;
+		}
+
+		if(!image.resize(width, height, 3))
+		{
+			error = "out of memory reading " + path;
+			return false;
+		}
+
+		//negative scale means little endian, rows are stored bottom to top
+		const bool swap = (scale < 0.0f) != host_is_little_endian();
+		std::vector<float> row(size_t(width) * channels);
+		for(int y = height - 1; y >= 0; --y)
+		{
+			if(fread(&row[0], sizeof(float), row.size(), file.f) != row.size())
+			{
+				error = "unexpected end of " + path;
+				return false;
+			}
+			if(swap)
+				swap_bytes(&row[0], row.size());
+
+			if(channels == 3)
+				image.set_row_interleaved(y, 0, width, &row[0], 3);
+			else
+			{
+				for(int dim = 0; dim < 3; ++dim)
+					std::copy(row.begin(), row.end(), image.row(dim, y));
+			}
+		}
+		return true;
+	}
+
+	bool write_pfm(const std::string& path, const NAVIE_GLOBAL::nvImage& image, std::string& error)
+	{
+		nvFile file(path, "wb");
+		if(!file.f)
+		{
+			error = "cannot create " + path;
+			return false;
+		}
+
+		fprintf(file.f, "PF\n%d %d\n%s\n", image.width(), image.height(), host_is_little_endian() ? "-1.0" : "1.0");
+
+		std::vector<float> row(size_t(image.width()) * 3);
+		for(int y = image.height() - 1; y >= 0; --y)
+		{
+			image.get_row_interleaved(y, 0, image.width(), &row[0], 3);
+			if(fwrite(&row[0], sizeof(float), row.size(), file.f) != row.size())
+			{
+				error = "cannot write " + path;
+				return false;
+			}
+		}
+		return true;
+	}
+
+	bool read_raw(const std::string& path, const NAVIE_GLOBAL::nvRawFormat& raw, NAVIE_GLOBAL::nvImage& image, std::string& error)
+	{
+		if(raw.width <= 0 || raw.height <= 0)
+		{
+			error = "raw frame " + path + " needs --raw-size";
+			return false;
+		}
+
+		nvFile file(path, "rb");
+		if(!file.f)
+		{
+			error = "cannot open " + path;
+			return false;
+		}
+
+		if(!image.resize(raw.width, raw.height, 3))
+		{
+			error = "out of memory reading " + path;
+			return false;
+		}
+
+		std::vector<float> row(size_t(raw.width) * 3);
+		for(int y = 0; y < raw.height; ++y)
+		{
+			if(fread(&row[0], sizeof(float), row.size(), file.f) != row.size())
+			{
+				error = "raw frame " + path + " is smaller than --raw-size";
+				return false;
+			}
+			image.set_row_interleaved(y, 0, raw.width, &row[0], 3);
+		}
+		return true;
+	}
+
+	bool write_raw(const std::string& path, const NAVIE_GLOBAL::nvImage& image, std::string& error)
+	{
+		nvFile file(path, "wb");
+		if(!file.f)
+		{
+			error = "cannot create " + path;
+			return false;
+		}
+
+		std::vector<float> row(size_t(image.width()) * 3);
+		for(int y = 0; y < image.height(); ++y)
+		{
+			image.get_row_interleaved(y, 0, image.width(), &row[0], 3);
+			if(fwrite(&row[0], sizeof(float), row.size(), file.f) != row.size())
+			{
+				error = "cannot write " + path;
+				return false;
+			}
+		}
+		return true;
+	}
+
+#ifdef USE_OPENEXR
+	bool read_exr(const std::string& path, NAVIE_GLOBAL::nvImage& image, std::string& error)
+	{
+		try
+		{
+			Imf::RgbaInputFile file(path.c_str());
+			const Imath::Box2i window = file.dataWindow();
+			const int width		= window.max.x - window.min.x + 1;
+			const int height	= window.max.y - window.min.y + 1;
+
+			Imf::Array2D<Imf::Rgba> pixels(height, width);
+			file.setFrameBuffer(&pixels[0][0] - window.min.x - window.min.y * width, 1, width);
+			file.readPixels(window.min.y, window.max.y);
+
+			if(!image.resize(width, height, 3))
+			{
+				error = "out of memory reading " + path;
+				return false;
+			}
+
+			for(int y = 0; y < height; ++y)
+			{
+				float* r = image.row(0, y);
+				float* g = image.row(1, y);
+				float* b = image.row(2, y);
+				for(int x = 0; x < width; ++x)
+				{
+					r[x] = pixels[y][x].r;
+					g[x] = pixels[y][x].g;
+					b[x] = pixels[y][x].b;
+				}
+			}
+		}
+		catch(const std::exception& e)
+		{
+			error = path + ": " + e.what();
+			return false;
+		}
+		return true;
+	}
+
+	bool write_exr(const std::string& path, const NAVIE_GLOBAL::nvImage& image, std::string& error)
+	{
+		try
+		{
+			const int width		= image.width();
+			const int height	= image.height();
+
+			Imf::Array2D<Imf::Rgba> pixels(height, width);
+			for(int y = 0; y < height; ++y)
+			{
+				for(int x = 0; x < width; ++x)
+					pixels[y][x] = Imf::Rgba(image.at(0, x, y), image.at(1, x, y), image.at(2, x, y), 1.0f);
+			}
+
+			Imf::RgbaOutputFile file(path.c_str(), width, height, Imf::WRITE_RGB);
+			file.setFrameBuffer(&pixels[0][0], 1, width);
+			file.writePixels(height);
+		}
+		catch(const std::exception& e)
+		{
+			error = path + ": " + e.what();
+			return false;
+		}
+		return true;
+	}
+#endif
+}
+
+bool NAVIE_GLOBAL::nv_read_image(const std::string& path, const nvRawFormat& raw, nvImage& image, std::string& error)
+{
+	switch(file_format(path))
+	{
+		case FILE_FORMAT_PFM:	return read_pfm(path, image, error);
+#ifdef USE_OPENEXR
+		case FILE_FORMAT_EXR:	return read_exr(path, image, error);
+#else
+		case FILE_FORMAT_EXR:	error = "this build cannot read EXR files (" + path + ")"; return false;
+#endif
+		default:				return read_raw(path, raw, image, error);
+	}
+}
+
+bool NAVIE_GLOBAL::nv_write_image(const std::string& path, const nvImage& image, std::string& error)
+{
+	switch(file_format(path))
+	{
+		case FILE_FORMAT_PFM:	return write_pfm(path, image, error);
+#ifdef USE_OPENEXR
+		case FILE_FORMAT_EXR:	return write_exr(path, image, error);
+#else
+		case FILE_FORMAT_EXR:	error = "this build cannot write EXR files (" + path + ")"; return false;
+#endif
+		default:				return write_raw(path, image, error);
+	}
+}
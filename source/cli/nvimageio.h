@@ -0,0 +1,31 @@
+#ifndef NVIMAGEIO_H_
+#define NVIMAGEIO_H_
+
+#include "../nvimage.h"
+#include <string>
+
+namespace NAVIE_GLOBAL
+{
+	/****************************************************************************/
+	/* Frame files of the command line denoiser									*/
+	/*																			*/
+	/*	.pfm	portable float map, color (PF) or gray (Pf, read as gray RGB)	*/
+	/*	.exr	OpenEXR RGB(A), only if built with USE_OPENEXR. Alpha is		*/
+	/*			dropped, the result is written as half float RGB				*/
+	/*	other	raw interleaved 32 bit float RGB in host byte order, the		*/
+	/*			dimensions must be given since the file has no header			*/
+	/****************************************************************************/
+	struct nvRawFormat
+	{
+		int width;
+		int height;
+	};
+
+	/* Reads path into a 3 channel image. On failure returns false and sets error */
+	bool nv_read_image(const std::string& path, const nvRawFormat& raw, nvImage& image, std::string& error);
+
+	/* Writes the first 3 channels of image to path, the format follows the file extension */
+	bool nv_write_image(const std::string& path, const nvImage& image, std::string& error);
+}
+
+#endif
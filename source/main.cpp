@@ -1,6 +1,7 @@
 #include "c4d.h"
 
 Bool RegisterDenoiser(void);
+void FreeDenoiser(void);
 
 Bool PluginStart(void)
 {
@@ -12,6 +13,7 @@ Bool PluginStart(void)
 
 void PluginEnd(void)
 {
+	FreeDenoiser();
 }
 
 Bool PluginMessage(Int32 id, void *data)
@@ -0,0 +1,384 @@
+#include "nvclruntime.h"
+#include "nvlog.h"
+#include "nvpool.h"
+#include "nvtrace.h"
+
+#include <chrono>
+#include <cstdio>
+#include <sstream>
+
+#include <boost/compute/system.hpp>
+
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+namespace
+{
+	std::mutex								g_shared_lock;
+	std::shared_ptr<NAVIE_GLOBAL::nvCLRuntime>	g_shared;
+
+	/* 64 bit FNV-1a */
+	unsigned long long hash_string(const std::string& text, unsigned long long hash = 14695981039346656037ULL)
+	{
+		for(size_t i = 0; i < text.size(); ++i)
+		{
+			hash ^= (unsigned char)text[i];
+			hash *= 1099511628211ULL;
+		}
+		return hash;
+	}
+
+	double elapsed_ms(const std::chrono::high_resolution_clock::time_point& start)
+	{
+		return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+	}
+
+	bool read_file(const std::string& path, std::vector<unsigned char>& data)
+	{
+		FILE* file = fopen(path.c_str(), "rb");
+		if(!file)
+			return false;
+
+		fseek(file, 0, SEEK_END);
+		const long size = ftell(file);
+		fseek(file, 0, SEEK_SET);
+
+		bool ok = size > 0;
+		if(ok)
+		{
+			data.resize(size);
+			ok = fread(&data[0], 1, size, file) == size_t(size);
+		}
+		fclose(file);
+		return ok;
+	}
+
+	/* Writes to a temporary file first, so a concurrent reader never sees a partial binary */
+	bool write_file(const std::string& path, const std::vector<unsigned char>& data)
+	{
+		const std::string temporary = path + ".tmp";
+		FILE* file = fopen(temporary.c_str(), "wb");
+		if(!file)
+			return false;
+
+		const bool ok = fwrite(&data[0], 1, data.size(), file) == data.size();
+		fclose(file);
+
+		remove(path.c_str());
+		if(!ok || rename(temporary.c_str(), path.c_str()) != 0)
+		{
+			remove(temporary.c_str());
+			return false;
+		}
+		return true;
+	}
+
+	void make_directory(const std::string& path)
+	{
+#ifdef _WIN32
+		_mkdir(path.c_str());
+#else
+		mkdir(path.c_str(), 0755);
+#endif
+	}
+}
+
+NAVIE_GLOBAL::nvCLRuntime::nvCLRuntime()
+	: m_initialized(false), m_unavailable(false), m_profiles_loaded(false)
+{
+}
+
+NAVIE_GLOBAL::nvCLRuntime::~nvCLRuntime()
+{
+	try
+	{
+		for(size_t slot = 0; slot < m_pinned.size(); ++slot)
+			release_pinned(slot);
+	}
+	catch(boost::compute::opencl_error& e) { nv_log("nvDenoise: %s", e.what()); }
+}
+
+std::shared_ptr<NAVIE_GLOBAL::nvCLRuntime> NAVIE_GLOBAL::nvCLRuntime::shared()
+{
+	std::lock_guard<std::mutex> guard(g_shared_lock);
+	if(!g_shared)
+		g_shared = std::make_shared<nvCLRuntime>();
+	return g_shared;
+}
+
+void NAVIE_GLOBAL::nvCLRuntime::release_shared()
+{
+	std::lock_guard<std::mutex> guard(g_shared_lock);
+	g_shared.reset();
+}
+
+void NAVIE_GLOBAL::nvCLRuntime::set_cache_directory(const std::string& directory)
+{
+	std::lock_guard<std::mutex> guard(m_mutex);
+	m_cache_directory = directory;
+	m_profiles_loaded = false;
+}
+
+bool NAVIE_GLOBAL::nvCLRuntime::initialize()
+{
+	if(m_initialized)
+		return true;
+	if(m_unavailable)
+		return false;
+
+	try
+	{
+		const std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+
+		m_device	= boost::compute::system::default_device();
+		m_context	= boost::compute::context(m_device);
+		//the trace reads the device times of the commands, profiling is only switched on for it
+		const cl_command_queue_properties properties = NV_TRACE_ENABLED() ? boost::compute::command_queue::enable_profiling : 0;
+		m_queue				= boost::compute::command_queue(m_context, m_device, properties);
+		m_upload_queue		= boost::compute::command_queue(m_context, m_device, properties);
+		m_download_queue	= boost::compute::command_queue(m_context, m_device, properties);
+
+		nv_log("nvDenoise: OpenCL device %s (%s), context created in %.1f ms", m_device.name().c_str(), m_device.driver_version().c_str(), elapsed_ms(start));
+	}
+	catch(boost::compute::opencl_error& e)
+	{
+		nv_log("nvDenoise: no OpenCL device available (%s), the CPU engine runs instead", e.error_string().c_str());
+		m_unavailable = true;
+		return false;
+	}
+	catch(boost::compute::no_device_found&)
+	{
+		nv_log("nvDenoise: no OpenCL device available, the CPU engine runs instead");
+		m_unavailable = true;
+		return false;
+	}
+
+	m_initialized = true;
+	return true;
+}
+
+boost::compute::kernel& NAVIE_GLOBAL::nvCLRuntime::kernel(const std::string& source, const std::string& options, const std::string& name)
+{
+	std::ostringstream key;
+	key << std::hex << hash_string(source) << '|' << options;
+
+	std::map<std::string, boost::compute::program>::iterator program = m_programs.find(key.str());
+	if(program == m_programs.end())
+	{
+		//a failed build fails the same way again, every band and frame would pay for the compile
+		if(m_failed_programs.count(key.str()))
+			throw boost::compute::opencl_error(CL_BUILD_PROGRAM_FAILURE);
+
+		try
+		{
+			program = m_programs.insert(std::make_pair(key.str(), build_program(source, options))).first;
+		}
+		catch(boost::compute::opencl_error&)
+		{
+			m_failed_programs.insert(key.str());
+			nv_log("nvDenoise: OpenCL program with options \"%s\" failed to build, it is not compiled again", options.c_str());
+			throw;
+		}
+	}
+
+	key << '|' << name;
+	std::map<std::string, boost::compute::kernel>::iterator kernel = m_kernels.find(key.str());
+	if(kernel == m_kernels.end())
+		kernel = m_kernels.insert(std::make_pair(key.str(), boost::compute::kernel(program->second, name))).first;
+
+	return kernel->second;
+}
+
+boost::compute::buffer& NAVIE_GLOBAL::nvCLRuntime::buffer(int slot, size_t bytes)
+{
+	if(m_buffers.size() <= size_t(slot))
+	{
+		m_buffers.resize(slot + 1);
+		m_buffer_owners.resize(slot + 1, nullptr);
+	}
+
+	boost::compute::buffer& buffer = m_buffers[slot];
+	if(buffer.get() == 0 || buffer.size() < bytes)
+	{
+		buffer = boost::compute::buffer(m_context, bytes);
+		nv_pool_count(bytes);
+		m_buffer_owners[slot] = nullptr;
+	}
+
+	return buffer;
+}
+
+void* NAVIE_GLOBAL::nvCLRuntime::pinned(int slot, size_t bytes)
+{
+	if(m_pinned.size() <= size_t(slot))
+	{
+		m_pinned_buffers.resize(slot + 1);
+		m_pinned.resize(slot + 1, nullptr);
+	}
+
+	if(m_pinned[slot] && m_pinned_buffers[slot].size() >= bytes)
+		return m_pinned[slot];
+
+	//CL_MEM_ALLOC_HOST_PTR lets the driver allocate page locked memory, mapping it once gives the
+	//host a pointer the copies use directly
+	release_pinned(slot);
+	m_pinned_buffers[slot]	= boost::compute::buffer(m_context, bytes, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR);
+	nv_pool_count(bytes);
+	m_pinned[slot]			= m_queue.enqueue_map_buffer(m_pinned_buffers[slot], CL_MAP_READ | CL_MAP_WRITE, 0, bytes);
+	return m_pinned[slot];
+}
+
+void NAVIE_GLOBAL::nvCLRuntime::release_pinned(size_t slot)
+{
+	if(!m_pinned[slot])
+		return;
+
+	m_queue.enqueue_unmap_buffer(m_pinned_buffers[slot], m_pinned[slot]).wait();
+	m_pinned[slot] = nullptr;
+}
+
+bool NAVIE_GLOBAL::nvCLRuntime::claim_buffer(int slot, const void* owner)
+{
+	if(m_buffer_owners.size() <= size_t(slot))
+		m_buffer_owners.resize(slot + 1, nullptr);
+
+	const bool kept = m_buffer_owners[slot] == owner;
+	m_buffer_owners[slot] = owner;
+	return kept;
+}
+
+boost::compute::program NAVIE_GLOBAL::nvCLRuntime::build_program(const std::string& source, const std::string& options)
+{
+	const std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+	const std::string path = binary_path(source, options);
+
+	//a binary from a previous session
+	std::vector<unsigned char> binary;
+	if(!path.empty() && read_file(path, binary))
+	{
+		try
+		{
+			boost::compute::program program = boost::compute::program::create_with_binary(binary, m_context);
+			program.build(options);
+
+			nv_log("nvDenoise: loaded cached OpenCL program in %.1f ms", elapsed_ms(start));
+			return program;
+		}
+		catch(boost::compute::opencl_error&)
+		{
+			//stale or foreign binary, fall through and rebuild it
+		}
+	}
+
+	boost::compute::program program = boost::compute::program::build_with_source(source, m_context, options);
+	nv_log("nvDenoise: compiled OpenCL program in %.1f ms", elapsed_ms(start));
+
+	if(!path.empty())
+	{
+		make_directory(m_cache_directory);
+		binary = program.binary();
+		if(binary.empty() || !write_file(path, binary))
+			nv_log("nvDenoise: could not write OpenCL program cache %s", path.c_str());
+	}
+	return program;
+}
+
+std::string NAVIE_GLOBAL::nvCLRuntime::binary_path(const std::string& source, const std::string& options) const
+{
+	if(m_cache_directory.empty())
+		return std::string();
+
+	//everything that can make a binary unusable is part of the key
+	unsigned long long hash = device_hash();
+	hash = hash_string(options, hash);
+	hash = hash_string(source, hash);
+
+	char name[32];
+	snprintf(name, sizeof(name), "nlm_%016llx.bin", hash);
+	return cache_file(name);
+}
+
+std::string NAVIE_GLOBAL::nvCLRuntime::profile_path() const
+{
+	if(m_cache_directory.empty())
+		return std::string();
+
+	char name[40];
+	snprintf(name, sizeof(name), "profiles_%016llx.txt", device_hash());
+	return cache_file(name);
+}
+
+unsigned long long NAVIE_GLOBAL::nvCLRuntime::device_hash() const
+{
+	unsigned long long hash = hash_string(m_device.platform().name());
+	hash = hash_string(m_device.platform().version(), hash);
+	hash = hash_string(m_device.name(), hash);
+	hash = hash_string(m_device.vendor(), hash);
+	hash = hash_string(m_device.version(), hash);
+	return hash_string(m_device.driver_version(), hash);
+}
+
+std::string NAVIE_GLOBAL::nvCLRuntime::cache_file(const char* name) const
+{
+	const char last = m_cache_directory[m_cache_directory.size() - 1];
+	if(last == '/' || last == '\\')
+		return m_cache_directory + name;
+	return m_cache_directory + "/" + name;
+}
+
+bool NAVIE_GLOBAL::nvCLRuntime::profile(const std::string& key, std::string& value)
+{
+	if(!m_forced_profile.empty())
+	{
+		value = m_forced_profile;
+		return true;
+	}
+
+	//one "key value" line per profile
+	if(!m_profiles_loaded)
+	{
+		m_profiles_loaded = true;
+		std::vector<unsigned char> data;
+		const std::string path = profile_path();
+		if(!path.empty() && read_file(path, data))
+		{
+			std::istringstream lines(std::string(data.begin(), data.end()));
+			std::string line;
+			while(std::getline(lines, line))
+			{
+				const std::string::size_type space = line.find(' ');
+				if(space != std::string::npos)
+					m_profiles[line.substr(0, space)] = line.substr(space + 1);
+			}
+		}
+	}
+
+	std::map<std::string, std::string>::const_iterator found = m_profiles.find(key);
+	if(found == m_profiles.end())
+		return false;
+	value = found->second;
+	return true;
+}
+
+void NAVIE_GLOBAL::nvCLRuntime::set_profile(const std::string& key, const std::string& value)
+{
+	if(!m_forced_profile.empty())
+		return;
+
+	m_profiles[key] = value;
+
+	const std::string path = profile_path();
+	if(path.empty())
+		return;
+
+	std::string text;
+	for(std::map<std::string, std::string>::const_iterator p = m_profiles.begin(); p != m_profiles.end(); ++p)
+		text += p->first + ' ' + p->second + '\n';
+
+	make_directory(m_cache_directory);
+	if(!write_file(path, std::vector<unsigned char>(text.begin(), text.end())))
+		nv_log("nvDenoise: could not write OpenCL launch profiles %s", path.c_str());
+}
@@ -0,0 +1,124 @@
+#ifndef NVCLRUNTIME_H_
+#define NVCLRUNTIME_H_
+
+#include <boost/compute/core.hpp>
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace NAVIE_GLOBAL
+{
+	/****************************************************************************/
+	/* Long lived OpenCL state of the denoiser									*/
+	/*																			*/
+	/* Holds the device, context, command queue, the compiled programs and		*/
+	/* the device buffers between frames, so only the first frame pays for		*/
+	/* context creation and kernel compilation. Compiled programs are also		*/
+	/* written to a cache directory, keyed by platform, device, driver, build	*/
+	/* options and source, which makes the first frame of the next session		*/
+	/* cheap as well. The same directory keeps the launch profiles of the		*/
+	/* auto tuner.																*/
+	/*																			*/
+	/* Besides the compute queue there is one queue for uploads and one for	*/
+	/* downloads, so copies of one part of a frame run while another part is	*/
+	/* filtered. Host memory the copies go through comes from pinned(), which	*/
+	/* the driver can transfer without an extra copy.							*/
+	/*																			*/
+	/* The runtime is shared by all denoiser instances of the process. Callers	*/
+	/* lock mutex() for the duration of a frame.								*/
+	/****************************************************************************/
+	class nvCLRuntime
+	{
+	public:
+		nvCLRuntime();
+		~nvCLRuntime();
+
+		/* Process wide runtime, created on first use */
+		static std::shared_ptr<nvCLRuntime> shared();
+		/* Drops the process wide runtime. Call before the OpenCL driver gets unloaded */
+		static void release_shared();
+
+		/* Directory for compiled program binaries, an empty path disables the disk cache */
+		void set_cache_directory(const std::string& directory);
+		const std::string& cache_directory() const { return m_cache_directory; }
+
+		/* Creates device, context and queue on first call. Returns false if no device is available, */
+		/* later calls fail at once without looking for one again */
+		bool initialize();
+		bool is_initialized() const { return m_initialized; }
+
+		/* Kernel name of the program built from source with options. Each program is compiled */
+		/* once per runtime, or loaded from the binary cache. A program that failed to build throws */
+		/* at once on later calls instead of being compiled again */
+		boost::compute::kernel& kernel(const std::string& source, const std::string& options, const std::string& name);
+
+		/* Device buffer kept between frames. It is reallocated only when it has to grow */
+		boost::compute::buffer& buffer(int slot, size_t bytes);
+
+		/* Host memory of bytes that stays mapped to a device buffer allocated by the driver (pinned */
+		/* memory) and is kept between frames. It is reallocated only when it has to grow */
+		void* pinned(int slot, size_t bytes);
+
+		/* Makes owner the user of buffer slot. Returns true if the content owner left in the slot is */
+		/* still there, i.e. nobody else claimed it and it was not reallocated since */
+		bool claim_buffer(int slot, const void* owner);
+
+		/* Launch profile stored under key for the current device and driver. Profiles live in memory and, */
+		/* with a cache directory, in one text file per device and driver */
+		bool profile(const std::string& key, std::string& value);
+		void set_profile(const std::string& key, const std::string& value);
+		/* Returns value for every profile key and keeps new profiles out of the cache, so a test can */
+		/* run each launch variant. An empty value goes back to the stored profiles */
+		void force_profile(const std::string& value) { m_forced_profile = value; }
+
+		const boost::compute::device&	device() const	{ return m_device; }
+		boost::compute::context&		context()		{ return m_context; }
+		boost::compute::command_queue&	queue()			{ return m_queue; }
+		boost::compute::command_queue&	upload_queue()	{ return m_upload_queue; }
+		boost::compute::command_queue&	download_queue()	{ return m_download_queue; }
+
+		std::mutex& mutex() { return m_mutex; }
+
+	private:
+		boost::compute::program build_program(const std::string& source, const std::string& options);
+		/* Path of the cached binary of source/options on the current device, empty if caching is off */
+		std::string binary_path(const std::string& source, const std::string& options) const;
+		/* Path of the launch profiles of the current device, empty if caching is off */
+		std::string profile_path() const;
+		/* Hash of everything that identifies the device and its driver */
+		unsigned long long device_hash() const;
+		/* Path of name in the cache directory */
+		std::string cache_file(const char* name) const;
+		/* Unmaps the host memory of pinned slot */
+		void release_pinned(size_t slot);
+
+		bool										m_initialized;
+		bool										m_unavailable;	// initialize() found no device
+		std::string									m_cache_directory;
+
+		boost::compute::device						m_device;
+		boost::compute::context						m_context;
+		boost::compute::command_queue				m_queue;
+		boost::compute::command_queue				m_upload_queue;
+		boost::compute::command_queue				m_download_queue;
+
+		std::map<std::string, boost::compute::program>	m_programs;	// by options and source
+		std::map<std::string, boost::compute::kernel>	m_kernels;	// by program key and kernel name
+		std::set<std::string>							m_failed_programs;	// keys of m_programs that did not build
+		std::vector<boost::compute::buffer>				m_buffers;	// by slot
+		std::vector<const void*>						m_buffer_owners;	// last claim_buffer caller, by slot
+		std::vector<boost::compute::buffer>				m_pinned_buffers;	// by pinned slot
+		std::vector<void*>								m_pinned;	// mapped host memory of m_pinned_buffers
+		std::map<std::string, std::string>				m_profiles;	// by key
+		bool											m_profiles_loaded;
+		std::string										m_forced_profile;	// force_profile(), empty if none
+
+		std::mutex									m_mutex;
+	};
+}
+
+#endif
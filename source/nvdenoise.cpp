@@ -1,143 +1,567 @@
 #include "nvdenoise.h"
-#include <navie_math.h>
-#include "c4d.h"
+#include "nvtrace.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <limits>
 
-#define USE_MP
-#ifdef USE_MP
-#include <thread.h>
+namespace
+{
+	//tile edge length handed to the scheduler, small enough to balance well near borders
+	const int NLM_TILE_SIZE = 32;
+
+	inline float sqr(float x) { return x * x; }
+
+	/* Weighted sums (accum[0..3*count)) and normalizing factors (accum[3*count..6*count)) of the count */
+	/* pixels starting at (x,y). frame_planes holds 3 color planes and the guide planes per searched */
+	/* frame, the current frame first. Visits the search windows in the same order as the per pixel loop, */
+	/* only the offsets marked in axis if given (noise adaptive mode) */
+	void accumulate_run(const NAVIE_GLOBAL::nvNLMKernels& kernels, const nvDenoiseSettings& settings, const std::vector<const float*>& frame_planes, int stride,
+						int guides, const float* guide_weights, double h2, float max_dist, const char* axis, int x, int y, int count, float* accum)
+	{
+		const int patch_size_half = (settings.patch_size - 1) / 2;
+		const int seach_size_half = (settings.search_size - 1) / 2;
+
+		for(int i = 0; i < 6 * count; ++i)
+			accum[i] = 0.0f;
+
+		const NAVIE_GLOBAL::nvNLMBlockKernel accumulate = kernels.block_kernel(settings.patch_size);
+
+		NAVIE_GLOBAL::nvNLMBlock block;
+		block.stride		= stride;
+		block.patch_size	= settings.patch_size;
+		block.h2			= h2;
+		block.max_dist		= max_dist;
+		block.count			= count;
+		block.guides		= guides;
+		for(int g = 0; g < guides; ++g)
+			block.gweight[g] = guide_weights[g];
+		for(int dim = 0; dim < 3; ++dim)
+		{
+			block.out[dim]	= accum + dim * count;
+			block.norm[dim]	= accum + (3 + dim) * count;
+		}
+
+		const int patch_p = (y - patch_size_half) * stride + x - patch_size_half;
+		const size_t frame_stride = 3 + guides;
+		for(size_t f = 0; f < frame_planes.size(); f += frame_stride)
+		{
+			const float* const* qplanes = &frame_planes[f];
+			for(int j = 0; j < settings.search_size; j += settings.search_offset)
+			{
+				if(axis && !axis[j / settings.search_offset])
+					continue;
+				for(int i = 0; i < settings.search_size; i += settings.search_offset)
+				{
+					if(axis && !axis[i / settings.search_offset])
+						continue;
+					const int displacement = (j - seach_size_half) * stride + i - seach_size_half;
+					for(int dim = 0; dim < 3; ++dim)
+					{
+						block.p[dim] = frame_planes[dim] + patch_p;
+						block.q[dim] = qplanes[dim] + patch_p + displacement;
+						block.c[dim] = qplanes[dim] + y * stride + x + displacement;
+					}
+					for(int g = 0; g < guides; ++g)
+					{
+						block.gp[g] = frame_planes[3 + g] + patch_p;
+						block.gq[g] = qplanes[3 + g] + patch_p + displacement;
+					}
+					accumulate(block);
+				}
+			}
+		}
+	}
+}
+
+NAVIE_GLOBAL::nvThreadPool& NAVIE_GLOBAL::nvNLMdenoiser::thread_pool(int threads)
+{
+	if(!m_pool)
+		m_pool.reset(new nvThreadPool(threads));
+	else
+		m_pool->set_threads(threads);
+	return *m_pool;
+}
+
+NAVIE_GLOBAL::nvNLMdenoiser::nvNLMdenoiser()
+	: m_noise(), m_ring(nullptr), m_times()
+{
+}
+
+std::shared_ptr<NAVIE_GLOBAL::nvNLMdenoiser> NAVIE_GLOBAL::nvNLMdenoiser::shared()
+{
+	static std::mutex lock;
+	static std::shared_ptr<nvNLMdenoiser> denoiser;
+
+	std::lock_guard<std::mutex> guard(lock);
+	if(!denoiser)
+		denoiser = std::make_shared<nvNLMdenoiser>();
+	return denoiser;
+}
+
+const std::vector<const NAVIE_GLOBAL::nvImage*>& NAVIE_GLOBAL::nvNLMdenoiser::search_frames(const nvImage& noisy_image)
+{
+	if(!m_search_frames.empty())
+		return m_search_frames;
+
+	nv_pool_resize(m_single_frame, 1);
+	m_single_frame[0] = &noisy_image;
+	return m_single_frame;
+}
+
+float NAVIE_GLOBAL::nvNLMdenoiser::guide_weight(const nvDenoiseSettings& settings, int guide)
+{
+	switch(guide)
+	{
+		case NLM_GUIDE_ALBEDO:	return settings.albedo_weight;
+		case NLM_GUIDE_NORMAL:	return settings.normal_weight;
+		default:				return settings.depth_weight;
+	}
+}
+
+int NAVIE_GLOBAL::nvNLMdenoiser::guide_plane(const nvDenoiseSettings& settings, int guide)
+{
+	if(guide_weight(settings, guide) <= 0.0f)
+		return -1;
+
+	int plane = 3;
+	for(int g = 0; g < guide; ++g)
+	{
+		if(guide_weight(settings, g) > 0.0f)
+			plane += NLM_GUIDE_CHANNELS[g];
+	}
+	return plane;
+}
+
+int NAVIE_GLOBAL::nvNLMdenoiser::guide_planes(const nvDenoiseSettings& settings, float* weights)
+{
+	int planes = 0;
+	for(int g = 0; g < NLM_GUIDE_COUNT; ++g)
+	{
+		const float weight = guide_weight(settings, g);
+		if(weight <= 0.0f)
+			continue;
+
+		for(int c = 0; c < NLM_GUIDE_CHANNELS[g]; ++c, ++planes)
+		{
+			if(weights)
+				weights[planes] = weight;
+		}
+	}
+	return planes;
+}
+
+/****************************************************************************/
+/* Guided (joint) filter													*/
+/*																			*/
+/* Noise free feature passes of the renderer make the patch distance		*/
+/* robust, so small patches and search windows keep edges and texture.		*/
+/* The guides follow the color in the order albedo (3), normal (3),			*/
+/* depth (1). Depth should be normalized to about [0,1] by the caller.		*/
+/****************************************************************************/
+int NAVIE_GLOBAL::nvNLMdenoiser::used_guide_planes(const nvDenoiseSettings& settings, const nvImage& noisy_image, float* weights)
+{
+	//an image without the guide planes is filtered on its color alone
+	const int planes = guide_planes(settings, weights);
+	return noisy_image.channels() >= 3 + planes ? planes : 0;
+}
+
+/****************************************************************************/
+/* Fast weights																*/
+/*																			*/
+/* Most candidates of a render are so different from the patch that their	*/
+/* weight is practically 0. Candidates whose distance exceeds				*/
+/* -2h^2 ln(weight_cutoff) are dropped and the CPU engines use a			*/
+/* polynomial exp (relative error < 2e-7). The brute force engines (CPU		*/
+/* and OpenCL) stop comparing a patch as soon as its partial distance is	*/
+/* past the cutoff.															*/
+/*																			*/
+/* The error bound in nvdenoise.h has W >= 1 whenever the pixel itself is	*/
+/* a candidate, i.e. when (search_size - 1) / 2 is a multiple of			*/
+/* search_offset. Pixels whose candidates are all dropped keep their noisy	*/
+/* value.																	*/
+/****************************************************************************/
+float NAVIE_GLOBAL::nvNLMdenoiser::cutoff_distance(const nvDenoiseSettings& settings)
+{
+	if(settings.weight_cutoff <= 0.0f)
+		return std::numeric_limits<float>::infinity();
+
+	//exp(-d / 2h^2) < weight_cutoff
+	return float(-2.0 * sqr(settings.h) * std::log(double(settings.weight_cutoff)));
+}
+
+int NAVIE_GLOBAL::nvNLMdenoiser::halo(const nvDenoiseSettings& settings)
+{
+	//the search window and the patches reach further right/down than left/up for even sizes
+	const int search_reach	= settings.search_size - 1 - (settings.search_size - 1) / 2;
+	const int patch_reach	= settings.patch_size - 1 - (settings.patch_size - 1) / 2;
+	//the noise estimate of the adaptive mode reads the cell of a pixel, its margin and the mask border
+	const int noise_reach	= settings.adaptive ? NLM_NOISE_CELL + NLM_NOISE_MARGIN : 0;
+	const int reach			= std::max(search_reach + patch_reach, noise_reach);
+
+	//every level reads its own reach plus the upsampling margin (3 pixels) and twice the reach of
+	//the coarser levels
+	const int levels = std::min(settings.pyramid_levels, NLM_MAX_PYRAMID_LEVELS);
+	if(levels <= 1)
+		return reach;
+
+	int pyramid_reach = reach;
+	for(int level = 1; level < levels; ++level)
+		pyramid_reach = std::max(reach + 3, 2 * pyramid_reach + 6);
+	return pyramid_reach;
+}
+
+void NAVIE_GLOBAL::nvNLMdenoiser::denoise(const nvDenoiseSettings& settings, const nvImage& noisy_image, nvImage& denoised_image, const nvRect& roi)
+{
+	NV_TRACE_FRAME(-1);
+	const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	m_times = nvStageTimes();
+
+	//the levels run the plain engine
+	const int levels = std::min(settings.pyramid_levels, NLM_MAX_PYRAMID_LEVELS);
+	nvDenoiseSettings engine_settings = settings;
+	engine_settings.pyramid_levels = 0;
+	denoise_pyramid(engine_settings, noisy_image, denoised_image, roi, levels);
+
+	m_times.total = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	//the CPU engines only filter, the OpenCL one reports its stages itself
+	if(settings.engine != NLM_ENGINE_OPENCL)
+		m_times.filter = m_times.total;
+}
+
+void NAVIE_GLOBAL::nvNLMdenoiser::run_engine(const nvDenoiseSettings& settings, const nvImage& noisy_image, nvImage& denoised_image, const nvRect& roi)
+{
+	//noise cells of this image, the engines read them in adaptive mode
+	estimate_noise(settings, noisy_image, roi);
+
+	//the OpenCL engine traces its stages itself. Without a device the frame is filtered on the CPU
+	//instead of being left as it is
+	int engine = settings.engine;
+	if(engine == NLM_ENGINE_OPENCL)
+	{
+#ifdef USE_OPENCL
+		if(non_local_mean_cl(settings, noisy_image, denoised_image, roi))
+			return;
 #endif
-	
-void NAVIE_GLOBAL::nvNLMdenoiser::get_pixel(const BaseBitmap* bmp, int x, int y, NAVIE_GLOBAL::vector3d& dst)
+		engine = settings.fallback_engine;
+	}
+
+	NV_TRACE_NAMED_SCOPE(filter, "filter");
+	NV_TRACE_COUNT(filter, 0, (unsigned long long)roi.width * roi.height);
+	switch(engine)
+	{
+		case NLM_ENGINE_INTEGRAL:	non_local_mean_integral(&settings, noisy_image, denoised_image, roi); break;
+		case NLM_ENGINE_SYMMETRIC:	non_local_mean_symmetric(&settings, noisy_image, denoised_image, roi); break;
+		default:					non_local_mean(&settings, noisy_image, denoised_image, roi); break;
+	}
+}
+
+void NAVIE_GLOBAL::nvNLMdenoiser::denoise_temporal(const nvDenoiseSettings& settings, const nvFrameRing& ring, int frame, nvImage& denoised_image, const nvRect& roi)
 {
-	UInt16 pr, pg, pb;
-	bmp->GetPixel(x, y, &pr, &pg, &pb);
-	dst.x = float(pr) / 255;
-	dst.y = float(pg) / 255;
-	dst.z = float(pb) / 255;
+	NV_TRACE_FRAME(frame);
+	const int current = ring.slot(frame);
+	if(current < 0)
+		return;
+
+	//nearest frames first, frames of another size can not be compared
+	const nvImage& noisy_image = ring.image(current);
+	nv_pool_reserve(m_search_frames, size_t(2 * settings.temporal_radius + 1));
+	nv_pool_reserve(m_search_slots, size_t(2 * settings.temporal_radius + 1));
+	m_search_frames.assign(1, &noisy_image);
+	m_search_slots.assign(1, current);
+	for(int distance = 1; distance <= settings.temporal_radius; ++distance)
+	{
+		for(int side = -1; side <= 1; side += 2)
+		{
+			const int slot = ring.slot(frame + side * distance);
+			if(slot < 0 || ring.image(slot).width() != noisy_image.width() || ring.image(slot).height() != noisy_image.height() ||
+			   ring.image(slot).channels() != noisy_image.channels())
+				continue;
+
+			m_search_frames.push_back(&ring.image(slot));
+			m_search_slots.push_back(slot);
+		}
+	}
+
+	m_ring = &ring;
+	denoise(settings, noisy_image, denoised_image, roi);
+
+	m_ring = nullptr;
+	m_search_frames.clear();
+	m_search_slots.clear();
 }
 
+/* Brute force engine state, kept between frames */
+struct NAVIE_GLOBAL::nvBruteForceState
+{
+	/* Scratch memory of one worker, kept alive between tiles and frames */
+	struct Worker
+	{
+		std::vector<float>	weights;	// search window weights
+		std::vector<float>	accum;		// weighted sums and normalizing factors of a block run
+	};
+
+	std::vector<Worker>			workers;		// one entry per pool worker
+	std::vector<const float*>	frame_planes;	// planes of the searched frames
+};
+
 /* patchwise serial or mp approach */
-void NAVIE_GLOBAL::nvNLMdenoiser::non_local_mean(const nvDenoiseSettings* settings, const BaseBitmap *noisy_image, std::vector<NAVIE_GLOBAL::Color>& denoised_image)
+void NAVIE_GLOBAL::nvNLMdenoiser::non_local_mean(const nvDenoiseSettings* settings, const nvImage& noisy_image, nvImage& denoised_image, const nvRect& roi)
 {
 	const int beginX = 0;
 	const int beginY	= 0;
-	const int endX		= noisy_image->GetBw();
-	const int endY		= noisy_image->GetBh();
+	const int endX		= noisy_image.width();
+	const int endY		= noisy_image.height();
+
+	denoised_image.resize(roi.width, roi.height, 3);
+
+	//channel planes and row pitch of the noisy image
+	const float* planes[3] = { noisy_image.plane(0), noisy_image.plane(1), noisy_image.plane(2) };
+	const int stride = noisy_image.stride();
+
+	//guide planes (albedo, normal, depth) compared along with the color
+	float guide_weights[NLM_MAX_GUIDE_PLANES];
+	const int guides = used_guide_planes(*settings, noisy_image, guide_weights);
+	const float* guide_planes[NLM_MAX_GUIDE_PLANES];
+	for(int g = 0; g < guides; ++g)
+		guide_planes[g] = noisy_image.plane(3 + g);
+
+	//color and guide planes of the frames searched for similar patches, planes of the noisy image first
+	const std::vector<const nvImage*>& frames = search_frames(noisy_image);
+	const size_t frame_stride = 3 + guides;
+	nvBruteForceState& state = engine_state(m_brute_force);
+	std::vector<const float*>& frame_planes = state.frame_planes;
+	nv_pool_resize(frame_planes, frames.size() * frame_stride);
+	for(size_t f = 0; f < frames.size(); ++f)
+	{
+		for(size_t c = 0; c < frame_stride; ++c)
+			frame_planes[f * frame_stride + c] = frames[f]->plane(int(c));
+	}
 	
 	const int patch_size_half = (settings->patch_size - 1) / 2;
 	const int seach_size_half = (settings->search_size - 1) / 2;
 
 	const double h2 = 2 * sqr(settings->h); //In the paper they only have (h but it should be 2h. found that info on the internet somewhere)
+
+	//fast weights: candidates past max_dist are dropped, the others get the polynomial exp of the block kernels
+	const float max_dist	= cutoff_distance(*settings);
+	const bool reject		= max_dist < std::numeric_limits<float>::infinity();
+	const float scale		= float(-1.0 / h2);
 	
-#ifdef USE_MP
-	THREADS::nv_parallel_for<boost::thread>((size_t)0, (size_t)endY, [&](size_t y)
-	{
-		std::vector<Color> Weight(settings->search_size * settings->search_size);
-#else
-	std::vector<Color> Weight(settings->search_size * settings->search_size);
-	for(int y = beginY; y < endY; y++) 
+	//pixels whose patches and search candidates are all inside the image go through the block kernels
+	const nvNLMKernels* kernels = nv_nlm_kernels(settings->isa);
+	const int interior_begin	= seach_size_half + patch_size_half;
+	const int interior_endX		= endX - halo(*settings);
+	const int interior_endY		= endY - halo(*settings);
+
+	//adaptive mode: every noise cell brings its own h and search offsets
+	const nvNoiseMap& noise = m_noise;
+
+	//patch samples past the border, only the pixels outside the block runs see any
+	const bool clamp = settings->edge_mode == NLM_EDGE_CLAMP;
+
+	nvThreadPool& pool = thread_pool(settings->threads);
+	if(state.workers.size() < size_t(pool.size()))
+		nv_pool_resize(state.workers, pool.size());
+	pool.parallel_tiles(roi, NLM_TILE_SIZE, NLM_TILE_SIZE, [&](const nvRect& tile, int worker)
 	{
-#endif
-		for(int x = beginX; x < endX; x++) 
-		{			
-			//current pixel's search window start coordinates (centered at p = (x,y))
-			const int x_start = x - seach_size_half;
-			const int y_start = y - seach_size_half;
-
-			//current pixel's patch start coordinates (centered at p = (x,y))
-			const int x_startp = x - patch_size_half;
-			const int y_startp = y - patch_size_half;
-						
-			Color norm_factor = Color(0.0); //normalizing factor
-			
-			int searchpos_y = y_start;
-			//Browse the 'search window' and accumulate pixel weights for each patch
-			for(int j = 0; j < settings->search_size; j += settings->search_offset, searchpos_y += settings->search_offset) 
-			{
-				int searchpos_x	= x_start;
-				int idx_w = get_index(0, j, settings->search_size); //Weight index
-				for(int i = 0; i < settings->search_size; i += settings->search_offset, idx_w += settings->search_offset, searchpos_x += settings->search_offset) 
+		//the weight matrix (one per searched frame) belongs to the worker and is reused for all of its tiles
+		const int weights_per_frame = settings->search_size * settings->search_size * 3;
+		std::vector<float>& Weight = state.workers[worker].weights;
+		nv_pool_resize(Weight, weights_per_frame * frames.size());
+
+		//weighted sums and normalizing factors of a block run
+		std::vector<float>& accum = state.workers[worker].accum;
+		nv_pool_resize(accum, size_t(6 * tile.width));
+
+		for(int y = tile.y; y < tile.y + tile.height; y++) 
+		{
+			int block_begin	= std::max(tile.x, interior_begin);
+			int block_end	= std::min(tile.x + tile.width, interior_endX);
+			if(y < interior_begin || y >= interior_endY)
+				block_begin = block_end = tile.x - 1;
+
+			for(int x = tile.x; x < tile.x + tile.width; x++) 
+			{			
+				if(x == block_begin && block_begin < block_end)
 				{
-					Weight[idx_w] = Color(0.0);
+					//in adaptive mode a run ends at the next cell, clean cells are copied
+					int count					= block_end - x;
+					double run_h2				= h2;
+					float run_max_dist			= max_dist;
+					const char* axis			= nullptr;
+					bool clean					= false;
+					if(noise.active)
+					{
+						const nvNoiseCell& cell	= noise.at(x, y);
+						count					= std::min(count, (x / NLM_NOISE_CELL + 1) * NLM_NOISE_CELL - x);
+						run_h2					= cell.h2;
+						run_max_dist			= cell.max_dist;
+						clean					= cell.level == NLM_NOISE_CLEAN;
+						if(!clean)
+							axis				= &noise.axis[cell.level][0];
+						block_begin				= x + count;
+					}
 
-					if((searchpos_x >= endX) || (searchpos_x < beginX) || (searchpos_y >= endY) || (searchpos_y < beginY)) 
+					if(!clean)
+						accumulate_run(*kernels, *settings, frame_planes, stride, guides, guide_weights, run_h2, run_max_dist, axis, x, y, count, &accum[0]);
+					for(int dim = 0; dim < 3; ++dim)
+					{
+						for(int k = 0; k < count; ++k)
+						{
+							const float norm = clean ? 0.0f : accum[(3 + dim) * count + k];
+							denoised_image.at(dim, x + k - roi.x, y - roi.y) = norm > 0.0f ? accum[dim * count + k] / norm : planes[dim][get_index(x + k, y, stride)];
+						}
+					}
+					x += count - 1;
+					continue;
+				}
+
+				//adaptive mode: h, cutoff and search offsets of the cell of the pixel
+				double pixel_h2			= h2;
+				float pixel_max_dist	= max_dist;
+				float pixel_scale		= scale;
+				const char* axis		= nullptr;
+				if(noise.active)
+				{
+					const nvNoiseCell& cell = noise.at(x, y);
+					if(cell.level == NLM_NOISE_CLEAN)
+					{
+						for(int dim = 0; dim < 3; ++dim)
+							denoised_image.at(dim, x - roi.x, y - roi.y) = planes[dim][get_index(x, y, stride)];
 						continue;
+					}
+					pixel_h2		= cell.h2;
+					pixel_max_dist	= cell.max_dist;
+					pixel_scale		= float(-1.0 / cell.h2);
+					axis			= &noise.axis[cell.level][0];
+				}
+
+				//current pixel's search window start coordinates (centered at p = (x,y))
+				const int x_start = x - seach_size_half;
+				const int y_start = y - seach_size_half;
 
-					//Neighbor patch to evaluate weighting kernel in
-					//patch coordinates centered at q
-					int nbpatch_qx = searchpos_x - patch_size_half;
-					int nbpatch_qy = searchpos_y - patch_size_half;
-
-					//retrieve w(i,j) kernel:
-					//
-					//w(i,j)	= exp(-(d(i,j) / 2h)) / E(j){ exp(-(d(i,j) / 2h)) }
-					//d(i,j)	= v(i + t) - v(j + t)
-					//v(i)		= pixel value
-					//i,j		= 2D patch coordinates(x,y) of p,q (p and q are pixels)
-					int patchpos_py = y_startp;
-					int patchpos_qy = nbpatch_qy;
-
-					// weight value equals sum of all squared variance of neighborhood pixels (see denominator of w(i,j))
-					for(int b = 0; b < settings->patch_size; b++, ++patchpos_py, ++patchpos_qy) 
+				//current pixel's patch start coordinates (centered at p = (x,y))
+				const int x_startp = x - patch_size_half;
+				const int y_startp = y - patch_size_half;
+						
+				float norm_factor[3] = { 0.0f, 0.0f, 0.0f }; //normalizing factor
+			
+				for(size_t f = 0; f < frames.size(); ++f)
+				{
+					const float* const* qplanes = &frame_planes[f * frame_stride];
+					float* frame_weights = &Weight[f * weights_per_frame];
+					int searchpos_y = y_start;
+					//Browse the 'search window' and accumulate pixel weights for each patch
+					for(int j = 0; j < settings->search_size; j += settings->search_offset, searchpos_y += settings->search_offset) 
 					{
-						int patchpos_px = x_startp;
-						int patchpos_qx = nbpatch_qx;
-						for(int a = 0; a < settings->patch_size; a++, ++patchpos_px, ++patchpos_qx) 
+						int searchpos_x	= x_start;
+						int idx_w = get_index_array(0, j, settings->search_size); //Weight index
+						for(int i = 0; i < settings->search_size; i += settings->search_offset, idx_w += settings->search_offset * 3, searchpos_x += settings->search_offset) 
 						{
-							//out of bounds check
-							//idea: instead of skipping this pixel, shift the patch into the search window
-							//or: clamp the size of each neighbor patch rectangle; if pixel p is near the search windows boundary
-							if((patchpos_qx >= endX) || (patchpos_qx < beginX) || (patchpos_qy >= endY) || (patchpos_qy < beginY) ||
-							   (patchpos_px >= endX) || (patchpos_px < beginX) || (patchpos_py >= endY) || (patchpos_py < beginY))
+							float* weight = &frame_weights[idx_w];
+							weight[0] = weight[1] = weight[2] = 0.0f;
+
+							if((searchpos_x >= endX) || (searchpos_x < beginX) || (searchpos_y >= endY) || (searchpos_y < beginY)) 
+								continue;
+							if(axis && (!axis[j / settings->search_offset] || !axis[i / settings->search_offset]))
 								continue;
 
-							//get color values at p & q
-							vector3d p = vector3d(0.0), q = vector3d(0.0);
-							get_pixel(noisy_image, patchpos_px, patchpos_py, p);
-							get_pixel(noisy_image, patchpos_qx, patchpos_qy, q);
+							//Neighbor patch to evaluate weighting kernel in
+							//patch coordinates centered at q
+							int nbpatch_qx = searchpos_x - patch_size_half;
+							int nbpatch_qy = searchpos_y - patch_size_half;
 
-							// accumulate squared intensity distance for each color component
-							for(int dim = 0; dim < 3; ++dim)
-								Weight[idx_w][dim] += sqr(p[dim] - q[dim]);
-						}
-					}
+							//retrieve w(i,j) kernel:
+							//
+							//w(i,j)	= exp(-(d(i,j) / 2h)) / E(j){ exp(-(d(i,j) / 2h)) }
+							//d(i,j)	= v(i + t) - v(j + t)
+							//v(i)		= pixel value
+							//i,j		= 2D patch coordinates(x,y) of p,q (p and q are pixels)
+							int patchpos_py = y_startp;
+							int patchpos_qy = nbpatch_qy;
+							float guide_dist = 0.0f; //weighted guide distance, shared by the color channels
+							bool rejected = false;
 
-					for(int dim = 0; dim < 3; ++dim) 
-					{
-						//getting the exponent of current pixel in the weight matrix and divide it by squared h (nominator part)
-						Weight[idx_w][dim] = exp(-Weight[idx_w][dim] / h2);
-						//accumulate normalizing factor z (which is the nominator)
-						norm_factor[dim] += Weight[idx_w][dim];
+							// weight value equals sum of all squared variance of neighborhood pixels (see denominator of w(i,j))
+							for(int b = 0; b < settings->patch_size && !rejected; b++, ++patchpos_py, ++patchpos_qy) 
+							{
+								int patchpos_px = x_startp;
+								int patchpos_qx = nbpatch_qx;
+								for(int a = 0; a < settings->patch_size; a++, ++patchpos_px, ++patchpos_qx) 
+								{
+									//out of bounds check: the sample is skipped or the nearest border pixel (edge_mode)
+									int p, q;
+									if((patchpos_qx >= endX) || (patchpos_qx < beginX) || (patchpos_qy >= endY) || (patchpos_qy < beginY) ||
+									   (patchpos_px >= endX) || (patchpos_px < beginX) || (patchpos_py >= endY) || (patchpos_py < beginY))
+									{
+										if(!clamp)
+											continue;
+										p = get_index(std::min(std::max(patchpos_px, beginX), endX - 1), std::min(std::max(patchpos_py, beginY), endY - 1), stride);
+										q = get_index(std::min(std::max(patchpos_qx, beginX), endX - 1), std::min(std::max(patchpos_qy, beginY), endY - 1), stride);
+									}
+									else
+									{
+										//color values at p & q
+										p = get_index(patchpos_px, patchpos_py, stride);
+										q = get_index(patchpos_qx, patchpos_qy, stride);
+									}
+
+									// accumulate squared intensity distance for each color component
+									for(int dim = 0; dim < 3; ++dim)
+										weight[dim] += sqr(planes[dim][p] - qplanes[dim][q]);
+									for(int g = 0; g < guides; ++g)
+										guide_dist += guide_weights[g] * sqr(guide_planes[g][p] - qplanes[3 + g][q]);
+								}
+
+								//the distances only grow, a candidate past the cutoff in every channel is dropped right away
+								if(reject)
+									rejected = weight[0] + guide_dist > pixel_max_dist && weight[1] + guide_dist > pixel_max_dist && weight[2] + guide_dist > pixel_max_dist;
+							}
+
+							for(int dim = 0; dim < 3; ++dim) 
+							{
+								if(guides)
+									weight[dim] += guide_dist;
+								//getting the exponent of current pixel in the weight matrix and divide it by squared h (nominator part)
+								if(reject)
+									weight[dim] = weight[dim] > pixel_max_dist ? 0.0f : nv_exp_negative(weight[dim] * pixel_scale);
+								else
+									weight[dim] = exp(-weight[dim] / pixel_h2);
+								//accumulate normalizing factor z (which is the nominator)
+								norm_factor[dim] += weight[dim];
+							}
+						}
 					}
 				}
-			}
 			
-			//accumulate the final weighted output pixel value
-			Color out;
-			searchpos_y = y_start;
-			for(int jj = 0; jj < settings->search_size; jj += settings->search_offset, searchpos_y += settings->search_offset) 
-			{
-				int searchpos_x = x_start;
-				int idx_w		= get_index(0,jj,settings->search_size); //weight index
-				for(int ii = 0; ii < settings->search_size; ii += settings->search_offset, idx_w += settings->search_offset, searchpos_x += settings->search_offset) 
+				//accumulate the final weighted output pixel value
+				float out[3] = { 0.0f, 0.0f, 0.0f };
+				for(size_t f = 0; f < frames.size(); ++f)
 				{
-					if((searchpos_x >= endX) || (searchpos_x < beginX) || (searchpos_y >= endY) || (searchpos_y < beginY)) //out of bounds
-						continue;
-					
-					vector3d noisy_src_pixel;
-					get_pixel(noisy_image, searchpos_x, searchpos_y, noisy_src_pixel);
-
-					for(int dim = 0; dim < 3; ++dim)
-						out[dim] += Weight[idx_w][dim] * noisy_src_pixel[dim];
+					const float* const* qplanes = &frame_planes[f * frame_stride];
+					const float* frame_weights = &Weight[f * weights_per_frame];
+					int searchpos_y = y_start;
+					for(int jj = 0; jj < settings->search_size; jj += settings->search_offset, searchpos_y += settings->search_offset) 
+					{
+						int searchpos_x = x_start;
+						int idx_w		= get_index_array(0,jj,settings->search_size); //weight index
+						for(int ii = 0; ii < settings->search_size; ii += settings->search_offset, idx_w += settings->search_offset * 3, searchpos_x += settings->search_offset) 
+						{
+							if((searchpos_x >= endX) || (searchpos_x < beginX) || (searchpos_y >= endY) || (searchpos_y < beginY)) //out of bounds
+								continue;
+						
+							const int src = get_index(searchpos_x, searchpos_y, stride);
+							for(int dim = 0; dim < 3; ++dim)
+								out[dim] += frame_weights[idx_w + dim] * qplanes[dim][src];
+						}
+					}
 				}
-			}
-			out /= norm_factor;
 
-			denoised_image[get_index(x, y, noisy_image->GetBw())] = out;
+				//all candidates dropped by the fast weights, the pixel stays as it is
+				for(int dim = 0; dim < 3; ++dim)
+					denoised_image.at(dim, x - roi.x, y - roi.y) = norm_factor[dim] > 0.0f ? out[dim] / norm_factor[dim] : planes[dim][get_index(x, y, stride)];
+			}
 		}
-	}
-#ifdef USE_MP
-	);
-#endif
-		
-}
\ No newline at end of file
+	});
+}
@@ -1,10 +1,30 @@
 #ifndef NVDENOISE_H_
 #define NVDENOISE_H_
 
-#include <vector/vector3d.h>
+#include "nvframering.h"
+#include "nvimage.h"
+#include "nvkernels.h"
+#include "nvpool.h"
+#include "nvthreadpool.h"
+#include <memory>
+#include <mutex>
 #include <vector>
 
-class BaseBitmap;
+/* Implementations of the filter, see nvDenoiseSettings::engine */
+enum nvNLMEngine
+{
+	NLM_ENGINE_BRUTEFORCE	= 0,	// direct patch comparison on the CPU, reference implementation
+	NLM_ENGINE_INTEGRAL		= 1,	// summed squared difference tables on the CPU (Darbon et al, 2008)
+	NLM_ENGINE_OPENCL		= 2,	// direct patch comparison on the OpenCL device
+	NLM_ENGINE_SYMMETRIC	= 3		// integral tables shared by mirrored displacements on the CPU
+};
+
+/* Patch samples past the image border, see below */
+enum nvNLMEdgeMode
+{
+	NLM_EDGE_SKIP	= 0,	// left out of the distance
+	NLM_EDGE_CLAMP	= 1		// the nearest border pixel, OpenCL reads padded vectors
+};
 
 struct nvDenoiseSettings
 {
@@ -12,6 +32,72 @@ struct nvDenoiseSettings
 	int patch_size;
 	int search_size;
 	int search_offset;
+	int engine;			// nvNLMEngine
+	int fallback_engine;	// CPU engine run instead of the OpenCL one without a device or after a failed launch
+	int threads;		// CPU worker threads, 0 = one per hardware thread
+	int isa;			// nvNLMIsa of the brute force block kernels
+	int temporal_radius;	// frames searched before and after the current one by denoise_temporal
+	float albedo_weight;	// guide weights of the joint filter, 0 = guide not used
+	float normal_weight;
+	float depth_weight;
+	float weight_cutoff;	// fast weights below this are dropped, 0 = exact weights (see below)
+	int pyramid_levels;		// resolution levels of the pyramid mode, 0 or 1 = off (see below)
+	int half_input;			// OpenCL engine: the noisy frames are stored as fp16 on the device (see below)
+	int adaptive;			// noise adaptive mode: h and the search follow the local noise (see below)
+	float noise_floor;		// adaptive mode: cells with less noise are left as they are
+	int edge_mode;			// nvNLMEdgeMode (see below)
+};
+
+/* Pyramid mode: with pyramid_levels > 1 the image is also denoised at half, quarter... resolution, */
+/* the coarse levels supply the low frequencies. More levels than this are not used */
+const int NLM_MAX_PYRAMID_LEVELS = 6;
+
+/* Fast weights: weights below weight_cutoff in (0,1) are dropped. With N candidates of value range R */
+/* and exact weight sum W the error per pixel and channel is at most (N * weight_cutoff / W + 4e-7) * R */
+
+/* Half precision input: with half_input != 0 the OpenCL engine keeps the noisy frames as fp16 on */
+/* the device and computes in fp32, see nvdenoise_cl.cpp */
+
+/* Image border: NLM_EDGE_SKIP leaves patch samples past the border out of the distance, */
+/* NLM_EDGE_CLAMP compares the nearest border pixel. Pixels at least halo() from the border agree */
+
+/* Noise adaptive mode: with adaptive != 0 every NLM_NOISE_CELL^2 cell gets h and the candidates it */
+/* compares from its estimated noise, see nvdenoise_adaptive.cpp */
+const int NLM_NOISE_CELL	= 8;
+const int NLM_NOISE_MARGIN	= 4;	// pixels around a cell its estimate reads
+
+/* Filter levels of the noise cells, in the order of falling noise */
+enum nvNoiseLevel
+{
+	NLM_NOISE_FULL		= 0,
+	NLM_NOISE_SPARSE	= 1,
+	NLM_NOISE_NEAR		= 2,
+	NLM_NOISE_CLEAN		= 3
+};
+
+/* Guided (joint) filter: guides with a weight > 0 follow the color as extra planes of the noisy */
+/* image, their weighted squared differences are added to the distance of every color channel */
+enum nvNLMGuide
+{
+	NLM_GUIDE_ALBEDO	= 0,
+	NLM_GUIDE_NORMAL	= 1,
+	NLM_GUIDE_DEPTH		= 2,
+	NLM_GUIDE_COUNT		= 3
+};
+
+/* Planes of every guide */
+const int NLM_GUIDE_CHANNELS[NLM_GUIDE_COUNT] = { 3, 3, 1 };
+
+/* Wall clock seconds spent in the stages of the last denoise() call. The OpenCL engine overlaps the */
+/* copies with the filter, its upload and download count the host side staging and conversion, the */
+/* device time that is not hidden behind them counts as filter */
+struct nvStageTimes
+{
+	double upload;		// host to device copy (OpenCL)
+	double setup;		// kernel lookup/compilation and arguments (OpenCL)
+	double filter;		// the filter itself
+	double download;	// device to host copy (OpenCL)
+	double total;
 };
 
 namespace NAVIE_GLOBAL
@@ -35,18 +121,168 @@ namespace NAVIE_GLOBAL
 	/*  search offset															*/		
 	/*	higher pixel offset => less patches being checked in the search window	*/
 	/****************************************************************************/
+	class nvCLRuntime;
+
+	/* State of the engines and modes kept between frames, see nvNLMdenoiser::engine_state */
+	struct nvBruteForceState;
+	struct nvIntegralState;
+	struct nvSymmetricState;
+	struct nvPyramidState;
+	struct nvCLFrameState;
+	struct nvStreamState;
+
+	/* Filter of a cell in noise adaptive mode */
+	struct nvNoiseCell
+	{
+		float	sigma;		// estimated noise
+		int		level;		// nvNoiseLevel
+		float	h2;			// 2h^2 derived from sigma
+		float	max_dist;	// fast weights cutoff of that h, infinity for exact weights
+	};
+
+	/* Cells of the roi of an engine run, in image cell coordinates */
+	struct nvNoiseMap
+	{
+		bool						active;		// adaptive mode
+		int							x0;			// first cell
+		int							y0;
+		int							cols;
+		int							rows;
+		std::vector<nvNoiseCell>	cells;
+		std::vector<char>			axis[NLM_NOISE_CLEAN];	// search offsets along one axis compared per level
+
+		const nvNoiseCell& at(int x, int y) const { return cells[(y / NLM_NOISE_CELL - y0) * cols + x / NLM_NOISE_CELL - x0]; }
+
+		/* Whether a cell of level compares the candidate at search offsets (sx, sy) */
+		bool uses(int level, int sx, int sy) const { return level < NLM_NOISE_CLEAN && axis[level][sx] && axis[level][sy]; }
+	};
+
 	class nvNLMdenoiser
 	{
 	public:
-		void non_local_mean		(const nvDenoiseSettings* settings, const BaseBitmap *noisy_image, std::vector<NAVIE_GLOBAL::Color> &denoised_image );
-		void non_local_mean_cl	(const nvDenoiseSettings& settings, const std::vector<float>& noisy_image, std::vector<float> &denoised_image, const int width, const int height );
+		/* Integral engine tile size. Denoising a roi that starts at a multiple of it gives bit identical */
+		/* results to denoising the whole image */
+		static const int INTEGRAL_TILE_SIZE = 64;
+
+		/* Row callbacks of denoise_streamed. They copy image.width() pixels of count frame rows starting at */
+		/* (x, y) from/to the image rows starting at image_row */
+		typedef nvFunctionRef<bool(int x, int y, int count, nvImage& image, int image_row)>			RowReader;
+		typedef nvFunctionRef<bool(int x, int y, int count, const nvImage& image, int image_row)>	RowWriter;
+
+		/* Engines. Only the roi (in noisy_image coordinates) is denoised, pixels around it are only read. */
+		/* denoised_image is resized to the roi dimensions. non_local_mean_cl returns false if there is no */
+		/* device or the device failed, the roi is then not denoised */
+		void non_local_mean		(const nvDenoiseSettings* settings, const nvImage& noisy_image, nvImage& denoised_image, const nvRect& roi );
+		void non_local_mean_integral(const nvDenoiseSettings* settings, const nvImage& noisy_image, nvImage& denoised_image, const nvRect& roi );
+		void non_local_mean_symmetric(const nvDenoiseSettings* settings, const nvImage& noisy_image, nvImage& denoised_image, const nvRect& roi );
+		bool non_local_mean_cl	(const nvDenoiseSettings& settings, const nvImage& noisy_image, nvImage& denoised_image, const nvRect& roi );
+
+		nvNLMdenoiser();
+
+		/* Process wide denoiser, created on first use. The plugin instances share it and with it the */
+		/* worker pool and the buffers of the frame size. Callers lock mutex() for the duration of a frame */
+		static std::shared_ptr<nvNLMdenoiser> shared();
+		std::mutex& mutex() { return m_mutex; }
+
+		/* Runs the engine selected in settings, in pyramid mode on every level */
+		void denoise(const nvDenoiseSettings& settings, const nvImage& noisy_image, nvImage& denoised_image, const nvRect& roi);
+
+		/* Temporal filter. Denoises frame of the ring and also searches the frames up to */
+		/* settings.temporal_radius before and after it that are in the ring. Frames missing from */
+		/* the ring are left out, e.g. the future ones when the ring only holds past frames */
+		void denoise_temporal(const nvDenoiseSettings& settings, const nvFrameRing& ring, int frame, nvImage& denoised_image, const nvRect& roi);
+
+		/* Stage timings of the last denoise() call, of the last band for denoise_streamed() */
+		const nvStageTimes& stage_times() const { return m_times; }
+
+		/* Denoises a width x height frame in horizontal bands of (about) band_height rows. Only one band plus */
+		/* its halo is held in memory, the result is bit identical to denoising the whole frame at once */
+		/* (within float rounding for the symmetric engine, which adds the scattered weights in tile order). */
+		/* The band images have image_channels(settings) planes, the reader fills color and guides. */
+		/* Rows are written back as soon as they are done, the reader is never asked for a row after it */
+		/* has been written. Returns false if a callback fails or memory runs out */
+		bool denoise_streamed(const nvDenoiseSettings& settings, int width, int height, int band_height, const RowReader& read, const RowWriter& write);
+
+		/* Same for the region of the frame only, e.g. a render region. Only the region plus the halo around */
+		/* it is read and only the region is written, the result equals denoise() of the whole frame with */
+		/* the region as roi */
+		bool denoise_streamed(const nvDenoiseSettings& settings, int width, int height, const nvRect& region, int band_height, const RowReader& read, const RowWriter& write);
+
+		/* Number of pixels around a pixel the filter reads with these settings, the coarse levels of the */
+		/* pyramid mode included */
+		static int halo(const nvDenoiseSettings& settings);
+
+		/* Distance past which the fast weights drop a candidate, infinity for exact weights */
+		static float cutoff_distance(const nvDenoiseSettings& settings);
+
+		/* Guide planes the settings use and their weights (up to NLM_MAX_GUIDE_PLANES), see nvNLMGuide */
+		static int guide_planes(const nvDenoiseSettings& settings, float* weights = nullptr);
+		/* Weight of a guide in settings */
+		static float guide_weight(const nvDenoiseSettings& settings, int guide);
+		/* First plane of guide in the noisy image, -1 if the settings do not use it */
+		static int guide_plane(const nvDenoiseSettings& settings, int guide);
+		/* Planes of the noisy image, color and guides */
+		static int image_channels(const nvDenoiseSettings& settings) { return 3 + guide_planes(settings); }
+
+		/* Noise cells of the last engine run (the finest level in pyramid mode), inactive unless adaptive */
+		const nvNoiseMap& noise_map() const { return m_noise; }
+
+		/* Runs non_local_mean_cl on its own runtime instead of the process wide one */
+		void set_cl_runtime(const std::shared_ptr<nvCLRuntime>& runtime) { m_cl = runtime; }
 
 		/* Returns a 1d index from a 2d pixel coordinate. size is the width of the image */
 		static inline int get_index(int x, int y, int size) { return (size * y) + x; }
 		static inline int get_index_array(int x, int y, int size) { return get_index(x,y,size) * 3; }
 
-		/* Fills dst with the color (normal range) of the pixel at (x,y) */
-		void get_pixel(const BaseBitmap* bmp, int x, int y, NAVIE_GLOBAL::vector3d& dst);
+	private:
+		/* The engine of settings, without the pyramid */
+		void run_engine(const nvDenoiseSettings& settings, const nvImage& noisy_image, nvImage& denoised_image, const nvRect& roi);
+
+		/* Pyramid mode with levels levels, settings.pyramid_levels is ignored */
+		void denoise_pyramid(const nvDenoiseSettings& settings, const nvImage& noisy_image, nvImage& denoised_image, const nvRect& roi, int levels);
+
+		/* Returns the worker pool, (re)started with the requested thread count */
+		nvThreadPool& thread_pool(int threads);
+
+		/* Fills m_noise for the roi of noisy_image, see the noise adaptive mode */
+		void estimate_noise(const nvDenoiseSettings& settings, const nvImage& noisy_image, const nvRect& roi);
+
+		/* Frames the engines search for similar patches, noisy_image first */
+		const std::vector<const nvImage*>& search_frames(const nvImage& noisy_image);
+
+		/* Guide planes of noisy_image the engines compare, 0 if it does not carry the ones of the settings */
+		static int used_guide_planes(const nvDenoiseSettings& settings, const nvImage& noisy_image, float* weights);
+
+		/* State of an engine or mode, defined and created on first use in its translation unit. Like m_cl */
+		/* it is held by shared_ptr, which does not need the complete type here */
+		template<class T>
+		static T& engine_state(std::shared_ptr<T>& state)
+		{
+			if(!state)
+				state = std::make_shared<T>();
+			return *state;
+		}
+
+		std::unique_ptr<nvThreadPool>	m_pool;		// created on first CPU use, lives as long as the denoiser
+		std::vector<const nvImage*>		m_single_frame;	// search_frames() without temporal frames
+		nvNoiseMap						m_noise;		// filter per noise cell of the current engine run
+
+		std::shared_ptr<nvBruteForceState>	m_brute_force;
+		std::shared_ptr<nvIntegralState>	m_integral;
+		std::shared_ptr<nvSymmetricState>	m_symmetric;
+		std::shared_ptr<nvPyramidState>		m_pyramid;
+		std::shared_ptr<nvStreamState>		m_stream;
+
+		std::shared_ptr<nvCLRuntime>	m_cl;		// OpenCL state, the process wide runtime unless set otherwise
+		std::shared_ptr<nvCLFrameState>	m_cl_frames;	// host side buffers of the frames non_local_mean_cl uploads
+
+		const nvFrameRing*				m_ring;				// set during denoise_temporal
+		std::vector<const nvImage*>		m_search_frames;	// set during denoise_temporal, current frame first
+		std::vector<int>				m_search_slots;		// ring slots of m_search_frames
+
+		nvStageTimes					m_times;	// of the last denoise() call
+
+		std::mutex						m_mutex;	// see shared()
 	};
 	
 }
@@ -0,0 +1,151 @@
+#include "nvdenoise.h"
+#include "nvtrace.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <limits>
+
+/****************************************************************************/
+/* Noise adaptive mode														*/
+/*																			*/
+/* Sky, backgrounds and converged parts of a render carry almost no noise.	*/
+/* The noise sigma of every NLM_NOISE_CELL^2 cell is estimated from the		*/
+/* cell and NLM_NOISE_MARGIN pixels around it, and every cell gets its own	*/
+/* filter. h is derived from the estimate,									*/
+/*																			*/
+/*	h = settings.h / 0.4 * patch_size * sigma								*/
+/*																			*/
+/* so the default strength gives two patches that only differ by the		*/
+/* noise a weight of 1/e. The candidates compared depend on					*/
+/* sigma / noise_floor:														*/
+/*																			*/
+/*	< 1		none, the cell is left as it is									*/
+/*	< 2		every other one in the inner half of the window (1/16)			*/
+/*	< 4		every other one (1/4)											*/
+/*	else	all of the window												*/
+/*																			*/
+/* The candidates nearest the pixel are kept at every level. Cells are		*/
+/* aligned to the image origin and halo() covers the pixels the estimate	*/
+/* reads, streamed bands and regions see the same cells as a whole frame.	*/
+/*																			*/
+/* Noise estimate															*/
+/*																			*/
+/* The 3x3 mask																*/
+/*																			*/
+/*	 1 -2  1																*/
+/*	-2  4 -2																*/
+/*	 1 -2  1																*/
+/*																			*/
+/* is the difference of two Laplacians. It cancels constant and linear		*/
+/* image content and most of the smooth shading, what is left of white		*/
+/* noise of deviation sigma has a mean absolute value of					*/
+/* 6 sigma sqrt(2/pi) (Immerkaer, 1996). Edges and fine texture leave a	*/
+/* residual too, so they are rated somewhat noisier than they are, which	*/
+/* only keeps more of the search for them.									*/
+/*																			*/
+/* Every cell is estimated from its own pixels and a margin around them,	*/
+/* never from its neighbour cells, so the estimate does not depend on the	*/
+/* roi, the band or the worker that computes it.							*/
+/****************************************************************************/
+
+namespace
+{
+	using NAVIE_GLOBAL::nvImage;
+
+	//sqrt(pi/2) / 6, sigma per mean absolute residual of white noise
+	const double NOISE_SCALE = 1.2533141373155003 / 6.0;
+
+	//strength the derived h is relative to, the default of the plugin and the command line
+	const double ADAPTIVE_H_REFERENCE = 0.4;
+
+	/* Mean absolute mask response of the color planes over [x0,x1) x [y0,y1), whose 3x3 */
+	/* neighbourhoods all lie in the image */
+	double laplacian_residual(const nvImage& image, int x0, int y0, int x1, int y1)
+	{
+		double sum = 0.0;
+		for(int c = 0; c < 3; ++c)
+		{
+			for(int y = y0; y < y1; ++y)
+			{
+				const float* above	= image.row(c, y - 1);
+				const float* row	= image.row(c, y);
+				const float* below	= image.row(c, y + 1);
+				for(int x = x0; x < x1; ++x)
+				{
+					const float outer	= above[x - 1] - 2.0f * above[x] + above[x + 1] + below[x - 1] - 2.0f * below[x] + below[x + 1];
+					const float middle	= row[x - 1] - 2.0f * row[x] + row[x + 1];
+					sum += std::fabs(outer - 2.0f * middle);
+				}
+			}
+		}
+		return sum / (3.0 * (x1 - x0) * (y1 - y0));
+	}
+}
+
+void NAVIE_GLOBAL::nvNLMdenoiser::estimate_noise(const nvDenoiseSettings& settings, const nvImage& noisy_image, const nvRect& roi)
+{
+	nvNoiseMap& map = m_noise;
+	map.active = settings.adaptive != 0;
+	if(!map.active || roi.width <= 0 || roi.height <= 0)
+		return;
+
+	NV_TRACE_SCOPE("noise estimate");
+
+	//search offsets along one axis per level, the one nearest the pixel is compared by every level
+	const int offsets	= (settings.search_size + settings.search_offset - 1) / settings.search_offset;
+	const int half		= (settings.search_size - 1) / 2;
+	const int center	= (half + settings.search_offset / 2) / settings.search_offset;
+	for(int level = 0; level < NLM_NOISE_CLEAN; ++level)
+	{
+		nv_pool_resize(map.axis[level], size_t(offsets));
+		for(int k = 0; k < offsets; ++k)
+		{
+			const int offset = k * settings.search_offset - half;
+			map.axis[level][k] = level == NLM_NOISE_FULL || ((k - center) % 2 == 0 && (level == NLM_NOISE_SPARSE || 2 * std::abs(offset) <= half));
+		}
+	}
+
+	map.x0		= roi.x / NLM_NOISE_CELL;
+	map.y0		= roi.y / NLM_NOISE_CELL;
+	map.cols	= (roi.x + roi.width - 1) / NLM_NOISE_CELL - map.x0 + 1;
+	map.rows	= (roi.y + roi.height - 1) / NLM_NOISE_CELL - map.y0 + 1;
+	nv_pool_resize(map.cells, size_t(map.cols) * map.rows);
+
+	const double gain		= settings.h / ADAPTIVE_H_REFERENCE * settings.patch_size;
+	const double log_cutoff	= settings.weight_cutoff > 0.0f ? std::log(double(settings.weight_cutoff)) : 0.0;
+	const int width			= noisy_image.width();
+	const int height		= noisy_image.height();
+
+	const nvRect grid = { 0, 0, map.cols, map.rows };
+	nvThreadPool& pool = thread_pool(settings.threads);
+	pool.parallel_tiles(grid, 8, 8, [&](const nvRect& tile, int)
+	{
+		for(int cy = tile.y; cy < tile.y + tile.height; ++cy)
+		{
+			for(int cx = tile.x; cx < tile.x + tile.width; ++cx)
+			{
+				//the cell and its margin, without the image border the mask does not fit into
+				const int x = (map.x0 + cx) * NLM_NOISE_CELL;
+				const int y = (map.y0 + cy) * NLM_NOISE_CELL;
+				const int x0 = std::max(x - NLM_NOISE_MARGIN, 1);
+				const int y0 = std::max(y - NLM_NOISE_MARGIN, 1);
+				const int x1 = std::min(x + NLM_NOISE_CELL + NLM_NOISE_MARGIN, width - 1);
+				const int y1 = std::min(y + NLM_NOISE_CELL + NLM_NOISE_MARGIN, height - 1);
+
+				nvNoiseCell& cell = map.cells[cy * map.cols + cx];
+				cell.sigma = x0 < x1 && y0 < y1 ? float(NOISE_SCALE * laplacian_residual(noisy_image, x0, y0, x1, y1)) : 0.0f;
+
+				if(cell.sigma < settings.noise_floor)				cell.level = NLM_NOISE_CLEAN;
+				else if(cell.sigma < 2.0f * settings.noise_floor)	cell.level = NLM_NOISE_NEAR;
+				else if(cell.sigma < 4.0f * settings.noise_floor)	cell.level = NLM_NOISE_SPARSE;
+				else												cell.level = NLM_NOISE_FULL;
+
+				//a noise free cell above a floor of 0 still needs a finite h
+				const double h	= std::max(gain * cell.sigma, 1e-6);
+				cell.h2			= float(2.0 * h * h);
+				cell.max_dist	= settings.weight_cutoff > 0.0f ? float(-cell.h2 * log_cutoff) : std::numeric_limits<float>::infinity();
+			}
+		}
+	});
+}
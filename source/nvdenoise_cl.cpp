@@ -1,14 +1,260 @@
 #include <boost/compute/core.hpp>
+#include <boost/compute/memory/local_buffer.hpp>
 #include <boost/compute/type_traits.hpp>
 #include <boost/compute/utility/source.hpp>
-#include <boost/compute/container/vector.hpp>
 #include <boost/compute/types/struct.hpp>
 #include "nvdenoise.h"
+#include "nvclruntime.h"
+#include "nvlog.h"
+#include "nvtrace.h"
 
-#include "c4d_general.h"
-#include "c4d_string.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
 
-BOOST_COMPUTE_ADAPT_STRUCT(nvDenoiseSettings, nvDenoiseSettings, (patch_size, search_size, search_offset, h))
+/****************************************************************************/
+/* Half precision input														*/
+/*																			*/
+/* With half_input the noisy frames (color and guides) are uploaded as		*/
+/* fp16 and read with vload_half, the distances, weights and sums stay		*/
+/* fp32. That halves the upload and the device memory the memory bound		*/
+/* kernels stream through. The result is the fp32 filter of the input		*/
+/* rounded to fp16: 11 significant bits, values above 65504 become			*/
+/* infinity. The CPU engines compare patches in tiles that stay in the		*/
+/* caches and always read fp32.												*/
+/*																			*/
+/* Image border																*/
+/*																			*/
+/* In skip mode every sample is tested against the border. In clamp mode	*/
+/* the frames are uploaded with a border of clamped pixels as wide as the	*/
+/* patch reach, each pixel padded to a multiple of 4 elements. The kernels	*/
+/* then load the color as one aligned float4 (half4 with half_input) and	*/
+/* have no border tests in the patch loops, at a third more upload without	*/
+/* guides. The CPU engines clamp the sample positions instead.				*/
+/****************************************************************************/
+
+namespace
+{
+	/* device buffer slots of the runtime */
+	enum
+	{
+		NLM_BUFFER_INPUT = 0,
+		NLM_BUFFER_OUTPUT,
+		NLM_BUFFER_RING,			// frames of the temporal filter
+		NLM_BUFFER_FRAME_OFFSETS,	// offsets of the searched frames in the input or ring buffer
+		NLM_BUFFER_GUIDE_WEIGHTS,	// weights of the guide planes
+		NLM_BUFFER_NOISE			// noise cells of the adaptive mode
+	};
+
+	/* pinned host memory slots of the runtime */
+	enum
+	{
+		NLM_PINNED_INPUT = 0,		// staged input rows, or the new frames of the temporal filter
+		NLM_PINNED_OUTPUT			// downloaded roi rows
+	};
+
+	/* Border of clamped pixels around the device frames and elements per pixel, see the image border */
+	/* above. The border covers the patch reach, candidates outside the image are skipped */
+	int input_pad(const nvDenoiseSettings& settings)
+	{
+		return settings.edge_mode == NLM_EDGE_CLAMP ? settings.patch_size - 1 - (settings.patch_size - 1) / 2 : 0;
+	}
+
+	int input_stride(const nvDenoiseSettings& settings, int channels)
+	{
+		return settings.edge_mode == NLM_EDGE_CLAMP ? (channels + 3) / 4 * 4 : channels;
+	}
+
+	/* Build options baking the settings into the program for the common patch sizes and offsets. */
+	/* Other settings use the generic program that reads them from the kernel arguments */
+	std::string cl_build_options(const nvDenoiseSettings& settings, int channels)
+	{
+		//fp16 input frames, padded vectors with a clamped border
+		std::string input = settings.half_input ? "-DHALF_INPUT" : "";
+		if(settings.edge_mode == NLM_EDGE_CLAMP)
+		{
+			char vector[64];
+			snprintf(vector, sizeof(vector), " -DVECTOR_INPUT -DINPUT_PAD=%d -DINPUT_STRIDE=%d", input_pad(settings), input_stride(settings, channels));
+			input += vector;
+		}
+
+		const bool common_patch		= settings.patch_size == 3 || settings.patch_size == 5 || settings.patch_size == 7;
+		const bool common_offset	= settings.search_offset >= 1 && settings.search_offset <= 3;
+		if(!common_patch || !common_offset)
+			return input;
+
+		char options[96];
+		snprintf(options, sizeof(options), "-DPATCH_SIZE=%d -DSEARCH_SIZE=%d -DSEARCH_OFFSET=%d ", settings.patch_size, settings.search_size, settings.search_offset);
+		return options + input;
+	}
+
+	double seconds_since(const std::chrono::steady_clock::time_point& start)
+	{
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	/* Local memory tiles of the tiled kernel for a work-group of group_x * group_y pixels, in floats. */
+	/* The patch tile holds the patches of the group, the search tile the patches of all their candidates */
+	void tile_floats(const nvDenoiseSettings& settings, int channels, size_t group_x, size_t group_y, size_t& patch_floats, size_t& search_floats)
+	{
+		const size_t patch_reach	= settings.patch_size - 1;
+		const size_t search_reach	= settings.search_size - 1 + patch_reach;
+		patch_floats	= (group_x + patch_reach) * (group_y + patch_reach) * channels;
+		search_floats	= (group_x + search_reach) * (group_y + search_reach) * channels;
+	}
+
+	/* Work-group sizes of the tiled kernel the device can run with tiles that fit into its local memory, */
+	/* best guess first. Empty if none fits, only the direct kernel can run then */
+	std::vector<std::pair<size_t, size_t>> tiled_group_sizes(const boost::compute::device& device, const boost::compute::kernel& kernel, const nvDenoiseSettings& settings, int channels)
+	{
+		//wide groups first, rows of a group read consecutive addresses
+		static const size_t candidates[][2] = { { 16, 16 }, { 32, 8 }, { 16, 8 }, { 8, 8 }, { 8, 4 } };
+
+		//the kernel has no local memory of its own besides the tiles
+		const size_t max_items	= kernel.get_work_group_info<size_t>(device, CL_KERNEL_WORK_GROUP_SIZE);
+		const size_t available	= size_t(device.local_memory_size());
+
+		std::vector<std::pair<size_t, size_t>> sizes;
+		for(size_t i = 0; i < sizeof(candidates) / sizeof(candidates[0]); ++i)
+		{
+			size_t patch_floats, search_floats;
+			tile_floats(settings, channels, candidates[i][0], candidates[i][1], patch_floats, search_floats);
+			if(candidates[i][0] * candidates[i][1] <= max_items && (patch_floats + search_floats) * sizeof(float) <= available)
+				sizes.push_back(std::make_pair(candidates[i][0], candidates[i][1]));
+		}
+		return sizes;
+	}
+
+	/* Launch configuration of the filter, chosen by the auto tuner */
+	struct nvCLLaunch
+	{
+		int		tiled;		// non_local_mean_tiled (1) or non_local_mean (0)
+		size_t	group[2];	// work-group size of the tiled kernel
+		int		slices;		// launches the roi rows are split into
+	};
+
+	//longest a single launch should run, display drivers reset devices that are busy for too long
+	const double NLM_CL_SLICE_SECONDS = 0.05;
+
+	//bands the roi is pipelined in, the copies of the first and the last band are not hidden
+	const int NLM_CL_BANDS = 8;
+
+	/* Profile key of a frame size and the settings that change the kernel work */
+	std::string launch_key(const nvDenoiseSettings& settings, int width, int height, int channels, int frames)
+	{
+		char key[96];
+		//the fast weights skip most of the patch comparisons, which changes the best launch
+		snprintf(key, sizeof(key), "%dx%d/p%d/s%d/o%d/c%d/f%d%s%s%s", width, height, settings.patch_size, settings.search_size, settings.search_offset, channels, frames,
+				 settings.weight_cutoff > 0.0f ? "/fast" : "", settings.half_input ? "/half" : "", settings.edge_mode == NLM_EDGE_CLAMP ? "/clamp" : "");
+		return key;
+	}
+
+	std::string format_launch(const nvCLLaunch& launch)
+	{
+		char text[64];
+		snprintf(text, sizeof(text), "%s %u %u %d", launch.tiled ? "tiled" : "direct", unsigned(launch.group[0]), unsigned(launch.group[1]), launch.slices);
+		return text;
+	}
+
+	bool parse_launch(const std::string& text, nvCLLaunch& launch)
+	{
+		char variant[16];
+		unsigned group_x, group_y;
+		if(sscanf(text.c_str(), "%15s %u %u %d", variant, &group_x, &group_y, &launch.slices) != 4 || launch.slices < 1)
+			return false;
+
+		launch.tiled	= !strcmp(variant, "tiled");
+		launch.group[0]	= group_x;
+		launch.group[1]	= group_y;
+		return launch.tiled ? group_x > 0 && group_y > 0 : !strcmp(variant, "direct");
+	}
+
+	/* A device command of a frame, traced with its profiling times once the frame is done */
+	struct nvCLTraced
+	{
+		const char*				name;
+		int						track;	// nvTraceTrack of the queue
+		unsigned long long		bytes;
+		unsigned long long		pixels;
+		boost::compute::event	event;
+	};
+
+	/* Adds the finished commands to the trace. Device clocks are not the host clock, the last */
+	/* command is taken to end now */
+	void trace_device(const std::vector<nvCLTraced>& commands)
+	{
+		if(commands.empty())
+			return;
+
+		NAVIE_GLOBAL::nvTrace& trace = NAVIE_GLOBAL::nvTrace::instance();
+		const double now = trace.now();
+		try
+		{
+			cl_ulong last = 0;
+			for(size_t c = 0; c < commands.size(); ++c)
+				last = std::max(last, commands[c].event.get_profiling_info<cl_ulong>(CL_PROFILING_COMMAND_END));
+
+			for(size_t c = 0; c < commands.size(); ++c)
+			{
+				const nvCLTraced& command = commands[c];
+				const cl_ulong start	= command.event.get_profiling_info<cl_ulong>(CL_PROFILING_COMMAND_START);
+				const cl_ulong end		= command.event.get_profiling_info<cl_ulong>(CL_PROFILING_COMMAND_END);
+				trace.add(command.name, now - (last - start) * 1e-3, (end - start) * 1e-3, command.bytes, command.pixels, command.track);
+			}
+		}
+		catch(boost::compute::opencl_error&)
+		{
+			//queues created before tracing was enabled do not profile
+		}
+	}
+}
+
+BOOST_COMPUTE_ADAPT_STRUCT(nvDenoiseSettings, nvDenoiseSettings, (patch_size, search_size, search_offset, h, engine, fallback_engine, threads, isa, temporal_radius, albedo_weight, normal_weight, depth_weight, weight_cutoff, pyramid_levels, half_input, adaptive, noise_floor, edge_mode))
+
+/* Settings the program was built with (-D options) replace the kernel arguments, which lets the compiler */
+/* unroll the patch and search loops */
+const char nlm_settings[] =
+	"#ifndef PATCH_SIZE\n"
+	"#define PATCH_SIZE patch_size\n"
+	"#endif\n"
+	"#ifndef SEARCH_SIZE\n"
+	"#define SEARCH_SIZE search_size\n"
+	"#endif\n"
+	"#ifndef SEARCH_OFFSET\n"
+	"#define SEARCH_OFFSET search_offset\n"
+	"#endif\n"
+	//the frames are fp16 with -DHALF_INPUT, the filter itself computes in fp32
+	"#ifdef HALF_INPUT\n"
+	"typedef half nlm_input;\n"
+	"#define LOAD_INPUT(image, i) vload_half(i, image)\n"
+	"#else\n"
+	"typedef float nlm_input;\n"
+	"#define LOAD_INPUT(image, i) (image)[i]\n"
+	"#endif\n"
+	//clamped border (-DVECTOR_INPUT): the frames have a border of INPUT_PAD clamped pixels and every
+	//pixel takes INPUT_STRIDE elements, the color is one aligned vector and patches never leave the
+	//buffer. Otherwise pixels are channels elements and samples past the border are skipped
+	"#ifdef VECTOR_INPUT\n"
+	"#define PIXEL_STRIDE INPUT_STRIDE\n"
+	"#define PIXEL_INDEX(x, y) ((((y) + INPUT_PAD) * (width + 2 * INPUT_PAD) + (x) + INPUT_PAD) * INPUT_STRIDE)\n"
+	"#define OUTSIDE(p, q, size) 0\n"
+	"#ifdef HALF_INPUT\n"
+	"#define LOAD_COLOR(image, i) vloada_half4((i) / 4, image).xyz\n"
+	"#else\n"
+	"#define LOAD_COLOR(image, i) ((__global const float4*)(image))[(i) / 4].xyz\n"
+	"#endif\n"
+	"#else\n"
+	"#define INPUT_PAD 0\n"
+	"#define PIXEL_STRIDE channels\n"
+	"#define PIXEL_INDEX(x, y) (((y) * width + (x)) * channels)\n"
+	"#define OUTSIDE(p, q, size) ((p) < 0 || (q) < 0 || (p) >= (size) || (q) >= (size))\n"
+	"#define LOAD_COLOR(image, i) (float3)(LOAD_INPUT(image, i), LOAD_INPUT(image, (i) + 1), LOAD_INPUT(image, (i) + 2))\n"
+	"#endif\n";
 
 const char nlm[] = BOOST_COMPUTE_STRINGIZE_SOURCE
 (
@@ -17,23 +263,67 @@ const char nlm[] = BOOST_COMPUTE_STRINGIZE_SOURCE
 	uint create_index_arr(const uint x, const uint y, const uint size) { return (size * y * 3) + (x * 3); }
 
 	float square(const float x) { return x * x; }
+
+	/* Whether cells of the noise level compare the search offset k along one axis, the masks of */
+	/* nvNoiseMap::axis */
+	bool noise_uses(const int level, const int k, const int search_size, const int search_offset)
+	{
+		const int half		= (SEARCH_SIZE - 1) / 2;
+		const int center	= (half + SEARCH_OFFSET / 2) / SEARCH_OFFSET;
+		const int offset	= k * SEARCH_OFFSET - half;
+		return level == 0 || ((k - center) % 2 == 0 && (level == 1 || 2 * abs(offset) <= half));
+	}
 		
-	__kernel void non_local_mean( __global const float* noisy_image
+	__kernel void non_local_mean( __global const nlm_input* frames
+								, __global const int* frame_offsets
+								, const int frame_count
 								, __global float* denoised_image
 								, const int width
 								, const int height
 								, const int patch_size
 								, const int search_size
 								, const int search_offset
-								, const float h2)
+								, const float h2
+								, const float max_dist
+								, const int channels
+								, __global const float* guide_weights
+								, const int guide_count
+								, __global const float4* noise
+								, const int noise_cols
+								, const int noise_x
+								, const int noise_y)
 	{
 		const uint x = get_global_id(0);
 		const uint y = get_global_id(1);
 
 		uint index = create_index(x,y,width) * 3;
+
+		//the frame to denoise comes first, the other ones are only searched for similar patches
+		__global const nlm_input* noisy_image = frames + frame_offsets[0];
+		__global const nlm_input* search_image;
+
+		//adaptive mode (noise_cols > 0): h, cutoff and search offsets of the noise cell of the pixel
+		float cell_h2		= h2;
+		float cell_max_dist	= max_dist;
+		int level			= 0;
+		if(noise_cols > 0)
+		{
+			const float4 cell	= noise[((int)y + noise_y) / NOISE_CELL * noise_cols + ((int)x + noise_x) / NOISE_CELL];
+			cell_h2				= cell.x;
+			cell_max_dist		= cell.y;
+			level				= (int)cell.z;
+		}
+		if(level == 3)
+		{
+			const int p = PIXEL_INDEX(x, y);
+			denoised_image[index]		= LOAD_INPUT(noisy_image, p);
+			denoised_image[index + 1]	= LOAD_INPUT(noisy_image, p + 1);
+			denoised_image[index + 2]	= LOAD_INPUT(noisy_image, p + 2);
+			return;
+		}
 		
-		const int patch_size_half = (patch_size - 1) / 2;
-		const int search_size_half = (search_size - 1) / 2;
+		const int patch_size_half = (PATCH_SIZE - 1) / 2;
+		const int search_size_half = (SEARCH_SIZE - 1) / 2;
 
 		//current pixel's search window start coordinates (centered at p = (x,y))
 		const int x_start = x - search_size_half;
@@ -48,154 +338,702 @@ const char nlm[] = BOOST_COMPUTE_STRINGIZE_SOURCE
 		//accumulate the final weighted output pixel value
 		float3 out		= (float3)(0.0f);
 		float3 cweight	= (float3)(0.0f);
+		float3 diff;
+
+		//weighted squared difference of the guide planes (albedo, normal, depth), which follow the color
+		float guide_dist;
 
 		//Browse the 'search zone' and average pixel weights for each patch
-		int searchpos_y = y_start, searchpos_x, nindex, idx_w, pindex, qindex;
-		int i, j, a, b, nbpatch_qx, nbpatch_qy, patchpos_py, patchpos_qy, patchpos_px, patchpos_qx;
+		int searchpos_y, searchpos_x, nindex, idx_w, pindex, qindex;
+		int f, g, i, j, a, b, nbpatch_qx, nbpatch_qy, patchpos_py, patchpos_qy, patchpos_px, patchpos_qx;
 
-		for(j = 0; j < search_size; j += search_offset, searchpos_y += search_offset) 
+		for(f = 0; f < frame_count; ++f)
 		{
-			searchpos_x = x_start;
-			nindex		= create_index_arr(searchpos_x, searchpos_y, width); //image index
-			idx_w		= create_index_arr(0, j, search_size); //Weight index
-			for(i = 0; i < search_size; i += search_offset, idx_w += (search_offset * 3), searchpos_x += search_offset, nindex += (search_offset * 3)) 
+			search_image = frames + frame_offsets[f];
+			searchpos_y = y_start;
+
+			for(j = 0; j < SEARCH_SIZE; j += SEARCH_OFFSET, searchpos_y += SEARCH_OFFSET) 
 			{
-				if((searchpos_x >= width) || (searchpos_x < 0) || (searchpos_y >= height) || (searchpos_y < 0))
+				if(level && !noise_uses(level, j / SEARCH_OFFSET, search_size, search_offset))
 					continue;
 
-				//Neighbor patch to evaluate weighting kernel in
-				//patch coordinates centered at q
-				nbpatch_qx = searchpos_x - patch_size_half;
-				nbpatch_qy = searchpos_y - patch_size_half;
-
-				//retrieve w(i,j) kernel:
-				//
-				//w(i,j)	= exp(-(d(i,j) / 2h)) / E(j){ exp(-(d(i,j) / 2h)) }
-				//d(i,j)	= v(i + t) - v(j + t)
-				//v(i)		= pixel value
-				//i,j		= 2D patch coordinates(x,y) of p,q
-				patchpos_py = y_startp;
-				patchpos_qy = nbpatch_qy;
-
-				cweight = (float3)(0.0f);
-				// weight value equals sum of all squared differences of neighborhood pixels (see denominator of w(i,j))
-				for(b = 0; b < patch_size; b++, ++patchpos_py, ++patchpos_qy) 
+				searchpos_x = x_start;
+				nindex		= PIXEL_INDEX(searchpos_x, searchpos_y); //image index
+				idx_w		= create_index_arr(0, j, SEARCH_SIZE); //Weight index
+				for(i = 0; i < SEARCH_SIZE; i += SEARCH_OFFSET, idx_w += (SEARCH_OFFSET * 3), searchpos_x += SEARCH_OFFSET, nindex += (SEARCH_OFFSET * PIXEL_STRIDE)) 
 				{
-					if((patchpos_qy >= height) || (patchpos_qy < 0) || (patchpos_py >= height) || (patchpos_py < 0)) 
+					if((searchpos_x >= width) || (searchpos_x < 0) || (searchpos_y >= height) || (searchpos_y < 0))
+						continue;
+					if(level && !noise_uses(level, i / SEARCH_OFFSET, search_size, search_offset))
 						continue;
 
-					patchpos_px = x_startp;
-					patchpos_qx = nbpatch_qx;
-					
-					pindex = create_index_arr(patchpos_px, patchpos_py, width);
-					qindex = create_index_arr(patchpos_qx, patchpos_qy, width);
+					//Neighbor patch to evaluate weighting kernel in
+					//patch coordinates centered at q
+					nbpatch_qx = searchpos_x - patch_size_half;
+					nbpatch_qy = searchpos_y - patch_size_half;
 
-					for(a = 0; a < patch_size; a++, ++patchpos_px, ++patchpos_qx, pindex += 3, qindex += 3) 
+					//retrieve w(i,j) kernel:
+					//
+					//w(i,j)	= exp(-(d(i,j) / 2h)) / E(j){ exp(-(d(i,j) / 2h)) }
+					//d(i,j)	= v(i + t) - v(j + t)
+					//v(i)		= pixel value
+					//i,j		= 2D patch coordinates(x,y) of p,q
+					patchpos_py = y_startp;
+					patchpos_qy = nbpatch_qy;
+
+					cweight = (float3)(0.0f);
+					guide_dist = 0.0f;
+					// weight value equals sum of all squared differences of neighborhood pixels (see denominator of w(i,j))
+					for(b = 0; b < PATCH_SIZE; b++, ++patchpos_py, ++patchpos_qy) 
 					{
-						//out of bounds check
-						if((patchpos_qx >= width) || (patchpos_qx < 0) || (patchpos_px >= width) || (patchpos_px < 0))
-						   continue;
-
-						//get intensity values (color) at patch pixels p & q
-						//accumulate squared difference for each color component
-						cweight.x += square(noisy_image[pindex] - noisy_image[qindex]);
-						cweight.y += square(noisy_image[pindex + 1] - noisy_image[qindex + 1]);
-						cweight.z += square(noisy_image[pindex + 2] - noisy_image[qindex + 2]);						
+						//out of bounds check, none with the clamped border
+						if(OUTSIDE(patchpos_py, patchpos_qy, height))
+							continue;
+
+						patchpos_px = x_startp;
+						patchpos_qx = nbpatch_qx;
+						
+						pindex = PIXEL_INDEX(patchpos_px, patchpos_py);
+						qindex = PIXEL_INDEX(patchpos_qx, patchpos_qy);
+
+						for(a = 0; a < PATCH_SIZE; a++, ++patchpos_px, ++patchpos_qx, pindex += PIXEL_STRIDE, qindex += PIXEL_STRIDE) 
+						{
+							if(OUTSIDE(patchpos_px, patchpos_qx, width))
+							   continue;
+
+							//get intensity values (color) at patch pixels p & q
+							//accumulate squared difference for each color component
+							diff = LOAD_COLOR(noisy_image, pindex) - LOAD_COLOR(search_image, qindex);
+							cweight += diff * diff;
+
+							for(g = 0; g < guide_count; ++g)
+								guide_dist += guide_weights[g] * square(LOAD_INPUT(noisy_image, pindex + 3 + g) - LOAD_INPUT(search_image, qindex + 3 + g));
+						}
+
+						//fast weights: the distances only grow, stop once every channel is past the cutoff
+						if(all(cweight + (float3)(guide_dist) > (float3)(cell_max_dist)))
+							break;
 					}
+					cweight += (float3)(guide_dist);
+
+					//getting the exponent of current pixel in the weight matrix and divide it by squared h (nominator)
+					cweight.x	= cweight.x > cell_max_dist ? 0.0f : exp(-cweight.x / cell_h2);
+					cweight.y	= cweight.y > cell_max_dist ? 0.0f : exp(-cweight.y / cell_h2);
+					cweight.z	= cweight.z > cell_max_dist ? 0.0f : exp(-cweight.z / cell_h2);
+					
+					//accumulate the final weighted output pixel value
+					out += cweight * LOAD_COLOR(search_image, nindex);
+
+					//accumulate normalizing factor z (denominator)
+					norm_factor.x += cweight.x;
+					norm_factor.y += cweight.y;
+					norm_factor.z += cweight.z;				
 				}
+			}
+		}
+		//all candidates dropped by the fast weights, the pixel stays as it is
+		pindex = PIXEL_INDEX(x, y);
+		denoised_image[index]		= norm_factor.x > 0.0f ? out.x / norm_factor.x : LOAD_INPUT(noisy_image, pindex);
+		denoised_image[index + 1]	= norm_factor.y > 0.0f ? out.y / norm_factor.y : LOAD_INPUT(noisy_image, pindex + 1);
+		denoised_image[index + 2]	= norm_factor.z > 0.0f ? out.z / norm_factor.z : LOAD_INPUT(noisy_image, pindex + 2);
+	}
+
+	/* Copies the tile_w x tile_h pixels at (tile_x,tile_y) into local memory, every work-item of the */
+	/* group takes a share. Pixels outside the image and its clamped border are never read by the */
+	/* filter and left undefined. The tiles are fp32 for fp16 input too */
+	void load_tile(__global const nlm_input* image, __local float* tile, const int tile_x, const int tile_y, const int tile_w, const int tile_h,
+				   const int width, const int height, const int channels)
+	{
+		const int items = get_local_size(0) * get_local_size(1);
+		int i, c, tx, ty;
+		for(i = get_local_id(1) * get_local_size(0) + get_local_id(0); i < tile_w * tile_h; i += items)
+		{
+			tx = tile_x + i % tile_w;
+			ty = tile_y + i / tile_w;
+			if(tx < -INPUT_PAD || ty < -INPUT_PAD || tx >= width + INPUT_PAD || ty >= height + INPUT_PAD)
+				continue;
+
+			for(c = 0; c < channels; ++c)
+				tile[i * channels + c] = LOAD_INPUT(image, PIXEL_INDEX(tx, ty) + c);
+		}
+	}
+
+	/* Same filter as non_local_mean, but every work-group loads its patches and the patches of all */
+	/* their search candidates into local memory once per frame and compares them there. Work-items */
+	/* past the roi only help loading, the global size is rounded up to whole work-groups */
+	__kernel void non_local_mean_tiled( __global const nlm_input* frames
+									  , __global const int* frame_offsets
+									  , const int frame_count
+									  , __global float* denoised_image
+									  , const int width
+									  , const int height
+									  , const int patch_size
+									  , const int search_size
+									  , const int search_offset
+									  , const float h2
+									  , const float max_dist
+									  , const int channels
+									  , __global const float* guide_weights
+									  , const int guide_count
+									  , __global const float4* noise
+									  , const int noise_cols
+									  , const int noise_x
+									  , const int noise_y
+									  , const int roi_end_x
+									  , const int roi_end_y
+									  , __local float* patch_tile
+									  , __local float* search_tile)
+	{
+		const int x = get_global_id(0);
+		const int y = get_global_id(1);
+		const bool active = x < roi_end_x && y < roi_end_y;
+
+		//adaptive mode, see non_local_mean. Clean cells still load their share of the tiles
+		float cell_h2		= h2;
+		float cell_max_dist	= max_dist;
+		int level			= 0;
+		if(active && noise_cols > 0)
+		{
+			const float4 cell	= noise[(y + noise_y) / NOISE_CELL * noise_cols + (x + noise_x) / NOISE_CELL];
+			cell_h2				= cell.x;
+			cell_max_dist		= cell.y;
+			level				= (int)cell.z;
+		}
+
+		const int patch_size_half = (PATCH_SIZE - 1) / 2;
+		const int search_size_half = (SEARCH_SIZE - 1) / 2;
 
-				//getting the exponent of current pixel in the weight matrix and divide it by squared h (nominator)
-				cweight.x	= exp(-cweight.x / h2);
-				cweight.y	= exp(-cweight.y / h2);
-				cweight.z	= exp(-cweight.z / h2);
-				
-				//accumulate the final weighted output pixel value
-				out.x += (cweight.x * noisy_image[nindex]);
-				out.y += (cweight.y * noisy_image[nindex + 1]);
-				out.z += (cweight.z * noisy_image[nindex + 2]);
-
-				//accumulate normalizing factor z (denominator)
-				norm_factor.x += cweight.x;
-				norm_factor.y += cweight.y;
-				norm_factor.z += cweight.z;				
+		//tiles of the work-group: its patches, and the patches of all search candidates
+		const int group_x = x - get_local_id(0);
+		const int group_y = y - get_local_id(1);
+		const int ptile_x = group_x - patch_size_half;
+		const int ptile_y = group_y - patch_size_half;
+		const int ptile_w = get_local_size(0) + PATCH_SIZE - 1;
+		const int ptile_h = get_local_size(1) + PATCH_SIZE - 1;
+		const int stile_x = ptile_x - search_size_half;
+		const int stile_y = ptile_y - search_size_half;
+		const int stile_w = ptile_w + SEARCH_SIZE - 1;
+		const int stile_h = ptile_h + SEARCH_SIZE - 1;
+
+		load_tile(frames + frame_offsets[0], patch_tile, ptile_x, ptile_y, ptile_w, ptile_h, width, height, channels);
+
+		const int x_start = x - search_size_half;
+		const int y_start = y - search_size_half;
+		const int x_startp = x - patch_size_half;
+		const int y_startp = y - patch_size_half;
+
+		float3 norm_factor	= (float3)(0.0f);
+		float3 out			= (float3)(0.0f);
+		float3 cweight;
+		float guide_dist;
+
+		int searchpos_y, searchpos_x, nindex, pindex, qindex;
+		int f, g, i, j, a, b, nbpatch_qx, nbpatch_qy, patchpos_py, patchpos_qy, patchpos_px, patchpos_qx;
+
+		for(f = 0; f < frame_count; ++f)
+		{
+			//the previous frame's tile is still read until every work-item is done with it
+			barrier(CLK_LOCAL_MEM_FENCE);
+			load_tile(frames + frame_offsets[f], search_tile, stile_x, stile_y, stile_w, stile_h, width, height, channels);
+			barrier(CLK_LOCAL_MEM_FENCE);
+
+			if(!active || level == 3)
+				continue;
+
+			searchpos_y = y_start;
+			for(j = 0; j < SEARCH_SIZE; j += SEARCH_OFFSET, searchpos_y += SEARCH_OFFSET) 
+			{
+				if(level && !noise_uses(level, j / SEARCH_OFFSET, search_size, search_offset))
+					continue;
+
+				searchpos_x = x_start;
+				for(i = 0; i < SEARCH_SIZE; i += SEARCH_OFFSET, searchpos_x += SEARCH_OFFSET) 
+				{
+					if((searchpos_x >= width) || (searchpos_x < 0) || (searchpos_y >= height) || (searchpos_y < 0))
+						continue;
+					if(level && !noise_uses(level, i / SEARCH_OFFSET, search_size, search_offset))
+						continue;
+
+					nbpatch_qx = searchpos_x - patch_size_half;
+					nbpatch_qy = searchpos_y - patch_size_half;
+					patchpos_py = y_startp;
+					patchpos_qy = nbpatch_qy;
+
+					cweight = (float3)(0.0f);
+					guide_dist = 0.0f;
+					for(b = 0; b < PATCH_SIZE; b++, ++patchpos_py, ++patchpos_qy) 
+					{
+						if(OUTSIDE(patchpos_py, patchpos_qy, height))
+							continue;
+
+						patchpos_px = x_startp;
+						patchpos_qx = nbpatch_qx;
+						pindex = ((patchpos_py - ptile_y) * ptile_w + patchpos_px - ptile_x) * channels;
+						qindex = ((patchpos_qy - stile_y) * stile_w + patchpos_qx - stile_x) * channels;
+
+						for(a = 0; a < PATCH_SIZE; a++, ++patchpos_px, ++patchpos_qx, pindex += channels, qindex += channels) 
+						{
+							if(OUTSIDE(patchpos_px, patchpos_qx, width))
+							   continue;
+
+							cweight.x += square(patch_tile[pindex] - search_tile[qindex]);
+							cweight.y += square(patch_tile[pindex + 1] - search_tile[qindex + 1]);
+							cweight.z += square(patch_tile[pindex + 2] - search_tile[qindex + 2]);
+
+							for(g = 0; g < guide_count; ++g)
+								guide_dist += guide_weights[g] * square(patch_tile[pindex + 3 + g] - search_tile[qindex + 3 + g]);
+						}
+
+						if(all(cweight + (float3)(guide_dist) > (float3)(cell_max_dist)))
+							break;
+					}
+					cweight += (float3)(guide_dist);
+
+					cweight.x	= cweight.x > cell_max_dist ? 0.0f : exp(-cweight.x / cell_h2);
+					cweight.y	= cweight.y > cell_max_dist ? 0.0f : exp(-cweight.y / cell_h2);
+					cweight.z	= cweight.z > cell_max_dist ? 0.0f : exp(-cweight.z / cell_h2);
+
+					nindex = ((searchpos_y - stile_y) * stile_w + searchpos_x - stile_x) * channels;
+					out.x += (cweight.x * search_tile[nindex]);
+					out.y += (cweight.y * search_tile[nindex + 1]);
+					out.z += (cweight.z * search_tile[nindex + 2]);
+
+					norm_factor += cweight;
+				}
 			}
 		}
-		denoised_image[index]		= out.x / norm_factor.x;
-		denoised_image[index + 1]	= out.y / norm_factor.y;
-		denoised_image[index + 2]	= out.z / norm_factor.z;		
+
+		if(!active)
+			return;
+
+		const uint index = create_index(x,y,width) * 3;
+		pindex = ((y - ptile_y) * ptile_w + x - ptile_x) * channels;
+		denoised_image[index]		= norm_factor.x > 0.0f ? out.x / norm_factor.x : patch_tile[pindex];
+		denoised_image[index + 1]	= norm_factor.y > 0.0f ? out.y / norm_factor.y : patch_tile[pindex + 1];
+		denoised_image[index + 2]	= norm_factor.z > 0.0f ? out.z / norm_factor.z : patch_tile[pindex + 2];
 	}
 );
 
-void NAVIE_GLOBAL::nvNLMdenoiser::non_local_mean_cl(const nvDenoiseSettings& settings
-													, const std::vector<float>& noisy_image
-													, std::vector<float>& denoised_image
-													, const int width
-													, const int height)
+/* Host side buffers of the uploaded frames, kept between frames */
+struct NAVIE_GLOBAL::nvCLFrameState
 {
-	const int beginX = 0;
-	const int beginY = 0;
-	const int endX = width;
-	const int endY = height;
+	/* Layout of the frames held by the device ring, a copy is only reused with the same layout */
+	struct nvRingLayout
+	{
+		int		width;
+		int		height;
+		int		channels;		// color and guide planes
+		int		pixel_stride;
+		int		pad;			// clamped border pixels around the frame
+		int		edge_mode;
+		int		half_input;
 
-	const int patch_size_half = (settings.patch_size - 1) / 2;
-	const int seach_size_half = (settings.search_size - 1) / 2;
+		bool operator==(const nvRingLayout& other) const
+		{
+			return width == other.width && height == other.height && channels == other.channels && pixel_stride == other.pixel_stride
+				&& pad == other.pad && edge_mode == other.edge_mode && half_input == other.half_input;
+		}
+	};
 
-	const float h2 = 1.f / (settings.h * settings.h);
+	nvCLFrameState() : ring_layout() {}
 
-	boost::compute::device device = boost::compute::system::default_device();
-	boost::compute::context context(device);
-	boost::compute::command_queue queue(context, device/*, CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE*/);
+	std::vector<float>		staging;			// interleaved input row before its fp16 conversion
+	std::vector<float>		noise;				// noise cells as float4 (h2, max_dist, level, 0)
+	std::vector<int>		frame_offsets;		// of the searched frames in the device input
+	std::vector<unsigned>	ring_versions;		// nvFrameRing versions held by the device ring, per slot
+	nvRingLayout			ring_layout;		// of the frames in the device ring, zero before the first
+};
 
-	/* create gpu memory and fill it with data from the host */
-	boost::compute::vector<float> input_image(noisy_image, queue);
+bool NAVIE_GLOBAL::nvNLMdenoiser::non_local_mean_cl(const nvDenoiseSettings& settings
+													, const nvImage& noisy_image
+													, nvImage& denoised_image
+													, const nvRect& roi)
+{
+	//only the roi and the pixels the filter reads around it go to the device. The device ring keeps
+	//whole frames, the next frames search them too
+	const int reach		= halo(settings);
+	const int left		= m_ring ? 0 : std::max(roi.x - reach, 0);
+	const int top		= m_ring ? 0 : std::max(roi.y - reach, 0);
+	const int width		= (m_ring ? noisy_image.width() : std::min(roi.x + roi.width + reach, noisy_image.width())) - left;
+	const int height	= (m_ring ? noisy_image.height() : std::min(roi.y + roi.height + reach, noisy_image.height())) - top;
 
-	/* create gpu memory for the denoised result */
-	boost::compute::vector<float> output_image(denoised_image.size(), 0.0f, queue);
+	//the roi in the uploaded window
+	const int beginX	= roi.x - left;
+	const int beginY	= roi.y - top;
+	const int endX		= beginX + roi.width;
+	const int endY		= beginY + roi.height;
 
-	/* Create the kernel */
-	std::string final_code = boost::compute::type_definition<nvDenoiseSettings>() + "\n" + nlm;
-	boost::compute::program nlm_program = boost::compute::program::build_with_source(final_code, context);
-		
-	boost::compute::kernel nlm_kernel(nlm_program, "non_local_mean");
-	nlm_kernel.set_arg(0, input_image);
-	nlm_kernel.set_arg(1, output_image);
-	nlm_kernel.set_arg(2, width);
-	nlm_kernel.set_arg(3, height);
-	nlm_kernel.set_arg(4, settings.patch_size);
-	nlm_kernel.set_arg(5, settings.search_size);
-	nlm_kernel.set_arg(6, settings.search_offset);
-	nlm_kernel.set_arg(7, h2);
-
-	size_t kernels		= 32;
-	size_t clusters		= 1;
-	size_t size_fraction = (endY / kernels);
-
-	size_t kernelsm		= kernels - 1;
-	size_t clustersm	= clusters - 1;
-	
-	std::vector<boost::compute::event> events;
-	int cluster = 0;
-	for(int i = 0; i < kernels; ++i, ++cluster)
-	{
-		size_t start[2] = { 0, size_fraction * i }; //start offset
-		size_t end[2] = { endX, size_fraction }; //length of the sequence
-		if(i == kernelsm) //Last one takes the rest
-			end[1] = endY - start[1];
-
-		try {
-			if(i == 0)
-				events.push_back(queue.enqueue_nd_range_kernel(nlm_kernel, 2, start, end, 0));
-			else
-				events.push_back(queue.enqueue_nd_range_kernel(nlm_kernel, 2, start, end, 0, events.back()));
-
-			if(cluster >= clustersm || i == kernelsm) {
-				queue.finish();
-				cluster = 0;
+	const float h2 = 2.f * settings.h * settings.h; //same weighting as non_local_mean
+	const float max_dist = cutoff_distance(settings); //fast weights, infinity keeps every candidate
+
+	denoised_image.resize(roi.width, roi.height, 3);
+	nvCLFrameState& state = engine_state(m_cl_frames);
+
+	if(!m_cl)
+		m_cl = nvCLRuntime::shared();
+
+	//the runtime, its queues and buffers are shared with the other denoiser instances
+	nvCLRuntime& cl = *m_cl;
+	std::lock_guard<std::mutex> lock(cl.mutex());
+
+	try
+	{
+		if(!cl.initialize())
+			return false;
+
+		boost::compute::command_queue& queue			= cl.queue();
+		boost::compute::command_queue& upload_queue		= cl.upload_queue();
+		boost::compute::command_queue& download_queue	= cl.download_queue();
+		std::chrono::steady_clock::time_point stage = std::chrono::steady_clock::now();
+		double upload_seconds = 0.0, download_seconds = 0.0;
+
+		//device commands of the frame, only collected while tracing
+		const bool tracing = NV_TRACE_ENABLED();
+		std::vector<nvCLTraced> traced;
+		auto trace_command = [&](const char* name, int track, size_t bytes, size_t pixels, const boost::compute::event& event)
+		{
+			if(tracing)
+			{
+				const nvCLTraced command = { name, track, bytes, pixels, event };
+				traced.push_back(command);
 			}
+		};
+
+		//guide planes (albedo, normal, depth) are interleaved after the color of every pixel
+		float guide_weights[NLM_MAX_GUIDE_PLANES];
+		const int guides	= used_guide_planes(settings, noisy_image, guide_weights);
+		const int channels	= 3 + guides;
+
+		//color vectors encoded in a float array, the layout the kernel reads. With half_input the
+		//rows are converted to fp16 on the host, which halves the upload. With the clamped border
+		//every pixel takes pixel_stride elements and the frame is surrounded by pad clamped pixels
+		const int pad				= input_pad(settings);
+		const int pixel_stride		= input_stride(settings, channels);
+		const bool padded			= settings.edge_mode == NLM_EDGE_CLAMP;
+		const int device_rows		= height + 2 * pad;
+		const size_t element		= settings.half_input ? sizeof(unsigned short) : sizeof(float);
+		const size_t row_elements	= size_t(width + 2 * pad) * pixel_stride;
+		const size_t frame_floats	= row_elements * device_rows;
+		const size_t bytes			= frame_floats * element;
+		if(settings.half_input || padded)
+			nv_pool_resize(state.staging, row_elements + (padded ? size_t(width) * channels : 0));
+
+		//interleaves the device rows [first,last) of image into pinned memory laid out like the device
+		//buffer. Border rows and columns repeat the nearest pixel of the window
+		const nvHalfConverter to_half = nv_nlm_kernels(settings.isa)->to_half;
+		auto stage_rows = [&](const nvImage& image, int first, int last, unsigned char* pinned)
+		{
+			NV_TRACE_NAMED_SCOPE(staging, "stage input");
+			NV_TRACE_COUNT(staging, (unsigned long long)(last - first) * row_elements * element, (unsigned long long)(last - first) * width);
+			for(int r = first; r < last; ++r)
+			{
+				const int y = std::min(std::max(r - pad, 0), height - 1);
+				unsigned char* target = pinned + r * row_elements * element;
+				float* row = settings.half_input ? &state.staging[0] : (float*)target;
+				if(!padded)
+					image.get_row_interleaved(top + y, left, width, row, channels);
+				else
+				{
+					float* pixels = &state.staging[row_elements];
+					image.get_row_interleaved(top + y, left, width, pixels, channels);
+					for(int x = 0; x < width + 2 * pad; ++x)
+					{
+						const float* from	= pixels + std::min(std::max(x - pad, 0), width - 1) * channels;
+						float* to			= row + x * pixel_stride;
+						for(int c = 0; c < pixel_stride; ++c)
+							to[c] = c < channels ? from[c] : 0.0f;
+					}
+				}
+				if(settings.half_input)
+					to_half(row, (unsigned short*)target, row_elements);
+			}
+		};
+
+		//buffer handles are copied, the runtime may move its slots when it grows
+		boost::compute::buffer frames;
+		std::vector<int>& frame_offsets = state.frame_offsets;
+		frame_offsets.clear();
+		nv_pool_reserve(frame_offsets, m_ring ? m_search_frames.size() : 1);
+		boost::compute::wait_list input_ready;	// uploads the next launch waits for
+		int uploaded = 0;						// device rows of the current frame sent to the device
+		if(!m_ring)
+		{
+			/* reuse the gpu memory of the last frame, it is filled band by band below */
+			frames = cl.buffer(NLM_BUFFER_INPUT, bytes);
+			frame_offsets.push_back(0);
 		}
-		catch(boost::compute::opencl_error& e) { GePrint(e.to_string(e.error_code()).c_str()); }
-	}
+		else
+		{
+			/* temporal filter: the device keeps a copy of the frame ring, only frames that are new */
+			/* to it are uploaded, each from its own part of the pinned memory */
+			const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			frames = cl.buffer(NLM_BUFFER_RING, bytes * m_ring->capacity());
+			//any change of the layout (size, guides, border, fp16) makes every device copy stale
+			const nvCLFrameState::nvRingLayout layout = { width, height, channels, pixel_stride, pad, int(settings.edge_mode), settings.half_input };
+			if(!cl.claim_buffer(NLM_BUFFER_RING, this) || !(state.ring_layout == layout) || state.ring_versions.size() != size_t(m_ring->capacity()))
+				nv_pool_assign(state.ring_versions, size_t(m_ring->capacity()), 0u);
+			state.ring_layout = layout;
 
-	//Copy denoised result back to host output vector
-	boost::compute::copy(output_image.begin(), output_image.end(), denoised_image.begin(), queue);
-}
\ No newline at end of file
+			unsigned char* pinned = (unsigned char*)cl.pinned(NLM_PINNED_INPUT, bytes * m_search_frames.size());
+			for(size_t f = 0; f < m_search_frames.size(); ++f)
+			{
+				const int slot = m_search_slots[f];
+				if(state.ring_versions[slot] != m_ring->version(slot))
+				{
+					stage_rows(*m_search_frames[f], 0, device_rows, pinned + f * bytes);
+					const boost::compute::event uploaded_frame = upload_queue.enqueue_write_buffer_async(frames, slot * bytes, bytes, pinned + f * bytes);
+					input_ready.insert(uploaded_frame);
+					trace_command("device upload", NV_TRACE_DEVICE_UPLOAD, bytes, size_t(width) * height, uploaded_frame);
+					upload_queue.flush();
+					state.ring_versions[slot] = m_ring->version(slot);
+				}
+				frame_offsets.push_back(int(slot * frame_floats));
+			}
+			uploaded = device_rows;
+			upload_seconds += seconds_since(start);
+		}
+
+		//sends the window rows of the current frame up to last, the next launch waits for them. The
+		//bottom border goes with the last row
+		unsigned char* input_pinned = m_ring ? nullptr : (unsigned char*)cl.pinned(NLM_PINNED_INPUT, bytes);
+		auto upload_rows = [&](int last)
+		{
+			last = last >= height ? device_rows : last + pad;
+			if(last <= uploaded)
+				return;
+
+			const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			const size_t offset = uploaded * row_elements * element;
+			stage_rows(noisy_image, uploaded, last, input_pinned);
+			const boost::compute::event rows = upload_queue.enqueue_write_buffer_async(frames, offset, (last - uploaded) * row_elements * element, input_pinned + offset);
+			input_ready.insert(rows);
+			trace_command("device upload", NV_TRACE_DEVICE_UPLOAD, (last - uploaded) * row_elements * element, size_t(last - uploaded) * width, rows);
+			upload_queue.flush();
+			uploaded = last;
+			upload_seconds += seconds_since(start);
+		};
+
+		const int frame_count = int(frame_offsets.size());
+		boost::compute::buffer offsets = cl.buffer(NLM_BUFFER_FRAME_OFFSETS, frame_offsets.size() * sizeof(int));
+		queue.enqueue_write_buffer(offsets, 0, frame_offsets.size() * sizeof(int), &frame_offsets[0]);
+
+		//the kernel reads at least one weight
+		boost::compute::buffer weights = cl.buffer(NLM_BUFFER_GUIDE_WEIGHTS, sizeof(guide_weights));
+		if(guides)
+			queue.enqueue_write_buffer(weights, 0, guides * sizeof(float), guide_weights);
+
+		//noise cells of the adaptive mode, one float4 (h2, max_dist, level, 0) each. The kernels read
+		//them relative to the window, they are at least one cell
+		const nvNoiseMap& noise = m_noise;
+		const int noise_cols	= noise.active ? noise.cols : 0;
+		const int noise_x		= noise.active ? left - noise.x0 * NLM_NOISE_CELL : 0;
+		const int noise_y		= noise.active ? top - noise.y0 * NLM_NOISE_CELL : 0;
+		const size_t noise_cells = noise.active ? noise.cells.size() : 1;
+		boost::compute::buffer noise_buffer = cl.buffer(NLM_BUFFER_NOISE, noise_cells * 4 * sizeof(float));
+		if(noise.active)
+		{
+			std::vector<float>& cells = state.noise;
+			nv_pool_resize(cells, noise_cells * 4);
+			for(size_t c = 0; c < noise_cells; ++c)
+			{
+				cells[c * 4]		= noise.cells[c].h2;
+				cells[c * 4 + 1]	= noise.cells[c].max_dist;
+				cells[c * 4 + 2]	= float(noise.cells[c].level);
+				cells[c * 4 + 3]	= 0.0f;
+			}
+			queue.enqueue_write_buffer(noise_buffer, 0, noise_cells * 4 * sizeof(float), &cells[0]);
+		}
+
+		/* gpu memory for the denoised result */
+		boost::compute::buffer output_image = cl.buffer(NLM_BUFFER_OUTPUT, size_t(width) * height * 3 * sizeof(float));
+
+		/* The kernels are compiled once per runtime and settings (or loaded from the binary cache) */
+		NV_TRACE_NAMED_SCOPE(compile, "compile");
+		static const std::string final_code = boost::compute::type_definition<nvDenoiseSettings>() + "\n" + nlm_settings +
+											  "#define NOISE_CELL " + std::to_string(NLM_NOISE_CELL) + "\n" + nlm;
+		const std::string options = cl_build_options(settings, channels);
+		boost::compute::kernel& direct_kernel	= cl.kernel(final_code, options, "non_local_mean");
+		boost::compute::kernel& tiled_kernel	= cl.kernel(final_code, options, "non_local_mean_tiled");
+
+		boost::compute::kernel* nlm_kernels[2] = { &direct_kernel, &tiled_kernel };
+		for(int k = 0; k < 2; ++k)
+		{
+			boost::compute::kernel& nlm_kernel = *nlm_kernels[k];
+			nlm_kernel.set_arg(0, frames);
+			nlm_kernel.set_arg(1, offsets);
+			nlm_kernel.set_arg(2, frame_count);
+			nlm_kernel.set_arg(3, output_image);
+			nlm_kernel.set_arg(4, width);
+			nlm_kernel.set_arg(5, height);
+			nlm_kernel.set_arg(6, settings.patch_size);
+			nlm_kernel.set_arg(7, settings.search_size);
+			nlm_kernel.set_arg(8, settings.search_offset);
+			nlm_kernel.set_arg(9, h2);
+			nlm_kernel.set_arg(10, max_dist);
+			nlm_kernel.set_arg(11, channels);
+			nlm_kernel.set_arg(12, weights);
+			nlm_kernel.set_arg(13, guides);
+			nlm_kernel.set_arg(14, noise_buffer);
+			nlm_kernel.set_arg(15, noise_cols);
+			nlm_kernel.set_arg(16, noise_x);
+			nlm_kernel.set_arg(17, noise_y);
+		}
+		tiled_kernel.set_arg(18, endX);
+		tiled_kernel.set_arg(19, endY);
+		NV_TRACE_END(compile);
+
+		//enqueues the roi rows [first,last) after the pending uploads, in a share of launch.slices
+		//launches. The tiled kernel runs whole work-groups, its slices and width are rounded up to them.
+		//Returns the event of the last launch
+		auto enqueue = [&](const nvCLLaunch& launch, int first, int last) -> boost::compute::event
+		{
+			boost::compute::kernel& nlm_kernel = launch.tiled ? tiled_kernel : direct_kernel;
+			const size_t group_x = launch.tiled ? launch.group[0] : 1;
+			const size_t group_y = launch.tiled ? launch.group[1] : 1;
+			if(launch.tiled)
+			{
+				size_t patch_floats, search_floats;
+				tile_floats(settings, channels, group_x, group_y, patch_floats, search_floats);
+				nlm_kernel.set_arg(20, boost::compute::local_buffer<float>(patch_floats));
+				nlm_kernel.set_arg(21, boost::compute::local_buffer<float>(search_floats));
+			}
+
+			const size_t columns	= ((roi.width + group_x - 1) / group_x) * group_x;
+			const size_t row_groups	= (last - first + group_y - 1) / group_y;
+			const size_t share		= (size_t(launch.slices) * (last - first) + roi.height - 1) / roi.height;
+			const size_t slices		= std::min<size_t>(std::max<size_t>(share, 1), row_groups);
+			const size_t slice_rows	= (row_groups / slices) * group_y;
+
+			//the compute queue runs in order, launches only wait for each other on the device
+			boost::compute::event done;
+			for(size_t i = 0; i < slices; ++i)
+			{
+				size_t start[2] = { size_t(beginX), first + slice_rows * i }; //start offset
+				size_t end[2] = { columns, slice_rows }; //length of the sequence
+				if(i == slices - 1) //Last one takes the rest
+					end[1] = ((last - start[1] + group_y - 1) / group_y) * group_y;
+
+				done = queue.enqueue_nd_range_kernel(nlm_kernel, 2, start, end, launch.tiled ? launch.group : 0, input_ready);
+				input_ready.clear();
+				trace_command("device filter", NV_TRACE_DEVICE_COMPUTE, 0, std::min<size_t>(end[1], last - start[1]) * roi.width, done);
+			}
+			queue.flush();
+			return done;
+		};
+
+		//the launch profile of this device, frame size and settings, tuned on first use. Keyed by the
+		//image size, not by the window of every roi
+		const std::vector<std::pair<size_t, size_t>> groups = tiled_group_sizes(cl.device(), tiled_kernel, settings, channels);
+		const std::string key = launch_key(settings, noisy_image.width(), noisy_image.height(), channels, frame_count);
+		std::string profile;
+		nvCLLaunch launch;
+		bool tuned = cl.profile(key, profile) && parse_launch(profile, launch);
+		if(tuned && launch.tiled)
+			tuned = std::find(groups.begin(), groups.end(), std::make_pair(launch.group[0], launch.group[1])) != groups.end();
+
+		if(!tuned)
+		{
+			NV_TRACE_SCOPE("tune");
+
+			//the candidates run on the whole input
+			upload_rows(height);
+			upload_queue.finish();
+			input_ready.clear();
+
+			std::vector<nvCLLaunch> candidates;
+			nvCLLaunch candidate = { 0, { 0, 0 }, 1 };
+			candidates.push_back(candidate);
+			for(size_t g = 0; g < groups.size(); ++g)
+			{
+				candidate.tiled		= 1;
+				candidate.group[0]	= groups[g].first;
+				candidate.group[1]	= groups[g].second;
+				candidates.push_back(candidate);
+			}
+
+			//every candidate filters a band of the roi twice, the faster run counts
+			const int band = std::min(roi.height, 64);
+			double best = 0.0;
+			for(size_t c = 0; c < candidates.size(); ++c)
+			{
+				for(int run = 0; run < 2; ++run)
+				{
+					const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+					enqueue(candidates[c], beginY, beginY + band).wait();
+					const double seconds = seconds_since(start);
+					if((c == 0 && run == 0) || seconds < best)
+					{
+						best	= seconds;
+						launch	= candidates[c];
+					}
+				}
+			}
+
+			//as few slices as possible while each one stays short
+			const double frame_seconds = best * height / band;
+			launch.slices = std::max(1, std::min(64, int(std::ceil(frame_seconds / NLM_CL_SLICE_SECONDS))));
+
+			cl.set_profile(key, format_launch(launch));
+			nv_log("nvDenoise: tuned OpenCL launch for %s: %s", key.c_str(), format_launch(launch).c_str());
+		}
+
+		m_times.setup = seconds_since(stage) - upload_seconds;
+		stage = std::chrono::steady_clock::now();
+		const double setup_upload_seconds = upload_seconds;
+
+		/* The roi is filtered in bands. A band is launched as soon as the input rows it reads are */
+		/* uploaded and downloaded as soon as it is done, the three queues run those copies while */
+		/* other bands are filtered. The host stages the input of the next band and converts the */
+		/* output of the previous one in the meantime. Bands are aligned to the work-groups, no */
+		/* two launches write the same rows */
+		const int group_rows	= launch.tiled ? int(launch.group[1]) : 1;
+		const int band_rows		= ((roi.height + NLM_CL_BANDS - 1) / NLM_CL_BANDS + group_rows - 1) / group_rows * group_rows;
+		const size_t row_floats	= size_t(width) * 3;
+		float* output_pinned	= (float*)cl.pinned(NLM_PINNED_OUTPUT, roi.height * row_floats * sizeof(float));
+
+		std::vector<boost::compute::event> downloads;
+		downloads.reserve(NLM_CL_BANDS);
+		auto convert = [&](int band)
+		{
+			{
+				NV_TRACE_SCOPE("wait");
+				downloads[band].wait();
+			}
+			const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			const int last = std::min((band + 1) * band_rows, roi.height);
+			NV_TRACE_NAMED_SCOPE(conversion, "convert output");
+			NV_TRACE_COUNT(conversion, (unsigned long long)(last - band * band_rows) * roi.width * 3 * sizeof(float), (unsigned long long)(last - band * band_rows) * roi.width);
+			for(int y = band * band_rows; y < last; ++y)
+				denoised_image.set_row_interleaved(y, 0, roi.width, output_pinned + y * row_floats + beginX * 3, 3);
+			download_seconds += seconds_since(start);
+		};
+
+		for(int first = 0; first < roi.height; first += band_rows)
+		{
+			const int last = std::min(first + band_rows, roi.height);
+			upload_rows(std::min(beginY + last + reach, height));
+
+			const boost::compute::event filtered = enqueue(launch, beginY + first, beginY + last);
+			downloads.push_back(download_queue.enqueue_read_buffer_async(output_image, (beginY + first) * row_floats * sizeof(float), (last - first) * row_floats * sizeof(float),
+																		 output_pinned + first * row_floats, boost::compute::wait_list(filtered)));
+			download_queue.flush();
+			trace_command("device download", NV_TRACE_DEVICE_DOWNLOAD, (last - first) * row_floats * sizeof(float), size_t(last - first) * width, downloads.back());
+
+			if(downloads.size() > 1)
+				convert(int(downloads.size()) - 2);
+		}
+		convert(int(downloads.size()) - 1);
+		if(tracing)
+			trace_device(traced);
+
+		m_times.upload		= upload_seconds;
+		m_times.download	= download_seconds;
+		m_times.filter		= seconds_since(stage) - (upload_seconds - setup_upload_seconds) - download_seconds;
+	}
+	catch(boost::compute::opencl_error& e)
+	{
+		nv_log("nvDenoise: %s, the CPU engine runs instead", e.what());
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,325 @@
+#include "nvdenoise.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+/****************************************************************************/
+/* Integral image variant of the non-local mean filter						*/
+/* (Darbon et al, 2008)														*/
+/*																			*/
+/* The brute force version sums patch_size^2 squared differences for every	*/
+/* pixel and every search position. Here the squared difference between	*/
+/* the image and its copy shifted by one search displacement is integrated	*/
+/* once, so each patch distance for that displacement is an O(1) box sum.	*/
+/* Cost drops from W*H*S^2*P^2 to W*H*S^2.									*/
+/*																			*/
+/* The image is processed in tiles, each tile only integrates its own		*/
+/* pixels plus the patch overhang, which keeps the scratch memory per		*/
+/* worker small even for 4K frames.											*/
+/*																			*/
+/* The weighted guide differences are integrated as a fourth channel of	*/
+/* the table and added to the distance of every color channel.				*/
+/*																			*/
+/* The squared differences of a table row and the weights of a tile row	*/
+/* are computed by the vector kernels of settings.isa, the weights with	*/
+/* their polynomial exp. Only the running sums along the rows stay scalar	*/
+/* and in double precision.													*/
+/*																			*/
+/* In noise adaptive mode a displacement is only integrated if a cell of	*/
+/* the tile compares it, a tile of clean cells is not integrated at all.	*/
+/****************************************************************************/
+
+namespace
+{
+	inline double sqr(double x) { return x * x; }
+}
+
+/* Integral engine state, kept between frames */
+struct NAVIE_GLOBAL::nvIntegralState
+{
+	/* Scratch memory of one worker, kept alive between tiles and frames */
+	struct Worker
+	{
+		std::vector<double>	table;	// summed squared differences
+		std::vector<float>	rows;	// squared differences and weights of a tile row
+		std::vector<float>	accum;	// weighted sums and normalizing factors
+	};
+
+	std::vector<Worker>	workers;	// one entry per pool worker
+	std::vector<int>	offsets;	// search offsets along one axis
+};
+
+void NAVIE_GLOBAL::nvNLMdenoiser::non_local_mean_integral(const nvDenoiseSettings* settings, const nvImage& noisy_image, nvImage& denoised_image, const nvRect& roi)
+{
+	const int width		= noisy_image.width();
+	const int height	= noisy_image.height();
+
+	denoised_image.resize(roi.width, roi.height, 3);
+
+	const float* planes[3] = { noisy_image.plane(0), noisy_image.plane(1), noisy_image.plane(2) };
+	const int stride = noisy_image.stride();
+
+	//frames searched for similar patches, the noisy image first
+	const std::vector<const nvImage*>& frames = search_frames(noisy_image);
+
+	//guide planes (albedo, normal, depth) compared along with the color
+	float guide_weights[NLM_MAX_GUIDE_PLANES];
+	const int guides = used_guide_planes(*settings, noisy_image, guide_weights);
+	const int channels = guides ? 4 : 3;	// of the table
+	const float* guide_planes[NLM_MAX_GUIDE_PLANES];
+	for(int g = 0; g < guides; ++g)
+		guide_planes[g] = noisy_image.plane(3 + g);
+
+	const int patch_size_half = (settings->patch_size - 1) / 2;
+	const int seach_size_half = (settings->search_size - 1) / 2;
+
+	//extent of a patch right of/below its center (differs from patch_size_half for even sizes)
+	const int patch_size_rest = settings->patch_size - 1 - patch_size_half;
+
+	const double h2 = 2 * sqr(settings->h); //same weighting as non_local_mean
+
+	//fast weights: candidates past max_dist are dropped
+	const double max_dist	= cutoff_distance(*settings);
+	const float scale		= float(-1.0 / h2);
+
+	//vector row passes, see the top of the file
+	const nvNLMKernels& kernels = *nv_nlm_kernels(settings->isa);
+
+	//search displacements, visited in the same order as in the brute force version
+	nvIntegralState& state = engine_state(m_integral);
+	std::vector<int>& displacements = state.offsets;
+	nv_pool_resize(displacements, size_t((settings->search_size + settings->search_offset - 1) / settings->search_offset));
+	for(size_t s = 0; s < displacements.size(); ++s)
+		displacements[s] = int(s) * settings->search_offset - seach_size_half;
+
+	//adaptive mode: every noise cell brings its own h and search offsets
+	const nvNoiseMap& noise = m_noise;
+
+	//patch samples past the border compare the nearest border pixel, the tables extend past it
+	const bool clamp = settings->edge_mode == NLM_EDGE_CLAMP;
+
+	//tiles start at the roi origin. Streamed bands begin at multiples of INTEGRAL_TILE_SIZE,
+	//so they integrate exactly the same windows as a whole frame pass
+	nvThreadPool& pool = thread_pool(settings->threads);
+	if(state.workers.size() < size_t(pool.size()))
+		nv_pool_resize(state.workers, pool.size());
+	pool.parallel_tiles(roi, INTEGRAL_TILE_SIZE, INTEGRAL_TILE_SIZE, [&](const nvRect& tile, int worker)
+	{
+		const int x0 = tile.x, x1 = tile.x + tile.width;
+		const int y0 = tile.y, y1 = tile.y + tile.height;
+
+		//pixels touched by the patches of this tile, clipped to the image unless the border is clamped
+		const int ix0 = clamp ? x0 - patch_size_half : std::max(x0 - patch_size_half, 0);
+		const int ix1 = clamp ? x1 + patch_size_rest : std::min(x1 + patch_size_rest, width);
+		const int iy0 = clamp ? y0 - patch_size_half : std::max(y0 - patch_size_half, 0);
+		const int iy1 = clamp ? y1 + patch_size_rest : std::min(y1 + patch_size_rest, height);
+
+		//summed squared difference table with a leading zero row and column, 3 or 4 interleaved channels
+		const int istride = (ix1 - ix0 + 1) * channels;
+		std::vector<double>& integral = state.workers[worker].table;
+		nv_pool_assign(integral, size_t((iy1 - iy0 + 1) * istride), 0.0);
+
+		//weighted sum and normalizing factor of every tile pixel, one plane per channel
+		const int tile_pixels = tile.width * tile.height;
+		const int tile_floats = tile_pixels * 3;
+		std::vector<float>& accum = state.workers[worker].accum;
+		nv_pool_assign(accum, size_t(tile_floats * 2), 0.0f);
+		float* out			= &accum[0];
+		float* norm_factor	= &accum[tile_floats];
+
+		//squared differences of a table row, and the exp arguments and weights of a tile row, one plane
+		//per channel each
+		const int span = ix1 - ix0;
+		std::vector<float>& rows = state.workers[worker].rows;
+		nv_pool_resize(rows, size_t(span * channels + tile.width * 6));
+		float* squares	= &rows[0];
+		float* args		= &rows[span * channels];
+		float* weights	= args + tile.width * 3;
+
+		//noise levels of the cells in the tile, a bit per level
+		unsigned levels = 1u << NLM_NOISE_FULL;
+		if(noise.active)
+		{
+			levels = 0;
+			for(int y = y0; y < y1; y = (y / NLM_NOISE_CELL + 1) * NLM_NOISE_CELL)
+			{
+				for(int x = x0; x < x1; x = (x / NLM_NOISE_CELL + 1) * NLM_NOISE_CELL)
+					levels |= 1u << noise.at(x, y).level;
+			}
+			levels &= ~(1u << NLM_NOISE_CLEAN);
+		}
+
+		for(size_t f = 0; f < frames.size() && levels; ++f)
+		{
+			const float* qplanes[3 + NLM_MAX_GUIDE_PLANES];
+			for(int c = 0; c < 3 + guides; ++c)
+				qplanes[c] = frames[f]->plane(c);
+
+			for(size_t sy = 0; sy < displacements.size(); ++sy)
+			{
+				const int dy = displacements[sy];
+				for(size_t sx = 0; sx < displacements.size(); ++sx)
+				{
+					const int dx = displacements[sx];
+
+					//displacements no cell of the tile compares
+					if(noise.active)
+					{
+						bool used = false;
+						for(int level = 0; level < NLM_NOISE_CLEAN && !used; ++level)
+							used = (levels >> level & 1u) && noise.uses(level, int(sx), int(sy));
+						if(!used)
+							continue;
+					}
+
+					//integrate the squared difference between p and q = p + (dx,dy)
+					//pixels whose q lies outside the image contribute nothing, exactly like the
+					//skipped patch samples of the brute force version
+					for(int y = iy0; y < iy1; ++y)
+					{
+						const int qy = y + dy;
+						std::fill(squares, squares + span * channels, 0.0f);
+
+						//the columns whose p and q are both in the image go through the vector kernel
+						int xa = std::max(std::max(ix0, 0), -dx);
+						int xb = std::min(std::min(ix1, width), width - dx);
+						if(y < 0 || y >= height || qy < 0 || qy >= height || xa > xb)
+							xa = xb = ix0;
+						if(xb > xa)
+						{
+							const int p = get_index(xa, y, stride);
+							const int q = get_index(xa + dx, qy, stride);
+							for(int dim = 0; dim < 3; ++dim)
+								kernels.squared_diff(planes[dim] + p, qplanes[dim] + q, 1.0f, squares + dim * span + xa - ix0, xb - xa);
+							for(int g = 0; g < guides; ++g)
+								kernels.squared_diff(guide_planes[g] + p, qplanes[3 + g] + q, guide_weights[g], squares + 3 * span + xa - ix0, xb - xa);
+						}
+
+						//clamped mode: the other columns compare the nearest pixels in the image, with the
+						//arithmetic of the kernel
+						if(clamp)
+						{
+							const int py_clamped = std::min(std::max(y, 0), height - 1);
+							const int qy_clamped = std::min(std::max(qy, 0), height - 1);
+							for(int x = ix0 == xa ? xb : ix0; x < ix1; x = x + 1 == xa ? xb : x + 1)
+							{
+								const int p = get_index(std::min(std::max(x, 0), width - 1), py_clamped, stride);
+								const int q = get_index(std::min(std::max(x + dx, 0), width - 1), qy_clamped, stride);
+								for(int dim = 0; dim < 3; ++dim)
+								{
+									const float diff = planes[dim][p] - qplanes[dim][q];
+									squares[dim * span + x - ix0] = diff * diff;
+								}
+								for(int g = 0; g < guides; ++g)
+								{
+									const float diff = guide_planes[g][p] - qplanes[3 + g][q];
+									squares[3 * span + x - ix0] += guide_weights[g] * (diff * diff);
+								}
+							}
+						}
+
+						//running sums along the row
+						const double* above	= &integral[(y - iy0) * istride];
+						double* row			= &integral[(y - iy0 + 1) * istride];
+						double row_sum[4]	= { 0.0, 0.0, 0.0, 0.0 };
+						for(int i = 0, idx = channels; i < span; ++i, idx += channels)
+						{
+							for(int c = 0; c < channels; ++c)
+							{
+								row_sum[c] += squares[c * span + i];
+								row[idx + c] = above[idx + c] + row_sum[c];
+							}
+						}
+					}
+
+					//read every patch distance of the tile as a box sum
+					for(int y = y0; y < y1; ++y)
+					{
+						const int qy = y + dy;
+						if((qy >= height) || (qy < 0))
+							continue;
+
+						const double* top		= &integral[((clamp ? y - patch_size_half : std::max(y - patch_size_half, 0)) - iy0) * istride];
+						const double* bottom	= &integral[((clamp ? y + patch_size_rest + 1 : std::min(y + patch_size_rest + 1, height)) - iy0) * istride];
+
+						//the pixels whose candidate is in the image
+						const int xs = std::max(x0, -dx);
+						const int xe = std::min(x1, width - dx);
+						if(xs >= xe)
+							continue;
+
+						//exp arguments of the row, a positive one marks a candidate without weight
+						for(int x = xs; x < xe; ++x)
+						{
+							const int i = x - x0;
+							args[i] = args[tile.width + i] = args[2 * tile.width + i] = 1.0f;
+
+							//adaptive mode: the filter of the cell of the pixel
+							double pixel_max_dist	= max_dist;
+							float pixel_scale		= scale;
+							if(noise.active)
+							{
+								const nvNoiseCell& cell = noise.at(x, y);
+								if(!noise.uses(cell.level, int(sx), int(sy)))
+									continue;
+								pixel_max_dist	= cell.max_dist;
+								pixel_scale		= float(-1.0 / cell.h2);
+							}
+
+							const int left	= ((clamp ? x - patch_size_half : std::max(x - patch_size_half, 0)) - ix0) * channels;
+							const int right	= ((clamp ? x + patch_size_rest + 1 : std::min(x + patch_size_rest + 1, width)) - ix0) * channels;
+
+							const double guide_dist = guides ? bottom[right + 3] - bottom[left + 3] - top[right + 3] + top[left + 3] : 0.0;
+
+							for(int dim = 0; dim < 3; ++dim)
+							{
+								double dist = bottom[right + dim] - bottom[left + dim] - top[right + dim] + top[left + dim];
+								if(guides)
+									dist += guide_dist;
+								//cancellation in the table can produce tiny negative distances
+								if(dist <= pixel_max_dist)
+									args[dim * tile.width + i] = float(std::max(dist, 0.0)) * pixel_scale;
+							}
+						}
+
+						//weights and weighted candidates of the row, plain loops the compiler vectorizes
+						const int count = xe - xs;
+						const int q		= get_index(xs + dx, qy, stride);
+						const int o		= (y - y0) * tile.width + xs - x0;
+						for(int dim = 0; dim < 3; ++dim)
+						{
+							const float* arg	= args + dim * tile.width + xs - x0;
+							float* weight		= weights + dim * tile.width + xs - x0;
+							kernels.exp_negative(arg, weight, count);
+
+							const float* candidate	= qplanes[dim] + q;
+							float* sum				= out + dim * tile_pixels + o;
+							float* norm				= norm_factor + dim * tile_pixels + o;
+							for(int k = 0; k < count; ++k)
+							{
+								const float w = arg[k] > 0.0f ? 0.0f : weight[k];
+								norm[k]	+= w;
+								sum[k]	+= w * candidate[k];
+							}
+						}
+					}
+				}
+			}
+		}
+
+		for(int dim = 0; dim < 3; ++dim)
+		{
+			for(int y = y0; y < y1; ++y)
+			{
+				const float* sum	= out + dim * tile_pixels + (y - y0) * tile.width;
+				const float* norm	= norm_factor + dim * tile_pixels + (y - y0) * tile.width;
+				for(int x = x0; x < x1; ++x)
+				{
+					//all candidates dropped by the fast weights, the pixel stays as it is
+					denoised_image.at(dim, x - roi.x, y - roi.y) = norm[x - x0] > 0.0f ? sum[x - x0] / norm[x - x0] : planes[dim][get_index(x, y, stride)];
+				}
+			}
+		}
+	});
+}
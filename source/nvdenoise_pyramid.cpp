@@ -0,0 +1,189 @@
+#include "nvdenoise.h"
+
+#include <algorithm>
+#include <cmath>
+#include <utility>
+#include <vector>
+
+/****************************************************************************/
+/* Pyramid mode																*/
+/*																			*/
+/* Low frequency noise needs search windows far larger than a render can	*/
+/* afford, the cost grows with the square of the window. Here the image is	*/
+/* halved pyramid_levels - 1 times (2x2 box filter) and every level is		*/
+/* denoised with the same patch and search sizes, so the window of level l	*/
+/* reaches 2^l times as far at 1/4^l of the cost: 3 levels with a 20 pixel	*/
+/* window reach as far as an 80 pixel one for about 1.3 times the cost of	*/
+/* the 20 pixel one. Fine grained noise is better left to a single level.	*/
+/*																			*/
+/* A level is denoised on its own, then its low frequencies are replaced	*/
+/* by the ones of the denoised coarser level:								*/
+/*																			*/
+/*	result = fine + upsample(shrink(coarse - downsample(fine)))				*/
+/*																			*/
+/* with bilinear upsampling. If the coarser level agrees with the fine one	*/
+/* nothing changes. Low frequency noise keeps its strength when halved, so	*/
+/* every level uses the same h. The coarse levels blur fine structure		*/
+/* though, shrink() fades out corrections much larger than the noise a		*/
+/* level leaves behind and keeps the edges of the fine level.				*/
+/*																			*/
+/* The coarse levels are denoised whole and only from the current frame,	*/
+/* the temporal frames are searched on the finest level only. The level	*/
+/* images are kept in the denoiser between frames.							*/
+/****************************************************************************/
+
+/* Pyramid mode state, kept between frames */
+struct NAVIE_GLOBAL::nvPyramidState
+{
+	/* Bilinear sample positions of a fine pixel on the coarse grid */
+	struct Lerp
+	{
+		int		i0;
+		int		i1;
+		float	t;
+	};
+
+	/* Images of one level */
+	struct Level
+	{
+		nvImage				noisy;		// the finer noisy image halved
+		nvImage				denoised;	// and denoised
+		nvImage				fine;		// the finer level over the roi plus the upsampling margin
+		nvImage				correction;	// low frequencies of fine the coarse level replaces
+		std::vector<Lerp>	columns;	// positions of the roi columns
+	};
+
+	Level	levels[NLM_MAX_PYRAMID_LEVELS - 1];	// coarser levels, the coarsest first
+};
+
+namespace
+{
+	/* Halves every plane of image with a 2x2 box filter. An odd last row or column is averaged with itself */
+	void downsample(const NAVIE_GLOBAL::nvImage& image, NAVIE_GLOBAL::nvImage& half, int planes)
+	{
+		const int width		= image.width();
+		const int height	= image.height();
+		half.resize((width + 1) / 2, (height + 1) / 2, planes);
+
+		for(int c = 0; c < planes; ++c)
+		{
+			for(int y = 0; y < half.height(); ++y)
+			{
+				const float* row0	= image.row(c, 2 * y);
+				const float* row1	= image.row(c, std::min(2 * y + 1, height - 1));
+				float* out			= half.row(c, y);
+				for(int x = 0; x < half.width(); ++x)
+				{
+					const int x0 = 2 * x;
+					const int x1 = std::min(2 * x + 1, width - 1);
+					out[x] = 0.25f * (row0[x0] + row0[x1] + row1[x0] + row1[x1]);
+				}
+			}
+		}
+	}
+
+	/* Corrections of about PYRAMID_SHRINK * h and more are structure the coarser level blurred */
+	const float PYRAMID_SHRINK = 0.15f;
+
+	/* Bilinear sample positions of fine pixel i on the coarse grid whose pixel 0 covers fine pixels */
+	/* 2 * first and 2 * first + 1. Positions are clamped to the count coarse pixels */
+	NAVIE_GLOBAL::nvPyramidState::Lerp lerp_position(int i, int first, int count)
+	{
+		//coarse pixel centers are at fine coordinates 2 * c + 0.5
+		const float u	= 0.5f * i - 0.25f;
+		const int c		= int(std::floor(u));
+
+		NAVIE_GLOBAL::nvPyramidState::Lerp lerp;
+		lerp.t	= u - c;
+		lerp.i0	= std::min(std::max(c - first, 0), count - 1);
+		lerp.i1	= std::min(std::max(c + 1 - first, 0), count - 1);
+		return lerp;
+	}
+}
+
+void NAVIE_GLOBAL::nvNLMdenoiser::denoise_pyramid(const nvDenoiseSettings& settings, const nvImage& noisy_image, nvImage& denoised_image, const nvRect& roi, int levels)
+{
+	if(levels <= 1)
+	{
+		run_engine(settings, noisy_image, denoised_image, roi);
+		return;
+	}
+
+	//the coarser levels, whole and without the temporal frames
+	nvPyramidState::Level& level = engine_state(m_pyramid).levels[levels - 2];
+	nvImage& coarse_noisy	= level.noisy;
+	nvImage& coarse			= level.denoised;
+	downsample(noisy_image, coarse_noisy, noisy_image.channels());
+	const nvRect coarse_roi = { 0, 0, coarse_noisy.width(), coarse_noisy.height() };
+
+	std::vector<const nvImage*> search_frames;
+	std::vector<int> search_slots;
+	const nvFrameRing* ring = m_ring;
+	m_search_frames.swap(search_frames);
+	m_search_slots.swap(search_slots);
+	m_ring = nullptr;
+
+	denoise_pyramid(settings, coarse_noisy, coarse, coarse_roi, levels - 1);
+
+	m_search_frames.swap(search_frames);
+	m_search_slots.swap(search_slots);
+	m_ring = ring;
+
+	//this level over the roi plus the coarse pixels the upsampling reads, starting on a coarse pixel
+	const int margin = 2;
+	const int x0 = std::max((roi.x & ~1) - margin, 0);
+	const int y0 = std::max((roi.y & ~1) - margin, 0);
+	const int x1 = std::min(((roi.x + roi.width + 1) & ~1) + margin, noisy_image.width());
+	const int y1 = std::min(((roi.y + roi.height + 1) & ~1) + margin, noisy_image.height());
+	const nvRect outer = { x0, y0, x1 - x0, y1 - y0 };
+
+	nvImage& fine		= level.fine;
+	nvImage& correction	= level.correction;
+	run_engine(settings, noisy_image, fine, outer);
+
+	//low frequencies the coarser level wants to replace, faded out where they are structure
+	const float shrink = settings.h > 0.0f ? 1.0f / (PYRAMID_SHRINK * settings.h) : 0.0f;
+	downsample(fine, correction, 3);
+	const int cx0 = x0 / 2;
+	const int cy0 = y0 / 2;
+	for(int c = 0; c < 3; ++c)
+	{
+		for(int y = 0; y < correction.height(); ++y)
+		{
+			const float* from	= coarse.row(c, cy0 + y);
+			float* row			= correction.row(c, y);
+			for(int x = 0; x < correction.width(); ++x)
+			{
+				const float difference = from[cx0 + x] - row[x];
+				const float r = difference * shrink;
+				row[x] = difference * std::exp(-r * r);
+			}
+		}
+	}
+
+	denoised_image.resize(roi.width, roi.height, 3);
+
+	std::vector<nvPyramidState::Lerp>& columns = level.columns;
+	nv_pool_resize(columns, size_t(roi.width));
+	for(int x = 0; x < roi.width; ++x)
+		columns[x] = lerp_position(roi.x + x, cx0, correction.width());
+
+	for(int y = 0; y < roi.height; ++y)
+	{
+		const nvPyramidState::Lerp row = lerp_position(roi.y + y, cy0, correction.height());
+		for(int c = 0; c < 3; ++c)
+		{
+			const float* top	= correction.row(c, row.i0);
+			const float* bottom	= correction.row(c, row.i1);
+			const float* source	= fine.row(c, roi.y + y - y0) + roi.x - x0;
+			float* out			= denoised_image.row(c, y);
+			for(int x = 0; x < roi.width; ++x)
+			{
+				const nvPyramidState::Lerp& column = columns[x];
+				const float upper = top[column.i0] + column.t * (top[column.i1] - top[column.i0]);
+				const float lower = bottom[column.i0] + column.t * (bottom[column.i1] - bottom[column.i0]);
+				out[x] = source[x] + upper + row.t * (lower - upper);
+			}
+		}
+	}
+}
@@ -0,0 +1,115 @@
+#include "nvdenoise.h"
+#include "nvtrace.h"
+
+#include <algorithm>
+#include <cstring>
+
+/****************************************************************************/
+/* Streaming denoiser														*/
+/*																			*/
+/* The frame is processed in horizontal bands. Each band is read together	*/
+/* with the halo rows the filter looks at, denoised and written back right	*/
+/* away, so peak memory is two noisy bands and one denoised band instead	*/
+/* of several full frame copies.											*/
+/*																			*/
+/* Rows that were already written back are still needed as halo of the		*/
+/* next band. They are taken from the previous band buffer, so every band	*/
+/* sees the noisy input only and the result equals a whole frame pass.		*/
+/*																			*/
+/* A region (render region) is streamed the same way, the bands are only	*/
+/* as wide as the region plus the halo and start at its top.				*/
+/****************************************************************************/
+
+/* Streaming state, kept between frames */
+struct NAVIE_GLOBAL::nvStreamState
+{
+	nvImage	bands[2];	// noisy rows of the current and the previous band
+	nvImage	out;		// denoised rows of the current band
+};
+
+bool NAVIE_GLOBAL::nvNLMdenoiser::denoise_streamed(const nvDenoiseSettings& settings, int width, int height, int band_height, const RowReader& read, const RowWriter& write)
+{
+	const nvRect frame = { 0, 0, width, height };
+	return denoise_streamed(settings, width, height, frame, band_height, read, write);
+}
+
+bool NAVIE_GLOBAL::nvNLMdenoiser::denoise_streamed(const nvDenoiseSettings& settings, int width, int height, const nvRect& region, int band_height, const RowReader& read, const RowWriter& write)
+{
+	//the part of the region inside the frame
+	const int region_left	= std::max(region.x, 0);
+	const int region_top	= std::max(region.y, 0);
+	const int region_right	= std::min(region.x + region.width, width);
+	const int region_bottom	= std::min(region.y + region.height, height);
+	if(region_right <= region_left || region_bottom <= region_top)
+		return true;
+
+	NV_TRACE_FRAME(-1);
+	const int halo_rows = halo(settings);
+
+	//band images start on the grid of the coarsest pyramid level to see the same coarse pixels as the frame,
+	//and on its noise cells in adaptive mode
+	const int levels	= std::min(settings.pyramid_levels, NLM_MAX_PYRAMID_LEVELS);
+	const int grid		= (levels > 1 ? 1 << (levels - 1) : 1) * (settings.adaptive ? NLM_NOISE_CELL : 1);
+
+	//the columns every band holds
+	const int left		= std::max(region_left - halo_rows, 0) / grid * grid;
+	const int right		= std::min(region_right + halo_rows, width);
+	const int columns	= right - left;
+
+	//bands start at multiples of the integral tile size below the region top to stay bit identical to
+	//a whole frame pass
+	if(band_height <= 0)
+		band_height = region_bottom - region_top;
+	band_height = ((band_height + INTEGRAL_TILE_SIZE - 1) / INTEGRAL_TILE_SIZE) * INTEGRAL_TILE_SIZE;
+
+	nvStreamState& state = engine_state(m_stream);
+	int previous	= -1;	// state.bands index of the last band
+	int last_top	= 0;	// frame rows held by the last band
+	int last_bottom	= 0;
+
+	for(int band_top = region_top; band_top < region_bottom; band_top += band_height)
+	{
+		const int band_bottom	= std::min(band_top + band_height, region_bottom);
+		const int top			= std::max(band_top - halo_rows, 0) / grid * grid;
+		const int bottom		= std::min(band_bottom + halo_rows, height);
+
+		const int current = (previous + 1) % 2;
+		nvImage& band = state.bands[current];
+		//color plus the guide planes, the reader fills all of them
+		if(!band.resize(columns, bottom - top, image_channels(settings)))
+			return false;
+
+		//rows shared with the last band, some of them have been overwritten in the frame by now
+		int y = top;
+		if(previous >= 0)
+		{
+			const nvImage& last = state.bands[previous];
+			for(; y < std::min(last_bottom, bottom); ++y)
+			{
+				for(int c = 0; c < band.channels(); ++c)
+					memcpy(band.row(c, y - top), last.row(c, y - last_top), sizeof(float) * columns);
+			}
+		}
+
+		if(y < bottom)
+		{
+			NV_TRACE_NAMED_SCOPE(copy_in, "copy in");
+			NV_TRACE_COUNT(copy_in, (unsigned long long)(bottom - y) * columns * band.channels() * sizeof(float), (unsigned long long)(bottom - y) * columns);
+			if(!read(left, y, bottom - y, band, y - top))
+				return false;
+		}
+
+		const nvRect roi = { region_left - left, band_top - top, region_right - region_left, band_bottom - band_top };
+		denoise(settings, band, state.out, roi);
+
+		NV_TRACE_NAMED_SCOPE(copy_out, "copy out");
+		NV_TRACE_COUNT(copy_out, (unsigned long long)roi.width * roi.height * 3 * sizeof(float), (unsigned long long)roi.width * roi.height);
+		if(!write(region_left, band_top, band_bottom - band_top, state.out, 0))
+			return false;
+
+		previous	= current;
+		last_top	= top;
+		last_bottom	= bottom;
+	}
+	return true;
+}
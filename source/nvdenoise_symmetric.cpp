@@ -0,0 +1,465 @@
+#include "nvdenoise.h"
+
+#include <algorithm>
+#include <cmath>
+
+/****************************************************************************/
+/* Symmetric variant of the integral image filter							*/
+/*																			*/
+/* The patch distance is symmetric, d(p,q) = d(q,p). The distance field of	*/
+/* a search displacement d therefore also holds the distances of -d, seen	*/
+/* from q = p + d. Every displacement whose mirror is in the search window	*/
+/* is integrated once and its weight is scattered to both p and q, so only	*/
+/* half of the displacements are integrated. Rows are integrated and		*/
+/* weighted with the vector row passes of the integral engine, the			*/
+/* scattered weights are added along contiguous rows of planar sums.		*/
+/*																			*/
+/* The scatter reaches into the neighbouring tiles. Every tile accumulates	*/
+/* into its own buffer covering the tile plus that reach and adds it to		*/
+/* the frame accumulator when it is done. Tiles are run in phases such		*/
+/* that the buffers of the tiles of one phase never overlap, so the		*/
+/* reduction needs no locks and the result does not depend on the worker	*/
+/* count. The sums are added in another order than in the other engines,	*/
+/* results agree with them within float rounding.							*/
+/*																			*/
+/* In noise adaptive mode p and q are weighted with the filters of their	*/
+/* own cells. The search offset masks of the levels are symmetric, so a		*/
+/* pair is compared if the cell of p or of q uses it.						*/
+/****************************************************************************/
+
+namespace
+{
+	inline double sqr(double x) { return x * x; }
+
+	/* Search displacement, paired ones also stand for their mirror */
+	struct nvDisplacement
+	{
+		int		dx;
+		int		dy;
+		bool	paired;
+	};
+}
+
+/* Symmetric engine state, kept between frames */
+struct NAVIE_GLOBAL::nvSymmetricState
+{
+	/* Scratch memory of one worker, kept alive between tiles and frames */
+	struct Worker
+	{
+		std::vector<double>	table;	// summed squared differences
+		std::vector<float>	rows;	// squared differences, exp arguments and weights of a tile row
+		std::vector<float>	accum;	// weighted sums and normalizing factors of a tile and its scatter reach
+	};
+
+	std::vector<Worker>			workers;		// one entry per pool worker
+	std::vector<float>			accum;			// roi sums, the tiles scatter into it
+	std::vector<int>			offsets;		// search offsets along one axis
+	std::vector<nvDisplacement>	pairs;			// displacements of the noisy image
+	std::vector<nvDisplacement>	displacements;	// displacements of the temporal frames
+};
+
+void NAVIE_GLOBAL::nvNLMdenoiser::non_local_mean_symmetric(const nvDenoiseSettings* settings, const nvImage& noisy_image, nvImage& denoised_image, const nvRect& roi)
+{
+	const int width		= noisy_image.width();
+	const int height	= noisy_image.height();
+
+	denoised_image.resize(roi.width, roi.height, 3);
+
+	const float* planes[3] = { noisy_image.plane(0), noisy_image.plane(1), noisy_image.plane(2) };
+	const int stride = noisy_image.stride();
+
+	//frames searched for similar patches, the noisy image first. Only its own patches are symmetric
+	const std::vector<const nvImage*>& frames = search_frames(noisy_image);
+
+	//guide planes (albedo, normal, depth) compared along with the color
+	float guide_weights[NLM_MAX_GUIDE_PLANES];
+	const int guides = used_guide_planes(*settings, noisy_image, guide_weights);
+	const int channels = guides ? 4 : 3;	// of the table
+	const float* guide_planes[NLM_MAX_GUIDE_PLANES];
+	for(int g = 0; g < guides; ++g)
+		guide_planes[g] = noisy_image.plane(3 + g);
+
+	const int patch_size_half = (settings->patch_size - 1) / 2;
+	const int seach_size_half = (settings->search_size - 1) / 2;
+	const int patch_size_rest = settings->patch_size - 1 - patch_size_half;
+
+	const double h2 = 2 * sqr(settings->h); //same weighting as non_local_mean
+
+	//fast weights: candidates past max_dist are dropped
+	const double max_dist	= cutoff_distance(*settings);
+	const float scale		= float(-1.0 / h2);
+
+	//vector row passes of the integral engine
+	const nvNLMKernels& kernels = *nv_nlm_kernels(settings->isa);
+
+	nvSymmetricState& state = engine_state(m_symmetric);
+	std::vector<int>& offsets = state.offsets;
+	nv_pool_resize(offsets, size_t((settings->search_size + settings->search_offset - 1) / settings->search_offset));
+	for(size_t s = 0; s < offsets.size(); ++s)
+		offsets[s] = int(s) * settings->search_offset - seach_size_half;
+
+	//displacements of the noisy image: pairs are integrated from the one pointing down (or right),
+	//displacements without a mirror (even search sizes) and the zero one only for p
+	std::vector<nvDisplacement>& pairs	= state.pairs;
+	std::vector<nvDisplacement>& all	= state.displacements;
+	pairs.clear();
+	all.clear();
+	nv_pool_reserve(pairs, offsets.size() * offsets.size());
+	nv_pool_reserve(all, offsets.size() * offsets.size());
+	int reach_x = 0, reach_y = 0;
+	for(size_t sy = 0; sy < offsets.size(); ++sy)
+	{
+		for(size_t sx = 0; sx < offsets.size(); ++sx)
+		{
+			const int dx = offsets[sx], dy = offsets[sy];
+			const bool mirrored = std::find(offsets.begin(), offsets.end(), -dx) != offsets.end() &&
+								  std::find(offsets.begin(), offsets.end(), -dy) != offsets.end();
+			const nvDisplacement single = { dx, dy, false };
+			all.push_back(single);
+
+			if(!mirrored || (dx == 0 && dy == 0))
+				pairs.push_back(single);
+			else if(dy > 0 || (dy == 0 && dx > 0))
+			{
+				const nvDisplacement pair = { dx, dy, true };
+				pairs.push_back(pair);
+				reach_x = std::max(reach_x, std::abs(dx));
+				reach_y = std::max(reach_y, dy);
+			}
+		}
+	}
+
+	//pixels above and beside the roi send their weights into it through the mirrored displacements
+	const int ex0 = std::max(roi.x - reach_x, 0);
+	const int ex1 = std::min(roi.x + roi.width + reach_x, width);
+	const int ey0 = std::max(roi.y - reach_y, 0);
+	const int ey1 = roi.y + roi.height;
+
+	//weighted sums and normalizing factors of the roi, one plane per sum
+	const size_t roi_pixels = size_t(roi.width) * roi.height;
+	nv_pool_assign(state.accum, roi_pixels * 6, 0.0f);
+
+	//adaptive mode: every noise cell brings its own h and search offsets
+	const nvNoiseMap& noise = m_noise;
+
+	//patch samples past the border compare the nearest border pixel, the tables extend past it
+	const bool clamp = settings->edge_mode == NLM_EDGE_CLAMP;
+
+	//tiles of one phase are far enough apart that their accumulators do not overlap
+	const int tile_size		= INTEGRAL_TILE_SIZE;
+	const int tiles_x		= (ex1 - ex0 + tile_size - 1) / tile_size;
+	const int tiles_y		= (ey1 - ey0 + tile_size - 1) / tile_size;
+	const int phases_x		= 1 + (2 * reach_x + tile_size - 1) / tile_size;
+	const int phases_y		= 1 + (reach_y + tile_size - 1) / tile_size;
+
+	nvThreadPool& pool = thread_pool(settings->threads);
+	if(state.workers.size() < size_t(pool.size()))
+		nv_pool_resize(state.workers, pool.size());
+	for(int phase_y = 0; phase_y < std::min(phases_y, tiles_y); ++phase_y)
+	{
+		for(int phase_x = 0; phase_x < std::min(phases_x, tiles_x); ++phase_x)
+		{
+			//the pool splits the tile indices of this phase, one per job tile
+			const nvRect phase = { 0, 0, (tiles_x - phase_x + phases_x - 1) / phases_x, (tiles_y - phase_y + phases_y - 1) / phases_y };
+			pool.parallel_tiles(phase, 1, 1, [&](const nvRect& cell, int worker)
+			{
+				const int x0 = ex0 + (phase_x + cell.x * phases_x) * tile_size;
+				const int y0 = ey0 + (phase_y + cell.y * phases_y) * tile_size;
+				const int x1 = std::min(x0 + tile_size, ex1);
+				const int y1 = std::min(y0 + tile_size, ey1);
+
+				//pixels touched by the patches of this tile, clipped to the image unless the border is clamped
+				const int ix0 = clamp ? x0 - patch_size_half : std::max(x0 - patch_size_half, 0);
+				const int ix1 = clamp ? x1 + patch_size_rest : std::min(x1 + patch_size_rest, width);
+				const int iy0 = clamp ? y0 - patch_size_half : std::max(y0 - patch_size_half, 0);
+				const int iy1 = clamp ? y1 + patch_size_rest : std::min(y1 + patch_size_rest, height);
+
+				//summed squared difference table with a leading zero row and column, 3 or 4 interleaved channels
+				const int istride = (ix1 - ix0 + 1) * channels;
+				std::vector<double>& integral = state.workers[worker].table;
+				nv_pool_assign(integral, size_t((iy1 - iy0 + 1) * istride), 0.0);
+
+				//accumulator of the tile and the pixels its weights are scattered to, one plane per sum
+				const int ax0		= x0 - reach_x;
+				const int ay0		= y0;
+				const int awidth	= x1 - x0 + 2 * reach_x;
+				const int aplane	= awidth * (y1 - y0 + reach_y);
+				std::vector<float>& accum = state.workers[worker].accum;
+				nv_pool_assign(accum, size_t(aplane) * 6, 0.0f);
+
+				//squared differences of a table row, and the exp arguments and weights of p and q along a
+				//tile row, one plane per channel each
+				const int span			= ix1 - ix0;
+				const int tile_width	= x1 - x0;
+				std::vector<float>& rows = state.workers[worker].rows;
+				nv_pool_resize(rows, size_t(span * channels + tile_width * 12));
+				float* squares		= &rows[0];
+				float* p_args		= &rows[span * channels];
+				float* p_weights	= p_args + tile_width * 3;
+				float* q_args		= p_weights + tile_width * 3;
+				float* q_weights	= q_args + tile_width * 3;
+
+				const bool tile_in_roi = x0 < roi.x + roi.width && x1 > roi.x && y0 < roi.y + roi.height && y1 > roi.y;
+
+				//noise levels of the roi cells the tile scatters to, a bit per level
+				unsigned levels = 1u << NLM_NOISE_FULL;
+				if(noise.active)
+				{
+					levels = 0;
+					const int lx0 = std::max(ax0, roi.x), lx1 = std::min(x1 + reach_x, roi.x + roi.width);
+					const int ly0 = std::max(ay0, roi.y), ly1 = std::min(y1 + reach_y, roi.y + roi.height);
+					for(int y = ly0; y < ly1; y = (y / NLM_NOISE_CELL + 1) * NLM_NOISE_CELL)
+					{
+						for(int x = lx0; x < lx1; x = (x / NLM_NOISE_CELL + 1) * NLM_NOISE_CELL)
+							levels |= 1u << noise.at(x, y).level;
+					}
+					levels &= ~(1u << NLM_NOISE_CLEAN);
+				}
+
+				for(size_t f = 0; f < frames.size() && levels; ++f)
+				{
+					const float* qplanes[3 + NLM_MAX_GUIDE_PLANES];
+					for(int c = 0; c < 3 + guides; ++c)
+						qplanes[c] = frames[f]->plane(c);
+
+					//other frames are searched from p only
+					const std::vector<nvDisplacement>& displacements = f == 0 ? pairs : all;
+					if(f > 0 && !tile_in_roi)
+						break;
+
+					for(size_t d = 0; d < displacements.size(); ++d)
+					{
+						const int dx		= displacements[d].dx;
+						const int dy		= displacements[d].dy;
+						const bool paired	= displacements[d].paired;
+						if(!paired && !tile_in_roi)
+							continue;
+
+						//search offset indices of p and, for pairs, of q
+						const int sx = (dx + seach_size_half) / settings->search_offset;
+						const int sy = (dy + seach_size_half) / settings->search_offset;
+						const int mx = (seach_size_half - dx) / settings->search_offset;
+						const int my = (seach_size_half - dy) / settings->search_offset;
+						if(noise.active)
+						{
+							bool used = false;
+							for(int level = 0; level < NLM_NOISE_CLEAN && !used; ++level)
+								used = (levels >> level & 1u) && noise.uses(level, sx, sy);
+							if(!used)
+								continue;
+						}
+
+						//integrate the squared difference between p and q = p + (dx,dy), like the integral engine
+						for(int y = iy0; y < iy1; ++y)
+						{
+							const int qy = y + dy;
+							std::fill(squares, squares + span * channels, 0.0f);
+
+							//the columns whose p and q are both in the image go through the vector kernel
+							int xa = std::max(std::max(ix0, 0), -dx);
+							int xb = std::min(std::min(ix1, width), width - dx);
+							if(y < 0 || y >= height || qy < 0 || qy >= height || xa > xb)
+								xa = xb = ix0;
+							if(xb > xa)
+							{
+								const int p = get_index(xa, y, stride);
+								const int q = get_index(xa + dx, qy, stride);
+								for(int dim = 0; dim < 3; ++dim)
+									kernels.squared_diff(planes[dim] + p, qplanes[dim] + q, 1.0f, squares + dim * span + xa - ix0, xb - xa);
+								for(int g = 0; g < guides; ++g)
+									kernels.squared_diff(guide_planes[g] + p, qplanes[3 + g] + q, guide_weights[g], squares + 3 * span + xa - ix0, xb - xa);
+							}
+
+							//clamped mode: the other columns compare the nearest pixels in the image, with the
+							//arithmetic of the kernel
+							if(clamp)
+							{
+								const int py_clamped = std::min(std::max(y, 0), height - 1);
+								const int qy_clamped = std::min(std::max(qy, 0), height - 1);
+								for(int x = ix0 == xa ? xb : ix0; x < ix1; x = x + 1 == xa ? xb : x + 1)
+								{
+									const int p = get_index(std::min(std::max(x, 0), width - 1), py_clamped, stride);
+									const int q = get_index(std::min(std::max(x + dx, 0), width - 1), qy_clamped, stride);
+									for(int dim = 0; dim < 3; ++dim)
+									{
+										const float diff = planes[dim][p] - qplanes[dim][q];
+										squares[dim * span + x - ix0] = diff * diff;
+									}
+									for(int g = 0; g < guides; ++g)
+									{
+										const float diff = guide_planes[g][p] - qplanes[3 + g][q];
+										squares[3 * span + x - ix0] += guide_weights[g] * (diff * diff);
+									}
+								}
+							}
+
+							//running sums along the row
+							const double* above	= &integral[(y - iy0) * istride];
+							double* row			= &integral[(y - iy0 + 1) * istride];
+							double row_sum[4]	= { 0.0, 0.0, 0.0, 0.0 };
+							for(int i = 0, idx = channels; i < span; ++i, idx += channels)
+							{
+								for(int c = 0; c < channels; ++c)
+								{
+									row_sum[c] += squares[c * span + i];
+									row[idx + c] = above[idx + c] + row_sum[c];
+								}
+							}
+						}
+
+						for(int y = y0; y < y1; ++y)
+						{
+							const int qy = y + dy;
+							if((qy >= height) || (qy < 0))
+								continue;
+
+							const bool p_row_in_roi = y >= roi.y && y < roi.y + roi.height;
+							const bool q_row_in_roi = paired && qy >= roi.y && qy < roi.y + roi.height;
+							if(!p_row_in_roi && !q_row_in_roi)
+								continue;
+
+							//pixels whose candidate is in the image, [pa,pb) of them have p and [qa,qb) have q in the roi
+							const int xs = std::max(x0, -dx);
+							const int xe = std::min(x1, width - dx);
+							int pa = xs, pb = xs, qa = xs, qb = xs;
+							if(p_row_in_roi)
+							{
+								pa = std::max(xs, roi.x);
+								pb = std::max(pa, std::min(xe, roi.x + roi.width));
+							}
+							if(q_row_in_roi)
+							{
+								qa = std::max(xs, roi.x - dx);
+								qb = std::max(qa, std::min(xe, roi.x + roi.width - dx));
+							}
+							const int ua = pa < pb ? (qa < qb ? std::min(pa, qa) : pa) : qa;
+							const int ub = pa < pb ? (qa < qb ? std::max(pb, qb) : pb) : qb;
+							if(ua >= ub)
+								continue;
+
+							const double* top		= &integral[((clamp ? y - patch_size_half : std::max(y - patch_size_half, 0)) - iy0) * istride];
+							const double* bottom	= &integral[((clamp ? y + patch_size_rest + 1 : std::min(y + patch_size_rest + 1, height)) - iy0) * istride];
+
+							//exp arguments of p and q, a positive one marks a weight that is not used. q shares the
+							//weight of p unless the cells bring filters of their own
+							for(int x = ua; x < ub; ++x)
+							{
+								const int i = x - x0;
+
+								//adaptive mode: the filters of the cells of p and q
+								bool p_used				= true;
+								bool q_used				= true;
+								double p_max_dist		= max_dist, q_max_dist = max_dist;
+								float p_scale			= scale, q_scale = scale;
+								if(noise.active)
+								{
+									p_used = x >= pa && x < pb;
+									q_used = x >= qa && x < qb;
+									if(p_used)
+									{
+										const nvNoiseCell& cell = noise.at(x, y);
+										p_used		= noise.uses(cell.level, sx, sy);
+										p_max_dist	= cell.max_dist;
+										p_scale		= float(-1.0 / cell.h2);
+									}
+									if(q_used)
+									{
+										const nvNoiseCell& cell = noise.at(x + dx, qy);
+										q_used		= noise.uses(cell.level, mx, my);
+										q_max_dist	= cell.max_dist;
+										q_scale		= float(-1.0 / cell.h2);
+									}
+								}
+
+								const int left	= ((clamp ? x - patch_size_half : std::max(x - patch_size_half, 0)) - ix0) * channels;
+								const int right	= ((clamp ? x + patch_size_rest + 1 : std::min(x + patch_size_rest + 1, width)) - ix0) * channels;
+
+								const double guide_dist = guides ? bottom[right + 3] - bottom[left + 3] - top[right + 3] + top[left + 3] : 0.0;
+
+								for(int dim = 0; dim < 3; ++dim)
+								{
+									double dist = bottom[right + dim] - bottom[left + dim] - top[right + dim] + top[left + dim];
+									if(guides)
+										dist += guide_dist;
+									//cancellation in the table can produce tiny negative distances
+									const float clamped = float(std::max(dist, 0.0));
+									p_args[dim * tile_width + i] = p_used && dist <= p_max_dist ? clamped * p_scale : 1.0f;
+									if(noise.active)
+										q_args[dim * tile_width + i] = q_used && dist <= q_max_dist ? clamped * q_scale : 1.0f;
+								}
+							}
+
+							//weights and weighted candidates of p and q, plain loops the compiler vectorizes
+							const float* q_arg_planes		= noise.active ? q_args : p_args;
+							const float* q_weight_planes	= noise.active ? q_weights : p_weights;
+							for(int dim = 0; dim < 3; ++dim)
+							{
+								const int u = dim * tile_width + ua - x0;
+								kernels.exp_negative(p_args + u, p_weights + u, ub - ua);
+								if(noise.active)
+									kernels.exp_negative(q_args + u, q_weights + u, ub - ua);
+
+								if(pb > pa)
+								{
+									const float* arg		= p_args + dim * tile_width + pa - x0;
+									const float* weight		= p_weights + dim * tile_width + pa - x0;
+									const float* candidate	= qplanes[dim] + get_index(pa + dx, qy, stride);
+									float* sum				= &accum[dim * aplane + (y - ay0) * awidth + pa - ax0];
+									float* norm				= &accum[(3 + dim) * aplane + (y - ay0) * awidth + pa - ax0];
+									for(int k = 0; k < pb - pa; ++k)
+									{
+										const float w = arg[k] > 0.0f ? 0.0f : weight[k];
+										norm[k]	+= w;
+										sum[k]	+= w * candidate[k];
+									}
+								}
+								if(qb > qa)
+								{
+									const float* arg		= q_arg_planes + dim * tile_width + qa - x0;
+									const float* weight		= q_weight_planes + dim * tile_width + qa - x0;
+									const float* candidate	= planes[dim] + get_index(qa, y, stride);
+									float* sum				= &accum[dim * aplane + (qy - ay0) * awidth + qa + dx - ax0];
+									float* norm				= &accum[(3 + dim) * aplane + (qy - ay0) * awidth + qa + dx - ax0];
+									for(int k = 0; k < qb - qa; ++k)
+									{
+										const float w = arg[k] > 0.0f ? 0.0f : weight[k];
+										norm[k]	+= w;
+										sum[k]	+= w * candidate[k];
+									}
+								}
+							}
+						}
+					}
+				}
+
+				//reduction into the frame accumulator, no other tile of this phase touches these pixels
+				const int rx0 = std::max(ax0, roi.x), rx1 = std::min(x1 + reach_x, roi.x + roi.width);
+				const int ry0 = std::max(ay0, roi.y), ry1 = std::min(y1 + reach_y, roi.y + roi.height);
+				for(int k = 0; k < 6; ++k)
+				{
+					for(int y = ry0; y < ry1; ++y)
+					{
+						const float* src	= &accum[k * aplane + (y - ay0) * awidth + rx0 - ax0];
+						float* dst			= &state.accum[k * roi_pixels + size_t(y - roi.y) * roi.width + rx0 - roi.x];
+						for(int i = 0; i < rx1 - rx0; ++i)
+							dst[i] += src[i];
+					}
+				}
+			});
+		}
+	}
+
+	for(int dim = 0; dim < 3; ++dim)
+	{
+		for(int y = 0; y < roi.height; ++y)
+		{
+			const float* sum	= &state.accum[dim * roi_pixels + size_t(y) * roi.width];
+			const float* norm	= &state.accum[(3 + dim) * roi_pixels + size_t(y) * roi.width];
+			for(int x = 0; x < roi.width; ++x)
+			{
+				//all candidates dropped by the fast weights, the pixel stays as it is
+				denoised_image.at(dim, x, y) = norm[x] > 0.0f ? sum[x] / norm[x] : planes[dim][get_index(roi.x + x, roi.y + y, stride)];
+			}
+		}
+	}
+}
@@ -0,0 +1,62 @@
+#include "nvframering.h"
+
+#include <atomic>
+#include <cstdlib>
+
+namespace
+{
+	//versions are unique across rings, so a device copy can tell rings apart as well
+	std::atomic<unsigned> g_next_version(1);
+}
+
+NAVIE_GLOBAL::nvFrameRing::nvFrameRing(int capacity)
+{
+	reset(capacity);
+}
+
+void NAVIE_GLOBAL::nvFrameRing::reset(int capacity)
+{
+	//keep the slot images, their memory is reused by the next frames
+	m_images.resize(capacity);
+	m_frames.assign(capacity, 0);
+	m_used.assign(capacity, false);
+	m_versions.assign(capacity, 0);
+}
+
+NAVIE_GLOBAL::nvImage& NAVIE_GLOBAL::nvFrameRing::insert(int frame)
+{
+	if(m_images.empty())
+		reset(1);
+
+	int target = slot(frame);
+	for(int i = 0; i < capacity() && target < 0; ++i)
+	{
+		if(!m_used[i])
+			target = i;
+	}
+
+	if(target < 0)
+	{
+		target = 0;
+		for(int i = 1; i < capacity(); ++i)
+		{
+			if(abs(m_frames[i] - frame) > abs(m_frames[target] - frame))
+				target = i;
+		}
+	}
+
+	m_frames[target]	= frame;
+	m_used[target]		= true;
+	m_versions[target]	= g_next_version++;
+	return m_images[target];
+}
+
+int NAVIE_GLOBAL::nvFrameRing::slot(int frame) const
+{
+	for(int i = 0; i < capacity(); ++i)
+	{
+		if(m_used[i] && m_frames[i] == frame)
+			return i;
+	}
+	return -1;
+}
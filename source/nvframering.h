@@ -0,0 +1,49 @@
+#ifndef NVFRAMERING_H_
+#define NVFRAMERING_H_
+
+#include "nvimage.h"
+
+#include <vector>
+
+namespace NAVIE_GLOBAL
+{
+	/****************************************************************************/
+	/* Ring buffer of noisy animation frames for the temporal filter			*/
+	/*																			*/
+	/* Holds the last capacity() frames by frame number. A new frame takes		*/
+	/* the slot of the frame farthest away from it, so the slot images (and		*/
+	/* their memory) are reused and every frame is converted only once.		*/
+	/*																			*/
+	/* Every insert gets a version number that is unique in the process.		*/
+	/* Device side copies of the ring compare it to skip frames they already	*/
+	/* hold.																	*/
+	/****************************************************************************/
+	class nvFrameRing
+	{
+	public:
+		explicit nvFrameRing(int capacity = 0);
+
+		/* Drops all frames and sets the number of slots */
+		void reset(int capacity);
+
+		/* Slot image for frame, to be filled by the caller. Replaces the frame farthest away */
+		/* from it if the ring is full, or the frame itself if it is already in the ring */
+		nvImage& insert(int frame);
+
+		/* Slot of frame, -1 if it is not in the ring */
+		int slot(int frame) const;
+		const nvImage* find(int frame) const { const int s = slot(frame); return s < 0 ? nullptr : &m_images[s]; }
+
+		int capacity() const					{ return int(m_images.size()); }
+		const nvImage& image(int slot) const	{ return m_images[slot]; }
+		unsigned version(int slot) const		{ return m_versions[slot]; }
+
+	private:
+		std::vector<nvImage>	m_images;
+		std::vector<int>		m_frames;	// frame number per slot
+		std::vector<bool>		m_used;
+		std::vector<unsigned>	m_versions;	// 0 = empty
+	};
+}
+
+#endif
@@ -0,0 +1,126 @@
+#include "nvimage.h"
+#include "nvpool.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <utility>
+
+NAVIE_GLOBAL::nvImage::nvImage()
+	: m_memory(nullptr), m_data(nullptr), m_capacity(0), m_width(0), m_height(0), m_channels(0), m_stride(0)
+{
+}
+
+NAVIE_GLOBAL::nvImage::nvImage(int width, int height, int channels)
+	: m_memory(nullptr), m_data(nullptr), m_capacity(0), m_width(0), m_height(0), m_channels(0), m_stride(0)
+{
+	resize(width, height, channels);
+}
+
+NAVIE_GLOBAL::nvImage::nvImage(const nvImage& other)
+	: m_memory(nullptr), m_data(nullptr), m_capacity(0), m_width(0), m_height(0), m_channels(0), m_stride(0)
+{
+	*this = other;
+}
+
+NAVIE_GLOBAL::nvImage::nvImage(nvImage&& other)
+	: m_memory(nullptr), m_data(nullptr), m_capacity(0), m_width(0), m_height(0), m_channels(0), m_stride(0)
+{
+	*this = std::move(other);
+}
+
+NAVIE_GLOBAL::nvImage::~nvImage()
+{
+	release();
+}
+
+NAVIE_GLOBAL::nvImage& NAVIE_GLOBAL::nvImage::operator=(const nvImage& other)
+{
+	if(this != &other && resize(other.m_width, other.m_height, other.m_channels) && m_data)
+		memcpy(m_data, other.m_data, sizeof(float) * size_t(m_stride) * m_height * m_channels);
+	return *this;
+}
+
+NAVIE_GLOBAL::nvImage& NAVIE_GLOBAL::nvImage::operator=(nvImage&& other)
+{
+	if(this != &other)
+	{
+		release();
+		std::swap(m_memory, other.m_memory);
+		std::swap(m_data, other.m_data);
+		std::swap(m_capacity, other.m_capacity);
+		std::swap(m_width, other.m_width);
+		std::swap(m_height, other.m_height);
+		std::swap(m_channels, other.m_channels);
+		std::swap(m_stride, other.m_stride);
+	}
+	return *this;
+}
+
+bool NAVIE_GLOBAL::nvImage::resize(int width, int height, int channels)
+{
+	const int floats_per_line = ALIGNMENT / sizeof(float);
+	const int stride = ((width + floats_per_line - 1) / floats_per_line) * floats_per_line;
+	const size_t required = size_t(stride) * height * channels;
+
+	if(required > m_capacity)
+	{
+		release();
+
+		m_memory = static_cast<float*>(malloc(required * sizeof(float) + ALIGNMENT));
+		nv_pool_count(required * sizeof(float) + ALIGNMENT);
+		if(!m_memory)
+		{
+			m_width = m_height = m_channels = m_stride = 0;
+			return false;
+		}
+
+		//planes and rows are multiples of ALIGNMENT bytes, so aligning the start aligns every row
+		const uintptr_t address = reinterpret_cast<uintptr_t>(m_memory);
+		m_data		= reinterpret_cast<float*>((address + ALIGNMENT - 1) & ~uintptr_t(ALIGNMENT - 1));
+		m_capacity	= required;
+	}
+
+	m_width		= width;
+	m_height	= height;
+	m_channels	= channels;
+	m_stride	= stride;
+	return true;
+}
+
+void NAVIE_GLOBAL::nvImage::clear()
+{
+	if(m_data)
+		memset(m_data, 0, sizeof(float) * size_t(m_stride) * m_height * m_channels);
+}
+
+void NAVIE_GLOBAL::nvImage::set_row_interleaved(int y, int x, int count, const float* src, int pixel_stride, int first_channel, int channels)
+{
+	const int end = channels < 0 ? m_channels : first_channel + channels;
+	for(int c = first_channel; c < end; ++c)
+	{
+		float* dst = row(c, y) + x;
+		const float* s = src + c - first_channel;
+		for(int i = 0; i < count; ++i, s += pixel_stride)
+			dst[i] = *s;
+	}
+}
+
+void NAVIE_GLOBAL::nvImage::get_row_interleaved(int y, int x, int count, float* dst, int pixel_stride) const
+{
+	for(int c = 0; c < m_channels; ++c)
+	{
+		const float* src = row(c, y) + x;
+		float* d = dst + c;
+		for(int i = 0; i < count; ++i, d += pixel_stride)
+			*d = src[i];
+	}
+}
+
+void NAVIE_GLOBAL::nvImage::release()
+{
+	free(m_memory);
+	m_memory	= nullptr;
+	m_data		= nullptr;
+	m_capacity	= 0;
+}
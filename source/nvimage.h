@@ -0,0 +1,79 @@
+#ifndef NVIMAGE_H_
+#define NVIMAGE_H_
+
+#include <cstddef>
+
+namespace NAVIE_GLOBAL
+{
+	/* Pixel rectangle, x/y is the top left corner */
+	struct nvRect
+	{
+		int x;
+		int y;
+		int width;
+		int height;
+	};
+
+	/****************************************************************************/
+	/* Planar float image (structure of arrays)									*/
+	/*																			*/
+	/* Every channel is stored as its own plane. Rows are padded to a multiple	*/
+	/* of ALIGNMENT bytes and every row starts aligned, so the filters can		*/
+	/* walk the image with plain strided float loads instead of per pixel		*/
+	/* accessor calls. The class has no dependency on the Cinema 4D SDK.		*/
+	/****************************************************************************/
+	class nvImage
+	{
+	public:
+		static const int ALIGNMENT = 64;
+
+		nvImage();
+		nvImage(int width, int height, int channels = 3);
+		nvImage(const nvImage& other);
+		nvImage(nvImage&& other);
+		~nvImage();
+
+		nvImage& operator=(const nvImage& other);
+		nvImage& operator=(nvImage&& other);
+
+		/* Changes the dimensions. Memory is only reallocated if the new size does not fit, */
+		/* the content is undefined afterwards */
+		bool resize(int width, int height, int channels = 3);
+
+		/* Sets all pixels (including the row padding) to zero */
+		void clear();
+
+		int width() const		{ return m_width; }
+		int height() const		{ return m_height; }
+		int channels() const	{ return m_channels; }
+		/* Row pitch in floats */
+		int stride() const		{ return m_stride; }
+		bool empty() const		{ return m_width == 0 || m_height == 0; }
+
+		float* plane(int channel)							{ return m_data + size_t(channel) * m_stride * m_height; }
+		const float* plane(int channel) const				{ return m_data + size_t(channel) * m_stride * m_height; }
+		float* row(int channel, int y)						{ return plane(channel) + size_t(y) * m_stride; }
+		const float* row(int channel, int y) const			{ return plane(channel) + size_t(y) * m_stride; }
+		float& at(int channel, int x, int y)				{ return row(channel, y)[x]; }
+		const float& at(int channel, int x, int y) const	{ return row(channel, y)[x]; }
+
+		/* Copies count interleaved pixels (pixel_stride floats apart) into row y, starting at column x. */
+		/* Fills the planes from first_channel on, channels of them or all remaining ones (-1) */
+		void set_row_interleaved(int y, int x, int count, const float* src, int pixel_stride, int first_channel = 0, int channels = -1);
+		/* Copies count pixels of row y, starting at column x, into an interleaved buffer */
+		void get_row_interleaved(int y, int x, int count, float* dst, int pixel_stride) const;
+
+	private:
+		void release();
+
+		float*	m_memory;	// allocation as returned by malloc
+		float*	m_data;		// aligned start of the first plane
+		size_t	m_capacity;	// floats available from m_data on
+		int		m_width;
+		int		m_height;
+		int		m_channels;
+		int		m_stride;
+	};
+}
+
+#endif
@@ -0,0 +1,119 @@
+#include "nvkernels.h"
+#include <cstddef>
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#define NV_X86_CPUID 1
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#include <cpuid.h>
+#define NV_X86_CPUID 2
+#endif
+
+namespace
+{
+#if defined(NV_X86_CPUID)
+	/* Feature flags of the running CPU, only set if the OS also saves the register state */
+	struct CpuFeatures
+	{
+		bool sse42;
+		bool avx2;
+		bool avx512f;
+	};
+
+	void cpuid(int leaf, int subleaf, unsigned int regs[4])
+	{
+#if NV_X86_CPUID == 1
+		int r[4];
+		__cpuidex(r, leaf, subleaf);
+		for(int i = 0; i < 4; ++i)
+			regs[i] = (unsigned int)r[i];
+#else
+		__cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+	}
+
+	unsigned long long xgetbv0()
+	{
+#if NV_X86_CPUID == 1
+		return _xgetbv(0);
+#else
+		unsigned int lo, hi;
+		__asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+		return ((unsigned long long)hi << 32) | lo;
+#endif
+	}
+
+	CpuFeatures detect()
+	{
+		CpuFeatures features = { false, false, false };
+
+		unsigned int regs[4];
+		cpuid(0, 0, regs);
+		const unsigned int max_leaf = regs[0];
+		if(max_leaf < 1)
+			return features;
+
+		cpuid(1, 0, regs);
+		features.sse42 = (regs[2] & (1u << 20)) != 0;
+		const bool f16c = (regs[2] & (1u << 29)) != 0;
+
+		const bool osxsave	= (regs[2] & (1u << 27)) != 0;
+		const bool avx		= (regs[2] & (1u << 28)) != 0;
+		if(!osxsave || !avx || max_leaf < 7)
+			return features;
+
+		//XMM/YMM state (bits 1,2) and opmask/ZMM state (bits 5,6,7) enabled by the OS
+		const unsigned long long xcr0 = xgetbv0();
+		const bool ymm_state = (xcr0 & 0x06) == 0x06;
+		const bool zmm_state = (xcr0 & 0xe6) == 0xe6;
+
+		cpuid(7, 0, regs);
+		//the AVX2 kernels convert to fp16 with F16C, every AVX2 CPU has it
+		features.avx2		= ymm_state && f16c && (regs[1] & (1u << 5)) != 0;
+		features.avx512f	= zmm_state && (regs[1] & (1u << 16)) != 0;
+		return features;
+	}
+#endif
+
+	std::vector<const NAVIE_GLOBAL::nvNLMKernels*> collect()
+	{
+		std::vector<const NAVIE_GLOBAL::nvNLMKernels*> available;
+		const NAVIE_GLOBAL::nvNLMKernels* kernels;
+
+#if defined(NV_X86_CPUID)
+		const CpuFeatures cpu = detect();
+		if(cpu.avx512f && (kernels = NAVIE_GLOBAL::nv_nlm_kernels_avx512()))
+			available.push_back(kernels);
+		if(cpu.avx2 && (kernels = NAVIE_GLOBAL::nv_nlm_kernels_avx2()))
+			available.push_back(kernels);
+		if(cpu.sse42 && (kernels = NAVIE_GLOBAL::nv_nlm_kernels_sse42()))
+			available.push_back(kernels);
+#else
+		//compiled in means supported on ARM
+		if((kernels = NAVIE_GLOBAL::nv_nlm_kernels_neon()))
+			available.push_back(kernels);
+#endif
+		available.push_back(NAVIE_GLOBAL::nv_nlm_kernels_scalar());
+		return available;
+	}
+}
+
+const std::vector<const NAVIE_GLOBAL::nvNLMKernels*>& NAVIE_GLOBAL::nv_nlm_kernels_available()
+{
+	static const std::vector<const nvNLMKernels*> available = collect();
+	return available;
+}
+
+const NAVIE_GLOBAL::nvNLMKernels* NAVIE_GLOBAL::nv_nlm_kernels(int isa)
+{
+	const std::vector<const nvNLMKernels*>& available = nv_nlm_kernels_available();
+	if(isa != NLM_ISA_AUTO)
+	{
+		for(std::size_t i = 0; i < available.size(); ++i)
+		{
+			if(available[i]->isa == isa)
+				return available[i];
+		}
+	}
+	return available.front();
+}
@@ -0,0 +1,204 @@
+#ifndef NVKERNELS_H_
+#define NVKERNELS_H_
+
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+#include <vector>
+
+/* Instruction sets of the CPU block kernels, see nvDenoiseSettings::isa */
+enum nvNLMIsa
+{
+	NLM_ISA_AUTO	= 0,	// best one the CPU supports
+	NLM_ISA_SCALAR	= 1,	// plain C++, bit identical to the per pixel reference loop
+	NLM_ISA_SSE42	= 2,
+	NLM_ISA_AVX2	= 3,
+	NLM_ISA_AVX512	= 4,
+	NLM_ISA_NEON	= 5
+};
+
+namespace NAVIE_GLOBAL
+{
+	/****************************************************************************/
+	/* Block kernels of the brute force non-local mean filter					*/
+	/*																			*/
+	/* A block is a run of consecutive output pixels of one row that are far	*/
+	/* enough from the image border that every patch sample of every search		*/
+	/* candidate is inside the image. For one search displacement the kernel	*/
+	/* computes the patch distance of all pixels of the run, turns them into	*/
+	/* weights and accumulates weights and weighted candidate colors. The		*/
+	/* vector versions process 4 (SSE4.2, NEON), 8 (AVX2) or 16 (AVX-512)		*/
+	/* pixels per step and use a polynomial exp (relative error < 2e-7).		*/
+	/*																			*/
+	/* Guide planes (albedo, normal, depth) add their weighted squared patch	*/
+	/* difference to the distance of every color channel.						*/
+	/*																			*/
+	/* With a finite max_dist (fast weights, see nvDenoiseSettings::			*/
+	/* weight_cutoff) candidates further away get weight 0. The patch			*/
+	/* distance only grows while it is summed up, so the kernels stop			*/
+	/* comparing a patch as soon as all of its channels are past max_dist.		*/
+	/* The scalar kernel then also uses the polynomial exp.						*/
+	/*																			*/
+	/* to_half converts the input of the OpenCL engine to fp16 (see			*/
+	/* nvDenoiseSettings::half_input), with F16C on AVX2/AVX-512.				*/
+	/* squared_diff and exp_negative are the row passes of the integral		*/
+	/* engine.																	*/
+	/****************************************************************************/
+
+	/* Guide planes a block can carry, albedo (3) + normal (3) + depth (1) */
+	const int NLM_MAX_GUIDE_PLANES = 7;
+
+	/* exp(x) for x <= 0 with the polynomial of the vector kernels (relative error < 2e-7). Results */
+	/* below 2^-126 are flushed to 0 */
+	inline float nv_exp_negative(float x)
+	{
+		if(x < -87.0f)
+			return 0.0f;
+
+		//x = n * ln2 + r, |r| <= ln2/2
+		const float n = std::floor(x * 1.44269504088896341f + 0.5f);
+		float r = x - n * 0.693359375f;
+		r = r - n * -2.12194440e-4f;
+
+		float p = 1.9875691500e-4f;
+		p = p * r + 1.3981999507e-3f;
+		p = p * r + 8.3334519073e-3f;
+		p = p * r + 4.1665795894e-2f;
+		p = p * r + 1.6666665459e-1f;
+		p = p * r + 5.0000001201e-1f;
+		p = p * r * r + r + 1.0f;
+
+		//2^n from the exponent bits
+		const unsigned int bits = (unsigned int)(int(n) + 127) << 23;
+		float scale;
+		std::memcpy(&scale, &bits, sizeof(scale));
+		return p * scale;
+	}
+
+	/* Float to fp16 bits, rounded to nearest even like F16C. Values past the fp16 range become infinity, */
+	/* NaNs a quiet NaN */
+	inline unsigned short nv_float_to_half(float f)
+	{
+		unsigned int bits;
+		std::memcpy(&bits, &f, sizeof(bits));
+		const unsigned int sign = (bits >> 16) & 0x8000u;
+		bits &= 0x7fffffffu;
+
+		//2^16 and more, infinity and NaN
+		if(bits >= 0x47800000u)
+			return (unsigned short)(sign | (bits > 0x7f800000u ? 0x7e00u : 0x7c00u));
+
+		//below 2^-14 the result is subnormal, the float addition does the rounding
+		if(bits < 0x38800000u)
+		{
+			const unsigned int magic_bits = 0x3f000000u;	// 0.5, its last mantissa bit is worth 2^-24
+			float magic, value;
+			std::memcpy(&magic, &magic_bits, sizeof(magic));
+			std::memcpy(&value, &bits, sizeof(value));
+			value += magic;
+			std::memcpy(&bits, &value, sizeof(bits));
+			return (unsigned short)(sign | (bits - magic_bits));
+		}
+
+		//rebias the exponent, round the 13 dropped mantissa bits to nearest even
+		bits += 0xc8000fffu + ((bits >> 13) & 1u);
+		return (unsigned short)(sign | (bits >> 13));
+	}
+
+	/* fp16 bits to float, exact */
+	inline float nv_half_to_float(unsigned short half)
+	{
+		const unsigned int sign		= (unsigned int)(half & 0x8000u) << 16;
+		const unsigned int exponent	= (half >> 10) & 0x1fu;
+		const unsigned int mantissa	= half & 0x3ffu;
+
+		unsigned int bits;
+		if(exponent == 0x1fu)
+			bits = sign | 0x7f800000u | (mantissa << 13);
+		else if(exponent)
+			bits = sign | ((exponent + 112u) << 23) | (mantissa << 13);
+		else
+		{
+			const float value = float(mantissa) * 5.9604644775390625e-8f;	// 2^-24
+			std::memcpy(&bits, &value, sizeof(bits));
+			bits |= sign;
+		}
+
+		float f;
+		std::memcpy(&f, &bits, sizeof(f));
+		return f;
+	}
+
+	struct nvNLMBlock
+	{
+		const float*	p[3];		// top left patch sample of the first pixel of the run, per channel
+		const float*	q[3];		// top left patch sample of its search candidate
+		const float*	c[3];		// search candidate (patch center) of the first pixel
+		const float*	gp[NLM_MAX_GUIDE_PLANES];	// top left patch sample of the first pixel, per guide plane
+		const float*	gq[NLM_MAX_GUIDE_PLANES];	// top left patch sample of its search candidate
+		float			gweight[NLM_MAX_GUIDE_PLANES];
+		int				guides;		// guide planes in use
+		int				stride;		// row pitch in floats
+		int				patch_size;
+		double			h2;			// weights are exp(-d / h2)
+		float			max_dist;	// candidates with a larger distance get weight 0, infinity computes every weight
+		int				count;		// pixels in the run
+
+		float*			out[3];		// weighted candidate colors of the run, accumulated
+		float*			norm[3];	// normalizing factors of the run, accumulated
+	};
+
+	typedef void (*nvNLMBlockKernel)(const nvNLMBlock& block);
+
+	/* Converts count floats to fp16 bits, the same result as nv_float_to_half */
+	typedef void (*nvHalfConverter)(const float* src, unsigned short* dst, size_t count);
+
+	/* acc[i] += weight * (p[i] - q[i])^2 for count values */
+	typedef void (*nvSquaredDiffKernel)(const float* p, const float* q, float weight, float* acc, int count);
+
+	/* y[i] = exp(x[i]) for x[i] <= 0 with the polynomial of the vector kernels, count values. A value */
+	/* gets the same result wherever it is in the array */
+	typedef void (*nvExpKernel)(const float* x, float* y, int count);
+
+	/* Patch sizes with kernels specialized at compile time, the patch loops of those are fully unrolled */
+	const int NLM_FIXED_PATCH_SIZES[3] = { 3, 5, 7 };
+
+	struct nvNLMKernels
+	{
+		int					isa;		// nvNLMIsa
+		const char*			name;
+		int					width;		// pixels per vector step
+		nvNLMBlockKernel	accumulate;	// any patch size
+		nvNLMBlockKernel	accumulate_fixed[3];	// patch sizes of NLM_FIXED_PATCH_SIZES
+		nvHalfConverter		to_half;
+		nvSquaredDiffKernel	squared_diff;
+		nvExpKernel			exp_negative;
+
+		/* The specialized kernel for patch_size if there is one, the generic one otherwise */
+		nvNLMBlockKernel block_kernel(int patch_size) const
+		{
+			for(int i = 0; i < 3; ++i)
+			{
+				if(NLM_FIXED_PATCH_SIZES[i] == patch_size)
+					return accumulate_fixed[i];
+			}
+			return accumulate;
+		}
+	};
+
+	/* Kernel tables of the individual instruction sets. nullptr if not compiled into this build */
+	const nvNLMKernels* nv_nlm_kernels_scalar();
+	const nvNLMKernels* nv_nlm_kernels_sse42();
+	const nvNLMKernels* nv_nlm_kernels_avx2();
+	const nvNLMKernels* nv_nlm_kernels_avx512();
+	const nvNLMKernels* nv_nlm_kernels_neon();
+
+	/* Kernels that are compiled in and supported by this CPU (CPUID), best first */
+	const std::vector<const nvNLMKernels*>& nv_nlm_kernels_available();
+
+	/* Kernels for the requested nvNLMIsa. Falls back to the best available one if isa is NLM_ISA_AUTO */
+	/* or not supported */
+	const nvNLMKernels* nv_nlm_kernels(int isa);
+}
+
+#endif
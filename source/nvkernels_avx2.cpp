@@ -0,0 +1,46 @@
+#include "nvkernels.h"
+
+/* Needs -mavx2 -mf16c (gcc/clang) or /arch:AVX2 (msvc) for this file */
+#if defined(__AVX2__)
+
+#include <immintrin.h>
+#include "nvkernels_impl.h"
+
+namespace
+{
+	struct AVX2
+	{
+		typedef __m256 type;
+		static const int width = 8;
+
+		static inline type zero()							{ return _mm256_setzero_ps(); }
+		static inline type set1(float f)					{ return _mm256_set1_ps(f); }
+		static inline type load(const float* p)				{ return _mm256_loadu_ps(p); }
+		static inline void store(float* p, type v)			{ _mm256_storeu_ps(p, v); }
+		static inline type add(type a, type b)				{ return _mm256_add_ps(a, b); }
+		static inline type sub(type a, type b)				{ return _mm256_sub_ps(a, b); }
+		static inline type mul(type a, type b)				{ return _mm256_mul_ps(a, b); }
+		static inline type max(type a, type b)				{ return _mm256_max_ps(a, b); }
+		static inline type round(type v)					{ return _mm256_round_ps(v, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC); }
+		static inline type pow2(type n)						{ return _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127)), 23)); }
+		static inline type within(type v, type limit, type x)	{ return _mm256_and_ps(_mm256_cmp_ps(v, limit, _CMP_LE_OQ), x); }
+		static inline bool all_greater(type v, type limit)	{ return _mm256_movemask_ps(_mm256_cmp_ps(v, limit, _CMP_GT_OQ)) == 0xff; }
+		static inline void store_half(unsigned short* p, type v)	{ _mm_storeu_si128((__m128i*)p, _mm256_cvtps_ph(v, _MM_FROUND_TO_NEAREST_INT)); }
+	};
+
+	const NAVIE_GLOBAL::nvNLMKernels g_avx2 = NV_NLM_KERNELS(NLM_ISA_AVX2, "avx2", AVX2);
+}
+
+const NAVIE_GLOBAL::nvNLMKernels* NAVIE_GLOBAL::nv_nlm_kernels_avx2()
+{
+	return &g_avx2;
+}
+
+#else
+
+const NAVIE_GLOBAL::nvNLMKernels* NAVIE_GLOBAL::nv_nlm_kernels_avx2()
+{
+	return nullptr;
+}
+
+#endif
@@ -0,0 +1,46 @@
+#include "nvkernels.h"
+
+/* Needs -mavx512f (gcc/clang) or /arch:AVX512 (msvc) for this file */
+#if defined(__AVX512F__)
+
+#include <immintrin.h>
+#include "nvkernels_impl.h"
+
+namespace
+{
+	struct AVX512
+	{
+		typedef __m512 type;
+		static const int width = 16;
+
+		static inline type zero()							{ return _mm512_setzero_ps(); }
+		static inline type set1(float f)					{ return _mm512_set1_ps(f); }
+		static inline type load(const float* p)				{ return _mm512_loadu_ps(p); }
+		static inline void store(float* p, type v)			{ _mm512_storeu_ps(p, v); }
+		static inline type add(type a, type b)				{ return _mm512_add_ps(a, b); }
+		static inline type sub(type a, type b)				{ return _mm512_sub_ps(a, b); }
+		static inline type mul(type a, type b)				{ return _mm512_mul_ps(a, b); }
+		static inline type max(type a, type b)				{ return _mm512_max_ps(a, b); }
+		static inline type round(type v)					{ return _mm512_roundscale_ps(v, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC); }
+		static inline type pow2(type n)						{ return _mm512_castsi512_ps(_mm512_slli_epi32(_mm512_add_epi32(_mm512_cvtps_epi32(n), _mm512_set1_epi32(127)), 23)); }
+		static inline type within(type v, type limit, type x)	{ return _mm512_maskz_mov_ps(_mm512_cmp_ps_mask(v, limit, _CMP_LE_OQ), x); }
+		static inline bool all_greater(type v, type limit)	{ return _mm512_cmp_ps_mask(v, limit, _CMP_GT_OQ) == 0xffff; }
+		static inline void store_half(unsigned short* p, type v)	{ _mm256_storeu_si256((__m256i*)p, _mm512_cvtps_ph(v, _MM_FROUND_TO_NEAREST_INT)); }
+	};
+
+	const NAVIE_GLOBAL::nvNLMKernels g_avx512 = NV_NLM_KERNELS(NLM_ISA_AVX512, "avx512", AVX512);
+}
+
+const NAVIE_GLOBAL::nvNLMKernels* NAVIE_GLOBAL::nv_nlm_kernels_avx512()
+{
+	return &g_avx512;
+}
+
+#else
+
+const NAVIE_GLOBAL::nvNLMKernels* NAVIE_GLOBAL::nv_nlm_kernels_avx512()
+{
+	return nullptr;
+}
+
+#endif
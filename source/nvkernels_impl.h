@@ -0,0 +1,224 @@
+#ifndef NVKERNELS_IMPL_H_
+#define NVKERNELS_IMPL_H_
+
+#include "nvkernels.h"
+
+#include <limits>
+
+/****************************************************************************/
+/* Vector block kernel, shared by all instruction sets						*/
+/*																			*/
+/* Only included by the per instruction set translation units, which are	*/
+/* compiled with the matching compiler flags. V is a traits class wrapping	*/
+/* the intrinsics:															*/
+/*																			*/
+/*	type, width, zero(), set1(f), load(p), store(p,v), add, sub, mul, max,	*/
+/*	round(v) to nearest, pow2(v) = 2^v for integral v in [-126,127],		*/
+/*	within(v, limit, x) = x where v <= limit and 0 elsewhere,				*/
+/*	all_greater(v, limit) = true if every lane of v is > limit,				*/
+/*	store_half(p, v) stores v as fp16 bits like nv_float_to_half			*/
+/****************************************************************************/
+
+/* Kernel table entry of one instruction set with the generic and the specialized kernels */
+#define NV_NLM_KERNELS(isa, name, V) \
+	{ isa, name, V::width, NAVIE_GLOBAL::kernels::accumulate<V, 0>, \
+	  { NAVIE_GLOBAL::kernels::accumulate<V, 3>, NAVIE_GLOBAL::kernels::accumulate<V, 5>, NAVIE_GLOBAL::kernels::accumulate<V, 7> }, \
+	  NAVIE_GLOBAL::kernels::to_half<V>, NAVIE_GLOBAL::kernels::squared_diff<V>, NAVIE_GLOBAL::kernels::exp_array<V> }
+
+namespace NAVIE_GLOBAL
+{
+	namespace kernels
+	{
+		/* exp(x) for x <= 0, Cephes expf polynomial */
+		template<class V>
+		inline typename V::type exp_negative(typename V::type x)
+		{
+			typedef typename V::type T;
+
+			//below this the result is denormal, weights that small do not matter
+			x = V::max(x, V::set1(-87.0f));
+
+			//x = n * ln2 + r, |r| <= ln2/2
+			const T n = V::round(V::mul(x, V::set1(1.44269504088896341f)));
+			T r = V::sub(x, V::mul(n, V::set1(0.693359375f)));
+			r = V::sub(r, V::mul(n, V::set1(-2.12194440e-4f)));
+
+			T p = V::set1(1.9875691500e-4f);
+			p = V::add(V::mul(p, r), V::set1(1.3981999507e-3f));
+			p = V::add(V::mul(p, r), V::set1(8.3334519073e-3f));
+			p = V::add(V::mul(p, r), V::set1(4.1665795894e-2f));
+			p = V::add(V::mul(p, r), V::set1(1.6666665459e-1f));
+			p = V::add(V::mul(p, r), V::set1(5.0000001201e-1f));
+			p = V::add(V::add(V::mul(V::mul(p, r), r), r), V::set1(1.0f));
+
+			return V::mul(p, V::pow2(n));
+		}
+
+		/* PATCH is the patch size, 0 reads it from the block */
+		template<class V, int PATCH>
+		void accumulate(const nvNLMBlock& block)
+		{
+			typedef typename V::type T;
+			const int width			= V::width;
+			const int patch_size	= PATCH ? PATCH : block.patch_size;
+
+			const T scale = V::set1(float(-1.0 / block.h2));
+
+			//fast weights, candidates past max_dist get no weight
+			const bool reject	= block.max_dist < std::numeric_limits<float>::infinity();
+			const T max_dist	= V::set1(block.max_dist);
+
+			int k = 0;
+			for(; k + width <= block.count; k += width)
+			{
+				T dist[3] = { V::zero(), V::zero(), V::zero() };
+				T guide_dist = V::zero();
+				bool rejected = false;
+
+				//squared differences of the patches of width pixels at once
+				for(int b = 0; b < patch_size && !rejected; ++b)
+				{
+					const int row = b * block.stride + k;
+					for(int a = 0; a < patch_size; ++a)
+					{
+						for(int dim = 0; dim < 3; ++dim)
+						{
+							const T diff = V::sub(V::load(block.p[dim] + row + a), V::load(block.q[dim] + row + a));
+							dist[dim] = V::add(dist[dim], V::mul(diff, diff));
+						}
+						for(int g = 0; g < block.guides; ++g)
+						{
+							const T diff = V::sub(V::load(block.gp[g] + row + a), V::load(block.gq[g] + row + a));
+							guide_dist = V::add(guide_dist, V::mul(V::set1(block.gweight[g]), V::mul(diff, diff)));
+						}
+					}
+
+					//the rest of the patch can only add to the distances
+					if(reject)
+						rejected = V::all_greater(V::add(dist[0], guide_dist), max_dist) && V::all_greater(V::add(dist[1], guide_dist), max_dist) &&
+								   V::all_greater(V::add(dist[2], guide_dist), max_dist);
+				}
+				if(rejected)
+					continue;
+
+				for(int dim = 0; dim < 3; ++dim)
+				{
+					if(block.guides)
+						dist[dim] = V::add(dist[dim], guide_dist);
+					T weight = exp_negative<V>(V::mul(dist[dim], scale));
+					if(reject)
+						weight = V::within(dist[dim], max_dist, weight);
+					V::store(block.norm[dim] + k, V::add(V::load(block.norm[dim] + k), weight));
+					V::store(block.out[dim] + k, V::add(V::load(block.out[dim] + k), V::mul(weight, V::load(block.c[dim] + k))));
+				}
+			}
+
+			if(k == block.count)
+				return;
+
+			//the rest of the run goes through lane buffers, so it gets exactly the same arithmetic
+			const int rest = block.count - k;
+			float guide_lanes[64];
+			for(int l = 0; l < rest; ++l)
+			{
+				float guide_dist = 0.0f;
+				for(int b = 0; b < patch_size; ++b)
+				{
+					const int row = b * block.stride + k + l;
+					for(int a = 0; a < patch_size; ++a)
+					{
+						for(int g = 0; g < block.guides; ++g)
+						{
+							const float diff = block.gp[g][row + a] - block.gq[g][row + a];
+							guide_dist = guide_dist + block.gweight[g] * (diff * diff);
+						}
+					}
+				}
+				guide_lanes[l] = guide_dist;
+			}
+
+			float lanes[3][64];
+			for(int dim = 0; dim < 3; ++dim)
+			{
+				for(int l = 0; l < width; ++l)
+					lanes[dim][l] = 0.0f;
+
+				for(int l = 0; l < rest; ++l)
+				{
+					float dist = 0.0f;
+					for(int b = 0; b < patch_size; ++b)
+					{
+						const int row = b * block.stride + k + l;
+						for(int a = 0; a < patch_size; ++a)
+						{
+							const float diff = block.p[dim][row + a] - block.q[dim][row + a];
+							dist = dist + diff * diff;
+						}
+					}
+					lanes[dim][l] = block.guides ? dist + guide_lanes[l] : dist;
+				}
+
+				const T dist = V::load(lanes[dim]);
+				T weight = exp_negative<V>(V::mul(dist, scale));
+				if(reject)
+					weight = V::within(dist, max_dist, weight);
+				V::store(lanes[dim], weight);
+
+				for(int l = 0; l < rest; ++l)
+				{
+					block.norm[dim][k + l]	+= lanes[dim][l];
+					block.out[dim][k + l]	+= lanes[dim][l] * block.c[dim][k + l];
+				}
+			}
+		}
+
+		template<class V>
+		void to_half(const float* src, unsigned short* dst, size_t count)
+		{
+			size_t i = 0;
+			for(; i + V::width <= count; i += V::width)
+				V::store_half(dst + i, V::load(src + i));
+			for(; i < count; ++i)
+				dst[i] = nv_float_to_half(src[i]);
+		}
+
+		/* The rest of the row with the same scalar arithmetic, the results do not depend on the width */
+		template<class V>
+		void squared_diff(const float* p, const float* q, float weight, float* acc, int count)
+		{
+			typedef typename V::type T;
+			const T w = V::set1(weight);
+			int i = 0;
+			for(; i + V::width <= count; i += V::width)
+			{
+				const T diff = V::sub(V::load(p + i), V::load(q + i));
+				V::store(acc + i, V::add(V::load(acc + i), V::mul(w, V::mul(diff, diff))));
+			}
+			for(; i < count; ++i)
+			{
+				const float diff = p[i] - q[i];
+				acc[i] = acc[i] + weight * (diff * diff);
+			}
+		}
+
+		/* The rest of the array goes through a lane buffer, so every value gets the vector polynomial */
+		template<class V>
+		void exp_array(const float* x, float* y, int count)
+		{
+			int i = 0;
+			for(; i + V::width <= count; i += V::width)
+				V::store(y + i, exp_negative<V>(V::load(x + i)));
+			if(i == count)
+				return;
+
+			float lanes[64];
+			for(int l = 0; l < V::width; ++l)
+				lanes[l] = i + l < count ? x[i + l] : 0.0f;
+			V::store(lanes, exp_negative<V>(V::load(lanes)));
+			for(int l = 0; i + l < count; ++l)
+				y[i + l] = lanes[l];
+		}
+	}
+}
+
+#endif
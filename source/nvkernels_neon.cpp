@@ -0,0 +1,46 @@
+#include "nvkernels.h"
+
+/* NEON is part of every ARMv8 (aarch64) target, vrndnq_f32 needs ARMv8 */
+#if defined(__aarch64__) || defined(_M_ARM64)
+
+#include <arm_neon.h>
+#include "nvkernels_impl.h"
+
+namespace
+{
+	struct NEON
+	{
+		typedef float32x4_t type;
+		static const int width = 4;
+
+		static inline type zero()							{ return vdupq_n_f32(0.0f); }
+		static inline type set1(float f)					{ return vdupq_n_f32(f); }
+		static inline type load(const float* p)				{ return vld1q_f32(p); }
+		static inline void store(float* p, type v)			{ vst1q_f32(p, v); }
+		static inline type add(type a, type b)				{ return vaddq_f32(a, b); }
+		static inline type sub(type a, type b)				{ return vsubq_f32(a, b); }
+		static inline type mul(type a, type b)				{ return vmulq_f32(a, b); }
+		static inline type max(type a, type b)				{ return vmaxq_f32(a, b); }
+		static inline type round(type v)					{ return vrndnq_f32(v); }
+		static inline type pow2(type n)						{ return vreinterpretq_f32_s32(vshlq_n_s32(vaddq_s32(vcvtq_s32_f32(n), vdupq_n_s32(127)), 23)); }
+		static inline type within(type v, type limit, type x)	{ return vreinterpretq_f32_u32(vandq_u32(vcleq_f32(v, limit), vreinterpretq_u32_f32(x))); }
+		static inline bool all_greater(type v, type limit)	{ return vminvq_u32(vcgtq_f32(v, limit)) != 0; }
+		static inline void store_half(unsigned short* p, type v)	{ vst1_u16(p, vreinterpret_u16_f16(vcvt_f16_f32(v))); }
+	};
+
+	const NAVIE_GLOBAL::nvNLMKernels g_neon = NV_NLM_KERNELS(NLM_ISA_NEON, "neon", NEON);
+}
+
+const NAVIE_GLOBAL::nvNLMKernels* NAVIE_GLOBAL::nv_nlm_kernels_neon()
+{
+	return &g_neon;
+}
+
+#else
+
+const NAVIE_GLOBAL::nvNLMKernels* NAVIE_GLOBAL::nv_nlm_kernels_neon()
+{
+	return nullptr;
+}
+
+#endif
@@ -0,0 +1,89 @@
+#include "nvkernels.h"
+
+#include <cmath>
+#include <limits>
+
+namespace
+{
+	/* Same arithmetic as the per pixel loop of non_local_mean, so the results are bit identical. */
+	/* PATCH is the patch size, 0 reads it from the block */
+	template<int PATCH>
+	void accumulate_scalar(const NAVIE_GLOBAL::nvNLMBlock& block)
+	{
+		const int patch_size = PATCH ? PATCH : block.patch_size;
+
+		//fast weights: candidates past max_dist get no weight, the others the polynomial exp
+		const bool reject	= block.max_dist < std::numeric_limits<float>::infinity();
+		const float scale	= float(-1.0 / block.h2);
+
+		for(int k = 0; k < block.count; ++k)
+		{
+			float weight[3] = { 0.0f, 0.0f, 0.0f };
+			float guide_dist = 0.0f;
+			bool rejected = false;
+			for(int b = 0; b < patch_size && !rejected; ++b)
+			{
+				const int row = b * block.stride + k;
+				for(int a = 0; a < patch_size; ++a)
+				{
+					for(int dim = 0; dim < 3; ++dim)
+					{
+						const float diff = block.p[dim][row + a] - block.q[dim][row + a];
+						weight[dim] += diff * diff;
+					}
+					for(int g = 0; g < block.guides; ++g)
+					{
+						const float diff = block.gp[g][row + a] - block.gq[g][row + a];
+						guide_dist += block.gweight[g] * (diff * diff);
+					}
+				}
+
+				if(reject)
+					rejected = weight[0] + guide_dist > block.max_dist && weight[1] + guide_dist > block.max_dist && weight[2] + guide_dist > block.max_dist;
+			}
+			if(rejected)
+				continue;
+
+			for(int dim = 0; dim < 3; ++dim)
+			{
+				if(block.guides)
+					weight[dim] += guide_dist;
+				if(reject)
+					weight[dim] = weight[dim] > block.max_dist ? 0.0f : NAVIE_GLOBAL::nv_exp_negative(weight[dim] * scale);
+				else
+					weight[dim] = exp(-weight[dim] / block.h2);
+				block.norm[dim][k]	+= weight[dim];
+				block.out[dim][k]	+= weight[dim] * block.c[dim][k];
+			}
+		}
+	}
+
+	void to_half_scalar(const float* src, unsigned short* dst, size_t count)
+	{
+		for(size_t i = 0; i < count; ++i)
+			dst[i] = NAVIE_GLOBAL::nv_float_to_half(src[i]);
+	}
+
+	void squared_diff_scalar(const float* p, const float* q, float weight, float* acc, int count)
+	{
+		for(int i = 0; i < count; ++i)
+		{
+			const float diff = p[i] - q[i];
+			acc[i] = acc[i] + weight * (diff * diff);
+		}
+	}
+
+	void exp_scalar(const float* x, float* y, int count)
+	{
+		for(int i = 0; i < count; ++i)
+			y[i] = NAVIE_GLOBAL::nv_exp_negative(x[i]);
+	}
+
+	const NAVIE_GLOBAL::nvNLMKernels g_scalar = { NLM_ISA_SCALAR, "scalar", 1, accumulate_scalar<0>,
+		{ accumulate_scalar<3>, accumulate_scalar<5>, accumulate_scalar<7> }, to_half_scalar, squared_diff_scalar, exp_scalar };
+}
+
+const NAVIE_GLOBAL::nvNLMKernels* NAVIE_GLOBAL::nv_nlm_kernels_scalar()
+{
+	return &g_scalar;
+}
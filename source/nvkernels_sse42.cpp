@@ -0,0 +1,66 @@
+#include "nvkernels.h"
+
+/* MSVC accepts SSE4 intrinsics on x64 without an /arch switch, other compilers need -msse4.2 */
+#if defined(__SSE4_2__) || (defined(_MSC_VER) && defined(_M_X64))
+
+#include <nmmintrin.h>
+#include "nvkernels_impl.h"
+
+namespace
+{
+	struct SSE42
+	{
+		typedef __m128 type;
+		static const int width = 4;
+
+		static inline type zero()							{ return _mm_setzero_ps(); }
+		static inline type set1(float f)					{ return _mm_set1_ps(f); }
+		static inline type load(const float* p)				{ return _mm_loadu_ps(p); }
+		static inline void store(float* p, type v)			{ _mm_storeu_ps(p, v); }
+		static inline type add(type a, type b)				{ return _mm_add_ps(a, b); }
+		static inline type sub(type a, type b)				{ return _mm_sub_ps(a, b); }
+		static inline type mul(type a, type b)				{ return _mm_mul_ps(a, b); }
+		static inline type max(type a, type b)				{ return _mm_max_ps(a, b); }
+		static inline type round(type v)					{ return _mm_round_ps(v, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC); }
+		static inline type pow2(type n)						{ return _mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(_mm_cvtps_epi32(n), _mm_set1_epi32(127)), 23)); }
+		static inline type within(type v, type limit, type x)	{ return _mm_and_ps(_mm_cmple_ps(v, limit), x); }
+		static inline bool all_greater(type v, type limit)	{ return _mm_movemask_ps(_mm_cmpgt_ps(v, limit)) == 0xf; }
+		static inline void store_half(unsigned short* p, type v)
+		{
+			//no conversion instruction before F16C, nv_float_to_half on all lanes at once
+			const __m128i bits		= _mm_castps_si128(v);
+			const __m128i sign		= _mm_and_si128(bits, _mm_set1_epi32(int(0x80000000u)));
+			const __m128i magnitude	= _mm_xor_si128(bits, sign);
+
+			const __m128i nan		= _mm_cmpgt_epi32(magnitude, _mm_set1_epi32(0x7f800000));
+			const __m128i overflow	= _mm_cmpgt_epi32(magnitude, _mm_set1_epi32(0x477fffff));
+			const __m128i subnormal	= _mm_cmplt_epi32(magnitude, _mm_set1_epi32(0x38800000));
+
+			const __m128i infinity	= _mm_or_si128(_mm_set1_epi32(0x7c00), _mm_and_si128(nan, _mm_set1_epi32(0x0200)));
+			const __m128i small		= _mm_sub_epi32(_mm_castps_si128(_mm_add_ps(_mm_castsi128_ps(magnitude), _mm_set1_ps(0.5f))), _mm_set1_epi32(0x3f000000));
+			const __m128i odd		= _mm_and_si128(_mm_srli_epi32(magnitude, 13), _mm_set1_epi32(1));
+			const __m128i normal	= _mm_srli_epi32(_mm_add_epi32(_mm_add_epi32(magnitude, _mm_set1_epi32(int(0xc8000fffu))), odd), 13);
+
+			__m128i half = _mm_blendv_epi8(normal, small, subnormal);
+			half = _mm_blendv_epi8(half, infinity, overflow);
+			half = _mm_or_si128(half, _mm_srli_epi32(sign, 16));
+			_mm_storel_epi64((__m128i*)p, _mm_packus_epi32(half, half));
+		}
+	};
+
+	const NAVIE_GLOBAL::nvNLMKernels g_sse42 = NV_NLM_KERNELS(NLM_ISA_SSE42, "sse4.2", SSE42);
+}
+
+const NAVIE_GLOBAL::nvNLMKernels* NAVIE_GLOBAL::nv_nlm_kernels_sse42()
+{
+	return &g_sse42;
+}
+
+#else
+
+const NAVIE_GLOBAL::nvNLMKernels* NAVIE_GLOBAL::nv_nlm_kernels_sse42()
+{
+	return nullptr;
+}
+
+#endif
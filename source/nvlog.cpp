@@ -0,0 +1,24 @@
+#include "nvlog.h"
+
+#include <cstdarg>
+#include <cstdio>
+
+#ifdef CINEMA4D
+#include "c4d_general.h"
+#endif
+
+void NAVIE_GLOBAL::nv_log(const char* format, ...)
+{
+	char message[1024];
+
+	va_list args;
+	va_start(args, format);
+	vsnprintf(message, sizeof(message), format, args);
+	va_end(args);
+
+#ifdef CINEMA4D
+	GePrint(message);
+#else
+	fprintf(stderr, "%s\n", message);
+#endif
+}
@@ -0,0 +1,11 @@
+#ifndef NVLOG_H_
+#define NVLOG_H_
+
+namespace NAVIE_GLOBAL
+{
+	/* printf style diagnostics. Goes to the Cinema 4D console inside the plugin (CINEMA4D defined) */
+	/* and to stderr everywhere else */
+	void nv_log(const char* format, ...);
+}
+
+#endif
@@ -0,0 +1,23 @@
+#include "nvpool.h"
+
+#include <atomic>
+
+namespace
+{
+	std::atomic<unsigned long long> g_allocations(0);
+	std::atomic<unsigned long long> g_bytes(0);
+}
+
+NAVIE_GLOBAL::nvPoolCounters NAVIE_GLOBAL::nv_pool_counters()
+{
+	nvPoolCounters counters;
+	counters.allocations	= g_allocations;
+	counters.bytes			= g_bytes;
+	return counters;
+}
+
+void NAVIE_GLOBAL::nv_pool_count(size_t bytes)
+{
+	++g_allocations;
+	g_bytes += bytes;
+}
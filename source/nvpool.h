@@ -0,0 +1,84 @@
+#ifndef NVPOOL_H_
+#define NVPOOL_H_
+
+#include <cstddef>
+#include <type_traits>
+#include <vector>
+
+namespace NAVIE_GLOBAL
+{
+	/****************************************************************************/
+	/* Frame persistent buffers													*/
+	/*																			*/
+	/* Everything the denoiser needs for a frame (band and pyramid images,		*/
+	/* worker scratch, OpenCL staging and device buffers) is kept between		*/
+	/* frames and only grows. Growing goes through the functions below, which	*/
+	/* count it, so a frame of a size and settings seen before must leave the	*/
+	/* counters unchanged. nvdenoise_bench --verify checks that, together with	*/
+	/* the heap allocations of the whole process.								*/
+	/****************************************************************************/
+	struct nvPoolCounters
+	{
+		unsigned long long	allocations;	// buffers allocated or grown
+		unsigned long long	bytes;			// bytes of those allocations
+	};
+
+	/* Counters since process start, of all denoisers */
+	nvPoolCounters nv_pool_counters();
+
+	/* Records an allocation of bytes */
+	void nv_pool_count(size_t bytes);
+
+	/* Makes room for count elements, counting the growth */
+	template<class T>
+	void nv_pool_reserve(std::vector<T>& buffer, size_t count)
+	{
+		if(count <= buffer.capacity())
+			return;
+		nv_pool_count(count * sizeof(T));
+		buffer.reserve(count);
+	}
+
+	/* Resizes buffer to count elements, counting the growth */
+	template<class T>
+	void nv_pool_resize(std::vector<T>& buffer, size_t count)
+	{
+		nv_pool_reserve(buffer, count);
+		buffer.resize(count);
+	}
+
+	/* Sets buffer to count copies of value, counting the growth */
+	template<class T>
+	void nv_pool_assign(std::vector<T>& buffer, size_t count, const T& value)
+	{
+		nv_pool_reserve(buffer, count);
+		buffer.assign(count, value);
+	}
+
+	/* Non owning reference to a callable, for callbacks that only live during the call they are passed */
+	/* to. Unlike std::function it never allocates */
+	template<class Signature>
+	class nvFunctionRef;
+
+	template<class R, class... Args>
+	class nvFunctionRef<R(Args...)>
+	{
+	public:
+		template<class F, class = typename std::enable_if<!std::is_same<F, nvFunctionRef>::value>::type>
+		nvFunctionRef(const F& function)
+			: m_function(&function), m_call(&call<F>)
+		{
+		}
+
+		R operator()(Args... args) const { return m_call(m_function, args...); }
+
+	private:
+		template<class F>
+		static R call(const void* function, Args... args) { return (*static_cast<const F*>(function))(args...); }
+
+		const void*	m_function;
+		R			(*m_call)(const void*, Args...);
+	};
+}
+
+#endif
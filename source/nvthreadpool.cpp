@@ -0,0 +1,174 @@
+#include "nvthreadpool.h"
+
+#include <algorithm>
+
+NAVIE_GLOBAL::nvThreadPool::nvThreadPool(int threads)
+	: m_size(0), m_requested(-1), m_function(nullptr), m_generation(0), m_active(0), m_quit(false)
+{
+	set_threads(threads);
+}
+
+NAVIE_GLOBAL::nvThreadPool::~nvThreadPool()
+{
+	stop();
+}
+
+int NAVIE_GLOBAL::nvThreadPool::resolve_threads(int threads)
+{
+	if(threads > 0)
+		return threads;
+
+	const int hardware = int(std::thread::hardware_concurrency());
+	return hardware > 0 ? hardware : 1;
+}
+
+void NAVIE_GLOBAL::nvThreadPool::set_threads(int threads)
+{
+	if(threads == m_requested)
+		return;
+
+	std::lock_guard<std::mutex> job(m_job_lock);
+	stop();
+	start(threads);
+}
+
+void NAVIE_GLOBAL::nvThreadPool::start(int threads)
+{
+	m_requested = threads;
+	m_size		= resolve_threads(threads);
+	m_quit		= false;
+
+	m_queues.clear();
+	for(int i = 0; i < m_size; ++i)
+	{
+		m_queues.emplace_back(new TileQueue());
+		m_queues.back()->front = 0;
+	}
+
+	//the generation survives restarts, new workers wait for the next job and not for the last one
+	unsigned generation;
+	{
+		std::lock_guard<std::mutex> guard(m_lock);
+		generation = m_generation;
+	}
+
+	//worker 0 is the thread calling parallel_tiles
+	for(int i = 1; i < m_size; ++i)
+		m_threads.emplace_back(&nvThreadPool::worker_main, this, i, generation);
+}
+
+void NAVIE_GLOBAL::nvThreadPool::stop()
+{
+	{
+		std::lock_guard<std::mutex> guard(m_lock);
+		m_quit = true;
+	}
+	m_wake.notify_all();
+
+	for(size_t i = 0; i < m_threads.size(); ++i)
+		m_threads[i].join();
+	m_threads.clear();
+}
+
+void NAVIE_GLOBAL::nvThreadPool::parallel_tiles(const nvRect& area, int tile_width, int tile_height, const TileFunction& function)
+{
+	if(area.width <= 0 || area.height <= 0)
+		return;
+
+	std::lock_guard<std::mutex> job(m_job_lock);
+
+	tile_width	= std::max(tile_width, 1);
+	tile_height	= std::max(tile_height, 1);
+
+	const int tiles_x	= (area.width + tile_width - 1) / tile_width;
+	const int tiles_y	= (area.height + tile_height - 1) / tile_height;
+	const int tiles		= tiles_x * tiles_y;
+
+	//hand every worker a contiguous run of tiles (row major) so neighbouring tiles share cache
+	for(int t = 0, worker = 0; worker < m_size; ++worker)
+	{
+		const int end = int((long long)tiles * (worker + 1) / m_size);
+		TileQueue& queue = *m_queues[worker];
+		queue.tiles.clear();
+		queue.front = 0;
+		nv_pool_reserve(queue.tiles, size_t(end - t));
+		for(; t < end; ++t)
+		{
+			nvRect tile;
+			tile.x		= area.x + (t % tiles_x) * tile_width;
+			tile.y		= area.y + (t / tiles_x) * tile_height;
+			tile.width	= std::min(tile_width, area.x + area.width - tile.x);
+			tile.height	= std::min(tile_height, area.y + area.height - tile.y);
+			queue.tiles.push_back(tile);
+		}
+	}
+
+	{
+		std::lock_guard<std::mutex> guard(m_lock);
+		m_function	= &function;
+		m_active	= m_size - 1;
+		++m_generation;
+	}
+	m_wake.notify_all();
+
+	run_tiles(0);
+
+	std::unique_lock<std::mutex> guard(m_lock);
+	m_done.wait(guard, [this] { return m_active == 0; });
+	m_function = nullptr;
+}
+
+void NAVIE_GLOBAL::nvThreadPool::worker_main(int worker, unsigned generation)
+{
+	for(;;)
+	{
+		{
+			std::unique_lock<std::mutex> guard(m_lock);
+			m_wake.wait(guard, [&] { return m_quit || m_generation != generation; });
+			if(m_quit)
+				return;
+			generation = m_generation;
+		}
+
+		run_tiles(worker);
+
+		std::lock_guard<std::mutex> guard(m_lock);
+		if(--m_active == 0)
+			m_done.notify_one();
+	}
+}
+
+void NAVIE_GLOBAL::nvThreadPool::run_tiles(int worker)
+{
+	nvRect tile;
+	while(pop_tile(worker, tile))
+		(*m_function)(tile, worker);
+}
+
+bool NAVIE_GLOBAL::nvThreadPool::pop_tile(int worker, nvRect& tile)
+{
+	//own queue first, from the front
+	{
+		TileQueue& own = *m_queues[worker];
+		std::lock_guard<std::mutex> guard(own.lock);
+		if(own.front < own.tiles.size())
+		{
+			tile = own.tiles[own.front++];
+			return true;
+		}
+	}
+
+	//steal from the back of the others, which is the work their owner would reach last
+	for(int i = 1; i < m_size; ++i)
+	{
+		TileQueue& victim = *m_queues[(worker + i) % m_size];
+		std::lock_guard<std::mutex> guard(victim.lock);
+		if(victim.front < victim.tiles.size())
+		{
+			tile = victim.tiles.back();
+			victim.tiles.pop_back();
+			return true;
+		}
+	}
+	return false;
+}
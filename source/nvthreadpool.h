@@ -0,0 +1,82 @@
+#ifndef NVTHREADPOOL_H_
+#define NVTHREADPOOL_H_
+
+#include "nvimage.h"
+#include "nvpool.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace NAVIE_GLOBAL
+{
+	/****************************************************************************/
+	/* Persistent worker pool with 2D tile work stealing						*/
+	/*																			*/
+	/* The threads are created once and sleep between jobs, so the pool can		*/
+	/* be kept alive across frames. A job splits a rectangle into tiles, every	*/
+	/* worker starts on its own contiguous run of tiles and steals from the		*/
+	/* back of the other queues once it runs dry. This balances the cheap		*/
+	/* border tiles against the expensive interior ones.						*/
+	/*																			*/
+	/* The calling thread takes part as worker 0. The worker index passed to	*/
+	/* the tile function is stable for the duration of a job, so callers can	*/
+	/* keep per worker scratch memory indexed by it. Once the queues have held	*/
+	/* the tiles of a job, jobs of the same size or smaller do not allocate.	*/
+	/****************************************************************************/
+	class nvThreadPool
+	{
+	public:
+		typedef nvFunctionRef<void(const nvRect& tile, int worker)> TileFunction;
+
+		/* threads = 0 uses one worker per hardware thread */
+		explicit nvThreadPool(int threads = 0);
+		~nvThreadPool();
+
+		/* Restarts the workers if the requested count differs from the current one */
+		void set_threads(int threads);
+
+		/* Number of workers (including the calling thread) */
+		int size() const { return m_size; }
+
+		/* Splits area into tiles of at most tile_width x tile_height and blocks until all are done */
+		void parallel_tiles(const nvRect& area, int tile_width, int tile_height, const TileFunction& function);
+
+		/* Resolves a configured thread count (0 = auto) */
+		static int resolve_threads(int threads);
+
+	private:
+		/* Tiles of one worker, tiles[front, end) are left */
+		struct TileQueue
+		{
+			std::mutex			lock;
+			std::vector<nvRect>	tiles;
+			size_t				front;
+		};
+
+		void start(int threads);
+		void stop();
+		void worker_main(int worker, unsigned generation);
+		void run_tiles(int worker);
+		bool pop_tile(int worker, nvRect& tile);
+
+		int										m_size;
+		int										m_requested;
+		std::vector<std::thread>				m_threads;
+		std::vector<std::unique_ptr<TileQueue>>	m_queues;
+
+		std::mutex								m_job_lock;		// one job at a time
+		std::mutex								m_lock;
+		std::condition_variable					m_wake;
+		std::condition_variable					m_done;
+		const TileFunction*						m_function;
+		unsigned								m_generation;
+		int										m_active;		// workers still inside the current job
+		bool									m_quit;
+	};
+}
+
+#endif
@@ -0,0 +1,257 @@
+#include "nvtrace.h"
+#include "nvlog.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+namespace
+{
+	using namespace NAVIE_GLOBAL;
+
+	/* Events kept before new ones are dropped, about 50 MB */
+	const size_t MAX_EVENTS = 1 << 20;
+
+	const std::chrono::steady_clock::time_point g_origin = std::chrono::steady_clock::now();
+
+	/* Small ids of the host threads for the trace */
+	std::atomic<int> g_next_thread(1);
+
+	/* The frame of the current thread, plain data so it needs no allocation */
+	struct nvThreadFrame
+	{
+		int				tid;
+		int				depth;		// nested NV_TRACE_FRAME scopes
+		double			start;
+		nvTraceFrame	frame;
+	};
+
+	/* Zero initialized, VS2013 has no thread_local but __declspec(thread) */
+#ifdef _MSC_VER
+	__declspec(thread) nvThreadFrame t_frame;
+#else
+	thread_local nvThreadFrame t_frame;
+#endif
+
+	int thread_id()
+	{
+		if(!t_frame.tid)
+			t_frame.tid = g_next_thread++;
+		return t_frame.tid;
+	}
+
+	/* Adds to the stage totals of the frame of this thread */
+	void accumulate(const char* name, double seconds, unsigned long long bytes, unsigned long long pixels)
+	{
+		if(!t_frame.depth)
+			return;
+
+		nvTraceFrame& frame = t_frame.frame;
+		int s = 0;
+		while(s < frame.stage_count && strcmp(frame.stages[s].name, name))
+			++s;
+		if(s == nvTraceFrame::MAX_STAGES)
+			return;
+		if(s == frame.stage_count)
+		{
+			const nvTraceStage empty = { name, 0.0, 0, 0, 0 };
+			frame.stages[frame.stage_count++] = empty;
+		}
+
+		nvTraceStage& stage = frame.stages[s];
+		stage.seconds	+= seconds;
+		stage.bytes		+= bytes;
+		stage.pixels	+= pixels;
+		stage.calls++;
+	}
+
+	/* "1.5 MB" style sizes for the frame summaries */
+	void format_bytes(char* text, size_t size, unsigned long long bytes)
+	{
+		if(bytes >= 1024ull * 1024)
+			snprintf(text, size, " %.1f MB", bytes / (1024.0 * 1024.0));
+		else
+			snprintf(text, size, " %.1f KB", bytes / 1024.0);
+	}
+}
+
+const NAVIE_GLOBAL::nvTraceStage* NAVIE_GLOBAL::nvTraceFrame::stage(const char* name) const
+{
+	for(int s = 0; s < stage_count; ++s)
+	{
+		if(!strcmp(stages[s].name, name))
+			return &stages[s];
+	}
+	return nullptr;
+}
+
+NAVIE_GLOBAL::nvTrace::nvTrace()
+	: m_enabled(false), m_log_frames(true), m_dropped(0), m_last_frame(), m_has_last_frame(false)
+{
+	const char* path = getenv("NVDENOISE_TRACE");
+	if(path && *path)
+		enable(path);
+}
+
+NAVIE_GLOBAL::nvTrace& NAVIE_GLOBAL::nvTrace::instance()
+{
+	static nvTrace trace;
+	return trace;
+}
+
+void NAVIE_GLOBAL::nvTrace::enable(const std::string& path)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_path = path;
+	m_enabled = true;
+}
+
+void NAVIE_GLOBAL::nvTrace::disable()
+{
+	m_enabled = false;
+}
+
+double NAVIE_GLOBAL::nvTrace::now() const
+{
+	return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - g_origin).count();
+}
+
+void NAVIE_GLOBAL::nvTrace::add(const char* name, double start, double duration, unsigned long long bytes, unsigned long long pixels, int track)
+{
+	if(!enabled())
+		return;
+
+	//device commands go to a process of their own, one thread per queue
+	const Event event = { name, start, duration, bytes, pixels, track == NV_TRACE_HOST ? 1 : 2, track == NV_TRACE_HOST ? thread_id() : track };
+	accumulate(name, duration * 1e-6, bytes, pixels);
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if(m_events.size() >= MAX_EVENTS)
+	{
+		++m_dropped;
+		return;
+	}
+	m_events.push_back(event);
+}
+
+void NAVIE_GLOBAL::nvTrace::begin_frame(int number)
+{
+	if(t_frame.depth++)
+		return;
+
+	t_frame.start				= now();
+	t_frame.frame.number		= number;
+	t_frame.frame.seconds		= 0.0;
+	t_frame.frame.stage_count	= 0;
+}
+
+void NAVIE_GLOBAL::nvTrace::end_frame()
+{
+	if(--t_frame.depth)
+		return;
+
+	nvTraceFrame& frame = t_frame.frame;
+	frame.seconds = (now() - t_frame.start) * 1e-6;
+
+	//one line per frame, the stages in the order they ran
+	if(m_log_frames)
+	{
+		char line[1024];
+		int length = snprintf(line, sizeof(line), "nvDenoise: frame %d %.3f s:", frame.number, frame.seconds);
+		for(int s = 0; s < frame.stage_count && length < int(sizeof(line)); ++s)
+		{
+			const nvTraceStage& stage = frame.stages[s];
+			char bytes[32] = "", pixels[32] = "";
+			if(stage.bytes)
+				format_bytes(bytes, sizeof(bytes), stage.bytes);
+			if(stage.pixels)
+				snprintf(pixels, sizeof(pixels), " %.2f Mpx", stage.pixels * 1e-6);
+			length += snprintf(line + length, sizeof(line) - length, "%s %s %.3f s%s%s", s ? "," : "", stage.name, stage.seconds, bytes, pixels);
+		}
+		nv_log("%s", line);
+	}
+
+	std::string path;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_last_frame		= frame;
+		m_has_last_frame	= true;
+		path				= m_path;
+	}
+	if(!path.empty())
+		write(path);
+}
+
+bool NAVIE_GLOBAL::nvTrace::last_frame(nvTraceFrame& frame) const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	frame = m_last_frame;
+	return m_has_last_frame;
+}
+
+bool NAVIE_GLOBAL::nvTrace::write(const std::string& path) const
+{
+	FILE* file = fopen(path.c_str(), "wb");
+	if(!file)
+	{
+		nv_log("nvDenoise: could not write the trace %s", path.c_str());
+		return false;
+	}
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	fprintf(file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"nvDenoise host\"}},\n");
+	fprintf(file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":2,\"args\":{\"name\":\"OpenCL device\"}},\n");
+	static const char* queues[] = { "compute queue", "upload queue", "download queue" };
+	for(int q = 0; q < 3; ++q)
+		fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":2,\"tid\":%d,\"args\":{\"name\":\"%s\"}},\n", NV_TRACE_DEVICE_COMPUTE + q, queues[q]);
+
+	for(size_t e = 0; e < m_events.size(); ++e)
+	{
+		const Event& event = m_events[e];
+		fprintf(file, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"bytes\":%llu,\"pixels\":%llu}},\n",
+				event.name, event.pid, event.tid, event.start, event.duration, event.bytes, event.pixels);
+	}
+	fprintf(file, "{\"name\":\"dropped events\",\"ph\":\"M\",\"pid\":1,\"args\":{\"count\":%llu}}\n]}\n", (unsigned long long)m_dropped);
+	return fclose(file) == 0;
+}
+
+void NAVIE_GLOBAL::nvTrace::clear()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_events.clear();
+	m_dropped			= 0;
+	m_has_last_frame	= false;
+}
+
+NAVIE_GLOBAL::nvTraceScope::nvTraceScope(const char* name)
+	: m_name(name), m_start(-1.0), m_bytes(0), m_pixels(0)
+{
+	nvTrace& trace = nvTrace::instance();
+	if(trace.enabled())
+		m_start = trace.now();
+}
+
+void NAVIE_GLOBAL::nvTraceScope::end()
+{
+	if(m_start < 0.0)
+		return;
+
+	nvTrace& trace = nvTrace::instance();
+	trace.add(m_name, m_start, trace.now() - m_start, m_bytes, m_pixels);
+	m_start = -1.0;
+}
+
+NAVIE_GLOBAL::nvTraceFrameScope::nvTraceFrameScope(int number)
+	: m_active(nvTrace::instance().enabled())
+{
+	if(m_active)
+		nvTrace::instance().begin_frame(number);
+}
+
+NAVIE_GLOBAL::nvTraceFrameScope::~nvTraceFrameScope()
+{
+	if(m_active)
+		nvTrace::instance().end_frame();
+}
@@ -0,0 +1,171 @@
+#ifndef NVTRACE_H_
+#define NVTRACE_H_
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace NAVIE_GLOBAL
+{
+	/****************************************************************************/
+	/* Pipeline instrumentation													*/
+	/*																			*/
+	/* Stages of a frame (copy in, kernel compilation, filter, OpenCL copies,	*/
+	/* copy out) are timed with the NV_TRACE_* macros below. Every stage is		*/
+	/* an event with its wall clock span, the bytes it moved and the pixels it	*/
+	/* processed. OpenCL commands are added with their device profiling times,	*/
+	/* aligned to the host clock at the end of the last command.				*/
+	/*																			*/
+	/* A frame is the outermost NV_TRACE_FRAME scope of a thread, nested ones	*/
+	/* (a band of a streamed frame, a pyramid level) count towards it. At its	*/
+	/* end the per stage totals are logged and, with an output file, the		*/
+	/* Chrome trace-event JSON (chrome://tracing, Perfetto) is rewritten, so	*/
+	/* a render that is killed still leaves the trace of its finished frames.	*/
+	/*																			*/
+	/* Builds without USE_TRACE compile the macros to nothing. With it,			*/
+	/* tracing is off until enable() is called (nvdenoise_cli --trace, or the	*/
+	/* NVDENOISE_TRACE environment variable naming the output file), and a		*/
+	/* disabled scope costs one relaxed atomic load.							*/
+	/****************************************************************************/
+
+	/* Totals of a stage within a frame */
+	struct nvTraceStage
+	{
+		const char*			name;
+		double				seconds;
+		unsigned long long	bytes;
+		unsigned long long	pixels;
+		unsigned int		calls;
+	};
+
+	/* Stages of one frame in the order they first ran */
+	struct nvTraceFrame
+	{
+		enum { MAX_STAGES = 24 };
+
+		int				number;		// frame number given to NV_TRACE_FRAME, -1 if unknown
+		double			seconds;	// wall clock of the whole frame
+		int				stage_count;
+		nvTraceStage	stages[MAX_STAGES];
+
+		/* Stage called name, nullptr if it did not run */
+		const nvTraceStage* stage(const char* name) const;
+	};
+
+	/* Event tracks of the Chrome trace besides the host threads */
+	enum nvTraceTrack
+	{
+		NV_TRACE_HOST				= 0,	// the recording thread
+		NV_TRACE_DEVICE_COMPUTE		= 1,	// OpenCL queues
+		NV_TRACE_DEVICE_UPLOAD		= 2,
+		NV_TRACE_DEVICE_DOWNLOAD	= 3
+	};
+
+	class nvTrace
+	{
+	public:
+		/* Process wide recorder, enabled here if NVDENOISE_TRACE is set */
+		static nvTrace& instance();
+
+		/* Starts recording. With a path the Chrome trace is written there after every frame */
+		void enable(const std::string& path = std::string());
+		void disable();
+		bool enabled() const { return m_enabled.load(std::memory_order_relaxed); }
+
+		/* Logs the summary of every frame with nv_log (on by default) */
+		void set_log_frames(bool log) { m_log_frames = log; }
+
+		/* Microseconds since the recorder was created */
+		double now() const;
+
+		/* Records an event of the current thread (or a device track) and adds it to the frame of the thread */
+		void add(const char* name, double start, double duration, unsigned long long bytes, unsigned long long pixels, int track = NV_TRACE_HOST);
+
+		/* Opens and closes a frame of the current thread, nested frames only count as depth */
+		void begin_frame(int number);
+		void end_frame();
+
+		/* Summary of the last frame that ended on any thread, false if there was none */
+		bool last_frame(nvTraceFrame& frame) const;
+
+		/* Writes all events recorded so far as Chrome trace-event JSON */
+		bool write(const std::string& path) const;
+
+		/* Drops the recorded events */
+		void clear();
+
+	private:
+		nvTrace();
+
+		struct Event
+		{
+			const char*			name;
+			double				start;		// microseconds
+			double				duration;
+			unsigned long long	bytes;
+			unsigned long long	pixels;
+			int					pid;
+			int					tid;
+		};
+
+		std::atomic<bool>		m_enabled;
+		bool					m_log_frames;
+		std::string				m_path;
+		mutable std::mutex		m_mutex;
+		std::vector<Event>		m_events;
+		size_t					m_dropped;	// events beyond the capacity
+		nvTraceFrame			m_last_frame;
+		bool					m_has_last_frame;
+	};
+
+	/* Times the enclosing scope as one event */
+	class nvTraceScope
+	{
+	public:
+		explicit nvTraceScope(const char* name);
+		~nvTraceScope() { end(); }
+
+		void count(unsigned long long bytes, unsigned long long pixels) { m_bytes += bytes; m_pixels += pixels; }
+
+		/* Records the event now instead of at the end of the scope */
+		void end();
+
+	private:
+		const char*			m_name;
+		double				m_start;	// negative while tracing is off or once recorded
+		unsigned long long	m_bytes;
+		unsigned long long	m_pixels;
+	};
+
+	/* A frame of the enclosing scope */
+	class nvTraceFrameScope
+	{
+	public:
+		explicit nvTraceFrameScope(int number);
+		~nvTraceFrameScope();
+
+	private:
+		bool m_active;
+	};
+}
+
+#ifdef USE_TRACE
+#define NV_TRACE_CONCAT_(a, b)					a##b
+#define NV_TRACE_CONCAT(a, b)					NV_TRACE_CONCAT_(a, b)
+#define NV_TRACE_FRAME(number)					NAVIE_GLOBAL::nvTraceFrameScope NV_TRACE_CONCAT(nv_trace_frame_, __LINE__)(number)
+#define NV_TRACE_SCOPE(name)					NAVIE_GLOBAL::nvTraceScope NV_TRACE_CONCAT(nv_trace_scope_, __LINE__)(name)
+#define NV_TRACE_NAMED_SCOPE(scope, name)		NAVIE_GLOBAL::nvTraceScope scope(name)
+#define NV_TRACE_COUNT(scope, bytes, pixels)	scope.count(bytes, pixels)
+#define NV_TRACE_END(scope)						scope.end()
+#define NV_TRACE_ENABLED()						NAVIE_GLOBAL::nvTrace::instance().enabled()
+#else
+#define NV_TRACE_FRAME(number)
+#define NV_TRACE_SCOPE(name)
+#define NV_TRACE_NAMED_SCOPE(scope, name)
+#define NV_TRACE_COUNT(scope, bytes, pixels)
+#define NV_TRACE_END(scope)
+#define NV_TRACE_ENABLED()						false
+#endif
+
+#endif